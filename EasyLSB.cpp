@@ -3,13 +3,16 @@
 EasyLSB.cpp
 
 An encoder and decoder for messages hidden inside bitmap
-images by least significant bit steganography. Uses my 
-BitmapParser library.
+images by least significant bit steganography. Bitmaps
+are worked on in place in their file buffer (see carrier.h),
+and binary PGM and PPM images and PNG images are streamed
+(see row_stream.h).
 
-The first 16 least significant bits is the length field
-before the actual message bits. Length is expressed in
-chars of the message (i.e. bytes of the message since 
-sizeof(char) = 1 by standard). 
+The first 96 least significant bits is a versioned header
+(see payload.h) holding the length and checksum of the message
+bits that follow, which may be compressed. Images from earlier versions,
+where the first 16 bits are just the length in chars of the
+message, still decode.
 
 The style confroms to Google's coding style guide for C++,
 and has been checked with cpplint.
@@ -20,282 +23,926 @@ June 29, 2019
 
 #include "EasyLSB.h"
 
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "batch.h"
+#include "daemon.h"
+#include "lsb_kernel.h"
+#include "scan.h"
+#include "shard.h"
+
+// Streamed images are left alone, everything else is loaded into a Carrier.
+static std::unique_ptr<Carrier> open_carrier(const char* filename,
+    CarrierCache* cache = nullptr) {
+    if (RowReader::open(filename)) {
+        return nullptr;
+    }
+    return std::make_unique<Carrier>(filename, cache);
+}
+
 // Encode constructor
-EasyLSB::EasyLSB(const char* message, const char* filename_in,
-    const char* filename_out)
-    : BitmapParser(filename_in), outfile(filename_out),
-    msg(message), c(this) {
+EasyLSB::EasyLSB(const std::string& message, const char* filename_in,
+    const char* filename_out, CarrierCache* cache)
+    : infile(filename_in), outfile(filename_out), msg(message),
+    image(open_carrier(filename_in, cache)) {
     // Check compatibility first.
     check_size();
 }
 
+EasyLSB::EasyLSB(const std::string& message, const char* filename_in,
+    const char* filename_out, std::shared_ptr<const CachedImage> file)
+    : infile(filename_in), outfile(filename_out), msg(message),
+    image(std::make_unique<Carrier>(filename_in, std::move(file))) {
+    check_size();
+}
+
 // Decode constructor - leave outfile and msg blank.
 EasyLSB::EasyLSB(const char* filename_in)
-    : BitmapParser(filename_in), outfile(nullptr),
-    msg(""), c(this) {
+    : infile(filename_in), outfile(nullptr), msg(""),
+    image(open_carrier(filename_in)) {
     // Check compatibility first.
     check_size();
 }
 
 /*
-Make sure the image is large enough for the message.
-Steganography starts with 2 bytes (16 bits) for original
-message length in bytes, so original messsage can be up to
-2^16 - 1 chars = 65535 chars in length.
+Make sure the message isn't too long. The header has 32 bits for
+the length, so a message can be up to 2^32 - 1 chars in length.
+Whether the image is large enough is checked once the message has
+been compressed or otherwise transformed, as it is embedded.
 */
 void EasyLSB::check_size() const {
-    if (msg.length() * BITS_PER_BYTE + NUM_LENGTH_BITS >
-        read_infoheader().width * read_infoheader().height *
-        BITS_PER_BYTE) {
+    if (msg.length() > MAX_MSG_LENGTH) {
         throw std::runtime_error(
-            "Image is not large enough to hold message!\n");
-    } else if (msg.length() > MAX_MSG_LENGTH) {
+            "Message length exceeds maximum of 4294967295 chars!\n");
+    }
+}
+
+// Number of bits the image can hold: one per bit plane per channel.
+size_t EasyLSB::capacity() const {
+    if (image) {
+        return image->layout().num_channels() * image->layout().channel_bits;
+    }
+    std::unique_ptr<RowReader> reader = RowReader::open(infile);
+    return reader->num_channels() * reader->channel_bits();
+}
+
+/*
+The header followed by the (possibly compressed) message. Read most
+significant bit first, these are exactly the bits encode() writes
+channel by channel. Every bit plane of every channel can hold one
+bit, so 16 bit channels hold twice as much as 8 bit channels.
+*/
+std::vector<uint8_t> EasyLSB::build_stream() const {
+    std::vector<uint8_t> stream = build_payload(msg, payload_options);
+    if (stream.size() * BITS_PER_BYTE > capacity()) {
         throw std::runtime_error(
-            "Message length exceeds maximum of 65535 chars!\n");
+            "Image is not large enough to hold message!\n");
+    }
+    return stream;
+}
+
+size_t EasyLSB::stream_size(const std::vector<uint8_t>& prefix) const {
+    PayloadHeader header;
+    size_t size;
+    if (PayloadHeader::parse(prefix.data(), prefix.size(), &header)) {
+        size = header.stream_size();
+    } else if (payload_options.legacy &&
+        prefix.size() >= NUM_LENGTH_BITS / BITS_PER_BYTE) {
+        // An image from an earlier version: just the length of msg.
+        size = NUM_LENGTH_BITS / BITS_PER_BYTE +
+            (static_cast<size_t>(prefix[0]) << BITS_PER_BYTE | prefix[1]);
+    } else {
+        return 0;
+    }
+    // If it doesn't fit, it can't be a message.
+    return size * BITS_PER_BYTE > capacity() ? 0 : size;
+}
+
+void EasyLSB::read_stream(const std::vector<uint8_t>& stream) {
+    PayloadHeader header;
+    if (PayloadHeader::parse(stream.data(), stream.size(), &header)) {
+        decoded = header;
+        msg = read_payload(header, payload_options,
+            [&stream](size_t offset, uint8_t* data, size_t size) {
+            std::copy(stream.begin() + offset,
+                stream.begin() + offset + size, data);
+        });
+    } else if (payload_options.legacy &&
+        stream.size() >= NUM_LENGTH_BITS / BITS_PER_BYTE) {
+        msg.assign(stream.begin() + NUM_LENGTH_BITS / BITS_PER_BYTE,
+            stream.end());
+    } else {
+        msg.clear();
     }
 }
 
 /*
 Encodes a message inside the bitmap image.
-First 16 LSBs is the length of the message in chars = bytes.
+First 96 LSBs is the header, holding the length of the payload.
 Then each channel's LSB is overwritten in R,G,B order within a pixel,
-and left to right, top to bottom for the pixels vector.
-If the message is larger, the accessor rolls over to the red channel
-of _pixels[0][0] but writes the 2nd least significant bit this time.
+and left to right, top to bottom for the pixels.
+If the message is larger, it rolls over to the red channel of the
+top left pixel but writes the 2nd least significant bit this time.
 At the extreme case this will overwrite the most significant bit of the
 blue channel of the bottom right pixel of the image.
+16 bit channels work the same way, with 16 planes instead of 8.
 */
 void EasyLSB::encode() {
-    // Mask to grab the least significant bit from a byte.
-    const uint8_t MASK = 0b00000001;
-    // Complete the 16 bit length field.
-    uint16_t len = msg.length();
-    for (int shift = NUM_LENGTH_BITS - 1; shift >= 0; --shift) {
-        /*
-        Extract the bits of the message by masking with 0b00000001.
-        Shift right 7 bits for the most significant bit of the char,
-        6 bits for 2nd most significant, and so on.
-        */
-        uint8_t encoding_bit = ((len >> shift) & MASK);
-        // Replaces just at the location of the encoding bit.
-        c.replace_channel((c.get_channel() &
-            c.wrap_mask(c.get_wraparounds())) | encoding_bit);
-        // Advance to the next channel.
-        c.next_channel();
-    }
-    // Continue splitting bits for the chars in the message.
-    for (char letter : msg) {
-        for (int shift = BITS_PER_BYTE - 1; shift >= 0; --shift) {
-            // Shift again by # of wraparounds to get it in the right place.
-            uint8_t encoding_bit =
-                ((letter >> shift) & MASK) << c.get_wraparounds();
-            // Replaces just at the location of the encoding bit.
-            c.replace_channel((c.get_channel() &
-                c.wrap_mask(c.get_wraparounds())) | encoding_bit);
-            // Advance to the next channel.
-            c.next_channel();
-        }
+    if (!image) {
+        encode_stream();
+        return;
     }
-    // Length and msg encoded. Output the result.
-    save(outfile);
+    embed_message();
+    // Header and payload encoded. Output the result.
+    image->save(outfile, options);
+}
+
+/*
+Blocks of the payload are embedded as soon as they come out of the
+pipeline (see payload.h), and the header once the last one is in,
+so the transformed payload is never held in memory as a whole, short
+of the compressed blocks write_payload() keeps to compare.
+The kernel writes straight into the rows of the file buffer.
+*/
+void EasyLSB::embed_message() {
+    write_payload(msg, payload_options,
+        [this](size_t offset, const uint8_t* data, size_t size) {
+        embed_range(offset, data, size);
+    });
+}
+
+/*
+Unlike encode(), the payload is built whole before any of it is
+embedded, since the parts are cut by rows, not by blocks of payload.
+In a keyed order the used rows can be anywhere, so all are loaded.
+*/
+size_t EasyLSB::begin_parts(size_t part_bytes) {
+    if (!image) {
+        return 0;
+    }
+    parts_stream = build_stream();
+    const RasterLayout& raster = image->layout();
+    parts_layout = raster.stream_layout(parts_stream.size() * BITS_PER_BYTE);
+    parts_layout.order = channel_order(raster.rows, raster.row_channels);
+    used_rows = (last_stream_channel(parts_layout) + raster.row_channels - 1) /
+        raster.row_channels;
+    image->load_rows(parts_layout.order ? raster.rows : used_rows);
+    part_rows = std::max<size_t>(1, part_bytes / raster.stride);
+    return (used_rows + part_rows - 1) / part_rows;
+}
+
+void EasyLSB::embed_part(size_t part) {
+    image->embed_rows(parts_layout, parts_stream.data(), part * part_rows,
+        std::min(used_rows, (part + 1) * part_rows));
+}
+
+void EasyLSB::finish_parts() {
+    image->save(outfile, options);
+    parts_stream.clear();
+}
+
+void EasyLSB::embed_range(size_t offset, const uint8_t* data, size_t size) {
+    StreamLayout layout =
+        image->layout().stream_layout((offset + size) * BITS_PER_BYTE);
+    if (layout.stream_bits > capacity()) {
+        throw std::runtime_error(
+            "Image is not large enough to hold message!\n");
+    }
+    layout.first_bit = offset * BITS_PER_BYTE;
+    layout.order = channel_order(image->layout().rows,
+        image->layout().row_channels);
+    image->embed(layout, data);
+}
+
+void EasyLSB::extract_range(size_t offset, uint8_t* data, size_t size) {
+    StreamLayout layout =
+        image->layout().stream_layout((offset + size) * BITS_PER_BYTE);
+    layout.first_bit = offset * BITS_PER_BYTE;
+    layout.order = channel_order(image->layout().rows,
+        image->layout().row_channels);
+    std::fill(data, data + size, 0);
+    image->extract(layout, data);
+}
+
+/*
+The carrier kept the rows it embedded into as they were read, so
+the patch is just where the two differ: a few KB for a short message
+however large the image is. See patch.h.
+*/
+void EasyLSB::encode_patch() {
+    if (!image) {
+        throw std::runtime_error("Patches are only supported for bitmaps!\n");
+    }
+    embed_message();
+    image->diff().save(outfile, options);
+}
+
+/*
+Reads the bits the new stream would occupy first. Where they already
+match, as when rotating a token for another one of the same length,
+embedding leaves those bytes exactly as they were, so diffing the
+rows against how they were read gives just the channels that change,
+and only those are written, with a pwrite() per run of them.
+*/
+size_t EasyLSB::update() {
+    if (!image) {
+        throw std::runtime_error("Updates are only supported for bitmaps!\n");
+    }
+    const std::vector<uint8_t> stream = build_stream();
+    StreamLayout layout =
+        image->layout().stream_layout(stream.size() * BITS_PER_BYTE);
+    layout.order = channel_order(image->layout().rows,
+        image->layout().row_channels);
+    std::vector<uint8_t> existing(stream.size(), 0);
+    image->extract(layout, existing.data());
+    std::error_code ec;
+    const bool in_place = std::filesystem::equivalent(infile, outfile, ec);
+    if (existing == stream && in_place) {
+        return 0;
+    }
+    image->embed(layout, stream.data());
+    const Patch patch = image->diff();
+    patch.apply(infile, outfile, options);
+    return patch.changed_bytes();
+}
+
+bool EasyLSB::map_image() {
+    std::error_code ec;
+    if (!image ||
+        (outfile && !std::filesystem::equivalent(infile, outfile, ec))) {
+        return false;
+    }
+    image->map(outfile != nullptr);
+    return true;
+}
+
+bool EasyLSB::is_bitmap() const {
+    return image != nullptr;
 }
 
 /*
 Attempts to decode a message within a bitmap image using the reverse
-method of what encode() does. First reads the 16 LSBs for length, and proceeds
-to fuse 8 LSBs (or nth least significant if there is wraparound)
-into one char until the length is reached. Result is stored in msg.
-Note that running this on a regular bitmap image will most likely
-result in gibberish or no output.
+method of what encode() does. First reads the 96 LSBs for the header
+(or the 16 LSBs for the length, in images from earlier versions), and
+proceeds to fuse 8 LSBs (or nth least significant if there is
+wraparound) into one byte until the length is reached. The payload is
+checked against the header's checksum and decompressed if needed,
+and the result is stored in msg.
+A regular bitmap image is rejected after extracting the 16 LSBs that
+would hold the magic bytes, unless earlier versions' images are
+allowed, in which case it will most likely decode to gibberish.
 */
 void EasyLSB::decode() {
-    // Extract the length first.
-    uint16_t len = 0;
-    for (size_t i = 0; i < NUM_LENGTH_BITS; ++i) {
-        /*
-        Wraparounds is zero at start, but just for readability.
-        Isolates the least significant bit of current channel.
-        */
-        uint16_t bit = c.get_channel() & c.bitmask(c.get_wraparounds());
-        /*
-        First lsb must be shifted 15 left, second lsb shifted 14 left...
-        and the 16th lsb should not be shifted.
-        */
-        bit = bit << (NUM_LENGTH_BITS - 1 - i);
-        // Add this bit to build up len.
-        len = len | bit;
-        // Advance to the next channel.
-        c.next_channel();
-    }
-    // There are len chars = len * 8 bits in msg.
-    for (size_t i = 0; i < len; ++i) {
-        // Empty byte to be filled in.
-        unsigned char char_byte = 0;
-        // Assemble the next 8 bits.
-        for (size_t j = 0; j < BITS_PER_BYTE; ++j) {
-            /*
-            Isolate nth least sig bit of current channel, where n
-            is the number of wraparounds.
-            Shift by # of wraparounds to bring it to lsb position.
-            */
-            unsigned char bit = (c.get_channel() &
-                c.bitmask(c.get_wraparounds())) >> c.get_wraparounds();
-            // Shift based on order in the byte.
-            bit = bit << (BITS_PER_BYTE - 1 - j);
-            // Add this bit to build char_byte.
-            char_byte = char_byte | bit;
-            // Advance to the next channel.
-            c.next_channel();
+    if (!image) {
+        decode_stream();
+        return;
+    }
+    // Check for the magic bytes first.
+    std::vector<uint8_t> stream(std::min(PayloadHeader::MAGIC_SIZE,
+        capacity() / BITS_PER_BYTE), 0);
+    extract_range(0, stream.data(), stream.size());
+    check_magic(stream);
+    // Then the rest of the header.
+    stream.assign(std::min(PayloadHeader::MAX_SIZE,
+        capacity() / BITS_PER_BYTE), 0);
+    extract_range(0, stream.data(), stream.size());
+    const size_t size = stream_size(stream);
+    PayloadHeader header;
+    if (size > 0 &&
+        PayloadHeader::parse(stream.data(), stream.size(), &header)) {
+        // Then the payload, a block at a time.
+        decoded = header;
+        msg = read_payload(header, payload_options,
+            [this](size_t offset, uint8_t* data, size_t size) {
+            extract_range(offset, data, size);
+        });
+        return;
+    }
+    if (!payload_options.legacy) {
+        throw std::runtime_error("No message found in image!\n");
+    }
+    // An image from an earlier version, or no message at all.
+    stream.assign(size, 0);
+    extract_range(0, stream.data(), stream.size());
+    read_stream(stream);
+}
+
+/*
+The header comes first, as in decode(). Then, since where every bit
+of the stream is follows from its index, the reader only extracts
+the bytes of the payload it is asked for. A bitmap reads only the
+rows those are in, a Netpbm image seeks past the rest, and a PNG
+image still inflates everything up to the last of them. A scattered
+stream could be anywhere in a streamed image, so there it's
+extracted whole first (see decode_stream()), though still only the
+blocks asked for are decrypted and decompressed.
+*/
+bool EasyLSB::read_message(const MessageUser& use) {
+    std::unique_ptr<RowCursor> cursor;
+    std::vector<uint8_t> stream;
+    StreamReader read;
+    size_t limit = capacity() / BITS_PER_BYTE;
+    if (image) {
+        read = [this](size_t offset, uint8_t* data, size_t size) {
+            extract_range(offset, data, size);
+        };
+    } else if (!payload_options.scatter) {
+        cursor = std::make_unique<RowCursor>(infile, RANGE_CHUNK_BYTES);
+        read = [this, &cursor](size_t offset, uint8_t* data, size_t size) {
+            extract_rows(cursor.get(), offset, data, size);
+        };
+    } else {
+        stream.resize(PayloadHeader::MAX_SIZE);
+        extract_scattered(&stream);
+        check_magic(stream);
+        stream.resize(stream_size(stream));
+        extract_scattered(&stream);
+        limit = stream.size();
+        read = [&stream](size_t offset, uint8_t* data, size_t size) {
+            std::copy(stream.begin() + offset,
+                stream.begin() + offset + size, data);
+        };
+    }
+    std::vector<uint8_t> prefix(std::min(PayloadHeader::MAGIC_SIZE, limit),
+        0);
+    read(0, prefix.data(), prefix.size());
+    check_magic(prefix);
+    prefix.assign(std::min(PayloadHeader::MAX_SIZE, limit), 0);
+    read(0, prefix.data(), prefix.size());
+    PayloadHeader header;
+    if (stream_size(prefix) == 0 ||
+        !PayloadHeader::parse(prefix.data(), prefix.size(), &header)) {
+        if (!payload_options.legacy) {
+            throw std::runtime_error("No message found in image!\n");
         }
-        // Append this char to msg.
-        msg += char_byte;
+        return false;
     }
-    // Output the result.
-    std::cout << msg << std::endl;
+    PayloadReader reader(header, payload_options, read);
+    use(header, &reader);
+    return true;
 }
 
 /*
-Returns the appropriate bit mask for setting individual bits,
-depending on how many times the message has wrapped around the pixels.
+A message from before the header is decoded whole, and the range
+cut out of it.
 */
-inline uint8_t EasyLSB::ChannelAccessor::wrap_mask(size_t wraparounds) const {
-    switch (wraparounds) {
-    case 0:
-        return 0b11111110;
-    case 1:
-        return 0b11111101;
-    case 2:
-        return 0b11111011;
-    case 3:
-        return 0b11110111;
-    case 4:
-        return 0b11101111;
-    case 5:
-        return 0b11011111;
-    case 6:
-        return 0b10111111;
-    case 7:
-        return 0b01111111;
-    }
-    // So the compiler doesn't complain
-    return 0;
+void EasyLSB::decode_range(size_t offset, size_t length) {
+    if (read_message([&](const PayloadHeader&, PayloadReader* reader) {
+        msg = reader->read(offset, length);
+    })) {
+        return;
+    }
+    decode();
+    if (offset > msg.size() || length > msg.size() - offset) {
+        throw std::runtime_error("Range is outside the message!\n");
+    }
+    msg = msg.substr(offset, length);
+}
+
+// Throws unless header is that of an archive.
+static void check_archive(const PayloadHeader& header) {
+    if (!(header.flags & PAYLOAD_ARCHIVE)) {
+        throw std::runtime_error("Message is not an archive!\n");
+    }
+}
+
+std::vector<ArchiveEntry> EasyLSB::list_archive() {
+    std::vector<ArchiveEntry> entries;
+    if (!read_message([&](const PayloadHeader& header,
+        PayloadReader* reader) {
+        check_archive(header);
+        entries = read_archive_toc(reader);
+    })) {
+        throw std::runtime_error("Message is not an archive!\n");
+    }
+    return entries;
+}
+
+void EasyLSB::decode_file(const std::string& name) {
+    if (!read_message([&](const PayloadHeader& header,
+        PayloadReader* reader) {
+        check_archive(header);
+        msg = read_archive_file(reader, name);
+    })) {
+        throw std::runtime_error("Message is not an archive!\n");
+    }
+}
+
+const std::string& EasyLSB::message() const {
+    return msg;
+}
+
+const PayloadHeader& EasyLSB::decoded_header() const {
+    return decoded;
+}
+
+void EasyLSB::set_output_options(const OutputOptions& output_options) {
+    options = output_options;
+}
+
+void EasyLSB::set_payload_options(const PayloadOptions& options) {
+    payload_options = options;
+    order.reset();
 }
 
 /*
-Returns the appropriate bit mask for isolating individual bits
-from a channel, depending on how many wraps (rollovers) were
-used in the decoding process.
+Deriving the key takes a while, so the order is made the first time
+it is needed and then kept.
 */
-inline uint8_t EasyLSB::ChannelAccessor::bitmask(size_t wraparounds) const {
-    switch (wraparounds) {
-    case 0:
-        return 0b00000001;
-    case 1:
-        return 0b00000010;
-    case 2:
-        return 0b00000100;
-    case 3:
-        return 0b00001000;
-    case 4:
-        return 0b00010000;
-    case 5:
-        return 0b00100000;
-    case 6:
-        return 0b01000000;
-    case 7:
-        return 0b10000000;
-    }
-    // So the compiler doesn't complain
-    return 0;
-}
-
-// Constructor for channel accessor - ptr set to red channel of first pixel.
-EasyLSB::ChannelAccessor::ChannelAccessor(EasyLSB* easy)
-    : e(easy), row(0), col(0), wraparounds(0), color(Color::RED),
-    ptr(&(easy->pixels()[row][col].red)) {}
-
-// Accessor for getting the channel value.
-inline uint8_t EasyLSB::ChannelAccessor::get_channel() const {
-    return *ptr;
-}
-
-// Mutator for replacing the channel value.
-inline void EasyLSB::ChannelAccessor::replace_channel(uint8_t new_value) {
-    *ptr = new_value;
-}
-
-// Accessor for number of wraps that msg has done around pixels.
-inline size_t EasyLSB::ChannelAccessor::get_wraparounds() const {
-    return wraparounds;
-}
-
-// "Increments" to the next channel.
-void EasyLSB::ChannelAccessor::next_channel() {
-    switch (color) {
-    case Color::RED:
-        // Get the green channel of the current pixel.
-        color = Color::GREEN;
-        ptr = &(e->pixels()[row][col].green);
-        break;
-
-    case Color::GREEN:
-        // Get the blue channel of the current pixel.
-        color = Color::BLUE;
-        ptr = &(e->pixels()[row][col].blue);
-        break;
-
-    case Color::BLUE:
-        /*
-        Need to get the next pixel!
-        Case 1: if there is a pixel to the right, get it.
-        */
-        if (col < e->pixels()[0].size() - 1) {
-            ++col;
-        } else {
-            /*
-            Case 2: if there is no pixel to the right but
-            a pixel to the bottom, get the bottom left pixel.
-            */
-            if (row < e->pixels().size() - 1) {
-                ++row;
-                col = 0;
+const ChannelOrder* EasyLSB::channel_order(size_t rows,
+    size_t row_channels) {
+    if (!payload_options.scatter) {
+        return nullptr;
+    }
+    if (payload_options.secret.empty()) {
+        throw std::runtime_error(
+            "Scattering needs a passphrase or key file!\n");
+    }
+    if (!order) {
+        order = std::make_unique<ChannelOrder>(payload_options.secret,
+            rows, row_channels);
+    }
+    return order.get();
+}
+
+/*
+Same bits as encode(), but the image is read CHUNK_BYTES worth of
+rows at a time, embedded into in place by the kernel and written
+straight back out, so memory use doesn't grow with the image.
+A scattered stream is embedded a row at a time, into the rows whose
+place in the keyed order holds part of it.
+*/
+void EasyLSB::encode_stream() {
+    std::unique_ptr<RowReader> source = RowReader::open(infile);
+    RowReader& reader = *source;
+    const std::vector<uint8_t> stream = build_stream();
+    StreamLayout layout =
+        reader.stream_layout(stream.size() * BITS_PER_BYTE);
+    layout.order = channel_order(reader.rows(), reader.row_channels());
+    const size_t used_rows = (last_stream_channel(layout) +
+        reader.row_channels() - 1) / reader.row_channels();
+    /*
+    Writing over the input while it's still being read would truncate
+    it, so in that case write next to it and rename at the end.
+    */
+    std::error_code ec;
+    const bool in_place = std::filesystem::equivalent(infile, outfile, ec);
+    const std::string path =
+        in_place ? std::string(outfile) + ".tmp" : std::string(outfile);
+    std::unique_ptr<RowWriter> writer;
+    try {
+        writer = reader.create_writer(path.c_str(), options);
+        const size_t rows_per_chunk =
+            std::max<size_t>(1, CHUNK_BYTES / reader.row_bytes());
+        std::vector<uint8_t> chunk(rows_per_chunk * reader.row_bytes());
+        // Channel index of the first sample in chunk.
+        size_t first = 0;
+        size_t rows;
+        while ((rows = reader.read_rows(chunk.data(),
+            rows_per_chunk)) > 0) {
+            const size_t count = rows * reader.row_channels();
+            if (!layout.order) {
+                embed_samples(chunk.data(), first, count, layout,
+                    stream.data());
             } else {
-                /*
-                Case 3: if we reached the end of the image
-                (bottom right pixel), loop around and go to the
-                top left pixel.
-                */
-                row = 0;
-                col = 0;
-                // Need to increment wraparound.
-                ++wraparounds;
+                for (size_t r = 0; r < rows; ++r) {
+                    const size_t row = layout.order->logical_row(
+                        first / reader.row_channels() + r);
+                    if (row < used_rows) {
+                        layout.order->embed_row(
+                            chunk.data() + r * reader.row_bytes(), row,
+                            layout, stream.data());
+                    }
+                }
             }
+            writer->write_rows(chunk.data(), rows);
+            first += count;
+        }
+        writer->close();
+        if (in_place && std::rename(path.c_str(), outfile) != 0) {
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+    } catch (...) {
+        // Don't leave a half written image next to the input.
+        if (in_place) {
+            writer.reset();
+            std::remove(path.c_str());
+        }
+        throw;
+    }
+}
+
+void EasyLSB::check_magic(const std::vector<uint8_t>& prefix) const {
+    if (!payload_options.legacy &&
+        !PayloadHeader::has_magic(prefix.data(), prefix.size())) {
+        throw std::runtime_error("No message found in image!\n");
+    }
+}
+
+/*
+Streaming decode(). Only the rows holding the magic bytes are read
+before checking them, usually just the first. The header always fits
+in the first chunk, after which only the chunks up to the last channel
+holding a bit of the message are read; the rest of the image never is.
+A scattered stream can be anywhere, so the image is read up to the
+last row of the header, then again up to the last row of the stream.
+*/
+void EasyLSB::decode_stream() {
+    if (payload_options.scatter) {
+        std::vector<uint8_t> stream(PayloadHeader::MAX_SIZE);
+        extract_scattered(&stream);
+        check_magic(stream);
+        stream.resize(stream_size(stream));
+        extract_scattered(&stream);
+        if (stream.empty() && !payload_options.legacy) {
+            throw std::runtime_error("No message found in image!\n");
+        }
+        read_stream(stream);
+        return;
+    }
+    std::unique_ptr<RowReader> source = RowReader::open(infile);
+    RowReader& reader = *source;
+    const size_t rows_per_chunk =
+        std::max<size_t>(1, CHUNK_BYTES / reader.row_bytes());
+    std::vector<uint8_t> chunk(rows_per_chunk * reader.row_bytes());
+    const size_t stream_limit =
+        reader.num_channels() * reader.channel_bits() / BITS_PER_BYTE;
+    // Check for the magic bytes first.
+    std::vector<uint8_t> stream(std::min(PayloadHeader::MAGIC_SIZE,
+        stream_limit), 0);
+    StreamLayout layout =
+        reader.stream_layout(stream.size() * BITS_PER_BYTE);
+    const size_t magic_rows = std::min(rows_per_chunk,
+        (last_stream_channel(layout) + reader.row_channels() - 1) /
+        reader.row_channels());
+    size_t rows = reader.read_rows(chunk.data(), magic_rows);
+    extract_samples(chunk.data(), 0, rows * reader.row_channels(), layout,
+        stream.data());
+    check_magic(stream);
+    // Then the rest of the first chunk, and the header from it.
+    rows += reader.read_rows(chunk.data() + rows * reader.row_bytes(),
+        rows_per_chunk - rows);
+    size_t count = rows * reader.row_channels();
+    stream.assign(std::min(PayloadHeader::MAX_SIZE, stream_limit), 0);
+    layout.stream_bits = stream.size() * BITS_PER_BYTE;
+    extract_samples(chunk.data(), 0, count, layout, stream.data());
+    // Then the whole stream, starting over with the first chunk.
+    stream.assign(stream_size(stream), 0);
+    layout.stream_bits = stream.size() * BITS_PER_BYTE;
+    size_t first = 0;
+    const size_t end = last_stream_channel(layout);
+    while (count > 0) {
+        extract_samples(chunk.data(), first, count, layout, stream.data());
+        first += count;
+        if (first >= end) {
+            break;
+        }
+        rows = reader.read_rows(chunk.data(), rows_per_chunk);
+        count = rows * reader.row_channels();
+    }
+    if (stream.empty() && !payload_options.legacy) {
+        throw std::runtime_error("No message found in image!\n");
+    }
+    read_stream(stream);
+}
+
+void EasyLSB::extract_scattered(std::vector<uint8_t>* stream) {
+    std::unique_ptr<RowReader> source = RowReader::open(infile);
+    RowReader& reader = *source;
+    const size_t rows_per_chunk =
+        std::max<size_t>(1, CHUNK_BYTES / reader.row_bytes());
+    std::vector<uint8_t> chunk(rows_per_chunk * reader.row_bytes());
+    stream->resize(std::min(stream->size(),
+        reader.num_channels() * reader.channel_bits() / BITS_PER_BYTE));
+    std::fill(stream->begin(), stream->end(), 0);
+    StreamLayout layout =
+        reader.stream_layout(stream->size() * BITS_PER_BYTE);
+    layout.order = channel_order(reader.rows(), reader.row_channels());
+    // Rows holding part of the stream, and how many of them are left.
+    const size_t used_rows = (last_stream_channel(layout) +
+        reader.row_channels() - 1) / reader.row_channels();
+    size_t remaining = used_rows;
+    size_t first_row = 0;
+    size_t rows;
+    while (remaining > 0 &&
+        (rows = reader.read_rows(chunk.data(), rows_per_chunk)) > 0) {
+        for (size_t r = 0; r < rows; ++r) {
+            const size_t row = layout.order->logical_row(first_row + r);
+            if (row < used_rows) {
+                layout.order->extract_row(
+                    chunk.data() + r * reader.row_bytes(), row, layout,
+                    stream->data());
+                --remaining;
+            }
+        }
+        first_row += rows;
+    }
+}
+
+void EasyLSB::extract_rows(RowCursor* cursor, size_t offset, uint8_t* data,
+    size_t size) {
+    RowReader& reader = cursor->reader();
+    StreamLayout layout =
+        reader.stream_layout((offset + size) * BITS_PER_BYTE);
+    layout.first_bit = offset * BITS_PER_BYTE;
+    std::fill(data, data + size, 0);
+    ChannelRun runs[2];
+    const size_t count = stream_channel_runs(layout, runs);
+    const size_t channels = reader.row_channels();
+    for (size_t i = 0; i < count; ++i) {
+        const size_t end = (runs[i].first + runs[i].count + channels - 1) /
+            channels;
+        for (size_t r = runs[i].first / channels; r < end; ++r) {
+            extract_samples(cursor->row(r), r * channels, channels, layout,
+                data);
         }
-        // Start with red channel again.
-        color = Color::RED;
-        ptr = &(e->pixels()[row][col].red);
-        break;
     }
 }
 
+// Left out when the class is linked into another program (see bench.cpp).
+#ifndef EASYLSB_NO_MAIN
+// The whole contents of filename, or throws error if it can't be opened.
+static std::string read_file(const char* filename, const char* error) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error(error);
+    }
+    return std::string((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+}
+
+/*
+Parses an --range argument, "<offset>:<length>" in bytes, into
+offset and length. Returns false if it isn't one.
+*/
+static bool parse_range(const char* arg, size_t* offset, size_t* length) {
+    char* end;
+    if (!std::isdigit(static_cast<unsigned char>(arg[0]))) {
+        return false;
+    }
+    const unsigned long long first = std::strtoull(arg, &end, 10);
+    if (*end != ':' || !std::isdigit(static_cast<unsigned char>(end[1]))) {
+        return false;
+    }
+    const unsigned long long count = std::strtoull(end + 1, &end, 10);
+    if (*end != '\0' || first > UINT32_MAX || count > UINT32_MAX) {
+        return false;
+    }
+    *offset = static_cast<size_t>(first);
+    *length = static_cast<size_t>(count);
+    return true;
+}
+
+// The message argument itself, or with --file, the contents of that file.
+static std::string read_message(const char* arg, bool from_file) {
+    if (!from_file) {
+        return arg;
+    }
+    return read_file(arg, "Cannot open message file!\n");
+}
+
+// How busy a stage of a batch was, over the seconds the batch took.
+static void print_stage(const char* name, const StageUse& stage,
+    double seconds) {
+    const double use = seconds > 0 ? stage.busy / seconds / stage.threads : 0;
+    std::cout << name << ": " << stage.threads <<
+        (stage.threads == 1 ? " thread, " : " threads, ") <<
+        static_cast<int>(use * 100 + 0.5) << "% busy\n";
+}
+
 /*
 Usage:
 
 1. For encoding a message inside an image:
 EasyLSB <-e or --encode> <message> <image filename> <output filename>
 
-2. For decoding a message from a LSB encoded image:
+Options for encoding, which can go anywhere on the command line:
+<-c or --compress>: compress the message before embedding it, if that
+makes it any smaller.
+<-f or --file>: <message> is the name of a file holding the message.
+<-z or --compression> <0-9>: zlib level for PNG output.
+--fsync: fsync() the output image before closing it.
+--direct: write the output image with O_DIRECT, bypassing the page cache.
+--drop-cache: drop the output image from the page cache once written.
+--patch: write a patch of the changed bytes to <output filename>
+instead of the whole output image (bitmaps only).
+<-p or --passphrase> <passphrase>: encrypt the message with a key
+derived from <passphrase>.
+<-k or --key-file> <filename>: encrypt the message with a key derived
+from the contents of <filename>.
+<-r or --redundancy> <1-128>: add that many Reed-Solomon parity bytes
+per 255 bytes embedded, to correct up to half as many damaged bytes.
+<-s or --scatter>: spread the message over the image in an order keyed
+by the passphrase or key file, which one of them must be given for.
+
+Or, for splitting a message too large for one image over several,
+each image followed by the output filename for it:
+EasyLSB <-e or --encode> <message> --shard <image filename>
+<output filename> [<image filename> <output filename>]...
+
+Or, for encoding several files as an archive, any single one of which
+can be decoded on its own:
+EasyLSB <-e or --encode> --add <filename> [--add <filename>]...
+<image filename> <output filename>
+
+2. For decoding a message from a LSB encoded image, giving the same
+passphrase or key file if it was encrypted:
 EasyLSB <-d or --decode> <image filename>
 
-3. To display help message:
+Options for decoding:
+--legacy: also decode images encoded by versions without the header.
+--range <offset>:<length>: decode only length bytes of the message,
+starting offset bytes into it, reading only the part of the image
+that holds them.
+--list: list the files in an archive, with their sizes.
+--extract <filename>: decode just that file from an archive, reading
+only the archive's table of contents and that file's part of the image.
+<-s or --scatter>: the message was encoded with --scatter.
+Or, for decoding a message split over several images with --shard,
+giving the images in any order:
+EasyLSB <-d or --decode> --shard <image filename> [<image filename>]...
+
+3. For replacing the message in an encoded image, rewriting only the
+bytes that change, in place or in a copy at <output filename>:
+EasyLSB <-u or --update> <message> <image filename> [<output filename>]
+
+4. For applying a patch written by --patch to the image it was made
+from, in place or to a copy at <output filename>:
+EasyLSB <-a or --apply> <patch filename> <image filename> [<output filename>]
+
+5. For running as a daemon, serving encode and decode requests on a
+Unix domain socket at <socket path> until killed:
+EasyLSB --serve <socket path>
+--cache <megabytes>: keep up to that many megabytes of bitmaps encoded
+from a path cached, 64 by default, 0 for none.
+
+For printing the hits, misses and other counters of a daemon's cache:
+EasyLSB --stats <socket path>
+
+Then, to have the daemon encode or decode instead of doing it here,
+add to an encode or decode command line (not with --shard, --add,
+--patch, --range, --list or --extract):
+--client <socket path>
+--pass-fd: open the images here and send the daemon their descriptors
+instead of their paths. A bitmap encoded in place is then embedded
+into right where it is, through a shared mapping.
+
+6. For encoding a batch of messages into images, one job to a line of
+<job filename>: <message filename> <image filename> <output filename>.
+The encoding options above apply to every job. Prints how busy the
+threads reading, embedding and writing the images were.
+EasyLSB --batch <job filename>
+
+7. For scanning every bitmap under <directory> for messages, decoding
+each one found with the passphrase or key file if given:
+EasyLSB --scan <directory>
+--extract-to <directory>: write each message decoded to a file under
+that directory, at the image's path with ".msg" added.
+--report <filename>: write the JSON lines report there instead of to
+standard output, and print a summary.
+
+8. To display help message:
 EasyLSB <-h or --help>
 
 */
 int main(int argc, char *argv[]) {
     // Repeated many times, so save it.
     std::string get_help = "Run EasyLSB <-h or --help> for information.\n";
+    // Options can go anywhere, so take them out before counting arguments.
+    OutputOptions options;
+    PayloadOptions payload_options;
+    bool patch = false;
+    bool message_file = false;
+    bool range = false;
+    size_t range_offset = 0;
+    size_t range_length = 0;
+    // Files to encode as an archive, and the one to decode from one.
+    std::vector<std::pair<std::string, std::string>> files;
+    bool list = false;
+    const char* extract = nullptr;
+    bool shard = false;
+    // Socket of a daemon to send the request to, instead of running it.
+    const char* client = nullptr;
+    // Send the daemon the images as descriptors rather than paths.
+    bool pass_fd = false;
+    // Megabytes of bitmaps the daemon caches.
+    size_t cache_megabytes = 64;
+    // Where --scan extracts messages to, and writes its report to.
+    const char* extract_to = nullptr;
+    const char* report_file = nullptr;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "-z" || arg == "--compression") {
+            if (i + 1 == argc || std::string(argv[i + 1]).length() != 1 ||
+                argv[i + 1][0] < '0' || argv[i + 1][0] > '9') {
+                std::cout << "Compression level must be 0 to 9!\n" <<
+                    get_help;
+                return -1;
+            }
+            options.compression_level = argv[++i][0] - '0';
+        } else if (arg == "-r" || arg == "--redundancy") {
+            const int parity = i + 1 == argc ? 0 : std::atoi(argv[i + 1]);
+            if (parity < 1 || parity > 128) {
+                std::cout << "Redundancy must be 1 to 128!\n" << get_help;
+                return -1;
+            }
+            payload_options.parity = parity;
+            ++i;
+        } else if (arg == "--range") {
+            if (i + 1 == argc ||
+                !parse_range(argv[i + 1], &range_offset, &range_length)) {
+                std::cout << "Range must be <offset>:<length>!\n" << get_help;
+                return -1;
+            }
+            range = true;
+            ++i;
+        } else if (arg == "--add") {
+            if (i + 1 == argc) {
+                std::cout << "--add needs a file name!\n" << get_help;
+                return -1;
+            }
+            ++i;
+            files.emplace_back(argv[i],
+                read_file(argv[i], "Cannot open message file!\n"));
+        } else if (arg == "--client") {
+            if (i + 1 == argc) {
+                std::cout << "--client needs a socket path!\n" << get_help;
+                return -1;
+            }
+            client = argv[++i];
+        } else if (arg == "--cache") {
+            char* end = nullptr;
+            const long megabytes = i + 1 == argc ? -1 :
+                std::strtol(argv[i + 1], &end, 10);
+            if (megabytes < 0 || end == argv[i + 1] || *end != '\0') {
+                std::cout << "Cache size must be a number of megabytes!\n" <<
+                    get_help;
+                return -1;
+            }
+            cache_megabytes = static_cast<size_t>(megabytes);
+            ++i;
+        } else if (arg == "--extract-to" || arg == "--report") {
+            if (i + 1 == argc) {
+                std::cout << arg << " needs a path!\n" << get_help;
+                return -1;
+            }
+            (arg == "--report" ? report_file : extract_to) = argv[++i];
+        } else if (arg == "--pass-fd") {
+            pass_fd = true;
+        } else if (arg == "--shard") {
+            shard = true;
+        } else if (arg == "--list") {
+            list = true;
+        } else if (arg == "--extract") {
+            if (i + 1 == argc) {
+                std::cout << "--extract needs a file name!\n" << get_help;
+                return -1;
+            }
+            extract = argv[++i];
+        } else if (arg == "-c" || arg == "--compress") {
+            payload_options.compress = true;
+        } else if (arg == "-f" || arg == "--file") {
+            message_file = true;
+        } else if (arg == "--fsync") {
+            options.sync = true;
+        } else if (arg == "--direct") {
+            options.direct = true;
+        } else if (arg == "--drop-cache") {
+            options.drop_cache = true;
+        } else if (arg == "--patch") {
+            patch = true;
+        } else if (arg == "--legacy") {
+            payload_options.legacy = true;
+        } else if (arg == "-s" || arg == "--scatter") {
+            payload_options.scatter = true;
+        } else if (arg == "-p" || arg == "--passphrase" ||
+            arg == "-k" || arg == "--key-file") {
+            if (i + 1 == argc || argv[i + 1][0] == '\0') {
+                std::cout << "Passphrase or key file must not be empty!\n" <<
+                    get_help;
+                return -1;
+            }
+            ++i;
+            payload_options.secret = arg == "-p" || arg == "--passphrase" ?
+                argv[i] : read_file(argv[i], "Cannot open key file!\n");
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    argc = static_cast<int>(args.size());
+    argv = args.data();
     // Check for number of arguments.
-    if (!(argc == 5 || argc == 3 || argc == 2)) {
+    if (argc < 2) {
         std::cout << "Incorrect number of arguments!\n" << get_help;
         return -1;
     }
@@ -304,23 +951,57 @@ int main(int argc, char *argv[]) {
     // Check that mode is valid.
     if (!(mode == "-e" || mode == "--encode" ||
         mode == "-d" || mode == "--decode" ||
+        mode == "-u" || mode == "--update" ||
+        mode == "-a" || mode == "--apply" ||
+        mode == "--serve" || mode == "--stats" || mode == "--batch" ||
+        mode == "--scan" ||
         mode == "-h" || mode == "--help")) {
         std::cout << "Incorrect mode!\n" << get_help;
         return -1;
     }
+    // With --add, the message argument is left out.
+    const int first_image = files.empty() ? 3 : 2;
     /*
-    Encode must have argc = 5.
-    Decode must have argc = 3.
+    Encode must have argc = 5, or 4 with --add, or with --shard,
+    any number of pairs of images after the message.
+    Decode must have argc = 3, or at least that with --shard.
+    Update and apply must have argc = 4 or 5.
+    Serve, stats, batch and scan must have argc = 3.
     Help must have argc = 2.
     */
-    if ((mode == "-e" || mode == "--encode") && (argc != 5)) {
+    if ((mode == "-e" || mode == "--encode") && (shard ?
+        argc < first_image + 2 || (argc - first_image) % 2 != 0 :
+        argc != first_image + 2)) {
         std::cout << "Incorrect number of arguments for encoding!\n" <<
             get_help;
         return -1;
-    } else if ((mode == "-d" || mode == "--decode") && (argc != 3)) {
+    } else if ((mode == "-d" || mode == "--decode") &&
+        (shard ? argc < 3 : argc != 3)) {
         std::cout << "Incorrect number of arguments for decoding!\n" <<
             get_help;
         return -1;
+    } else if ((mode == "-u" || mode == "--update") &&
+        (argc != 4 && argc != 5)) {
+        std::cout << "Incorrect number of arguments for updating!\n" <<
+            get_help;
+        return -1;
+    } else if ((mode == "-a" || mode == "--apply") &&
+        (argc != 4 && argc != 5)) {
+        std::cout << "Incorrect number of arguments for applying a patch!\n" <<
+            get_help;
+        return -1;
+    } else if ((mode == "--serve" || mode == "--stats") && argc != 3) {
+        std::cout << "Incorrect number of arguments for serving!\n" <<
+            get_help;
+        return -1;
+    } else if (mode == "--batch" && argc != 3) {
+        std::cout << "Incorrect number of arguments for a batch!\n" <<
+            get_help;
+        return -1;
+    } else if (mode == "--scan" && argc != 3) {
+        std::cout << "Incorrect number of arguments for scanning!\n" <<
+            get_help;
+        return -1;
     } else if ((mode == "-h" || mode == "--help") && (argc != 2)) {
         std::cout << "Incorrect number of arguments for help!\n" <<
             get_help;
@@ -331,14 +1012,192 @@ int main(int argc, char *argv[]) {
         std::cout << "Usage:\n" <<
             "EasyLSB <-e or --encode> <message>" <<
             " <image filename> <output filename>\n" <<
-            "EasyLSB <-d or --decode> <image filename>\n" <<
+            "    [--shard <image filename> <output filename>...]\n" <<
+            "    [<-c or --compress>] [<-f or --file>]" <<
+            " [<-z or --compression> <0-9>]" <<
+            " [--fsync] [--direct]" <<
+            " [--drop-cache] [--patch]\n" <<
+            "    [<-p or --passphrase> <passphrase>]" <<
+            " [<-k or --key-file> <filename>]\n" <<
+            "    [<-r or --redundancy> <1-128>] [<-s or --scatter>]\n" <<
+            "EasyLSB <-e or --encode> --add <filename>" <<
+            " [--add <filename>]..." <<
+            " <image filename> <output filename>\n" <<
+            "EasyLSB <-d or --decode> <image filename>" <<
+            " [<-p or --passphrase> <passphrase>]" <<
+            " [<-k or --key-file> <filename>]\n" <<
+            "    [--legacy] [<-s or --scatter>]" <<
+            " [--range <offset>:<length>]\n" <<
+            "    [--list] [--extract <filename>]\n" <<
+            "EasyLSB <-d or --decode> --shard <image filename>" <<
+            " [<image filename>]...\n" <<
+            "EasyLSB <-u or --update> <message> <image filename>" <<
+            " [<output filename>]\n" <<
+            "EasyLSB <-a or --apply> <patch filename> <image filename>" <<
+            " [<output filename>]\n" <<
+            "EasyLSB --serve <socket path> [--cache <megabytes>]\n" <<
+            "EasyLSB --stats <socket path>\n" <<
+            "EasyLSB --batch <job filename>\n" <<
+            "EasyLSB --scan <directory> [--extract-to <directory>]" <<
+            " [--report <filename>]\n" <<
+            "    [<-p or --passphrase> <passphrase>]" <<
+            " [<-k or --key-file> <filename>]\n" <<
+            "EasyLSB <-e or --encode or -d or --decode> ..." <<
+            " --client <socket path> [--pass-fd]\n" <<
             "EasyLSB <-h or --help>\n";
         return 0;
+    } else if (mode == "--serve") {
+        serve(argv[2], 0, cache_megabytes << 20);
+    } else if (mode == "--stats") {
+        DaemonRequest request;
+        request.op = DaemonRequest::Op::STATS;
+        std::cout << DaemonClient(argv[2]).call(request).data;
+    } else if (mode == "--batch") {
+        const std::vector<BatchJob> jobs = read_batch(argv[2]);
+        const BatchReport report =
+            encode_batch(jobs, payload_options, options);
+        for (const BatchFailure& failure : report.failures) {
+            std::cout << "Cannot encode " << jobs[failure.job].output <<
+                ": " << failure.error;
+        }
+        std::cout << "Encoded " << jobs.size() - report.failures.size() <<
+            " of " << jobs.size() << " images in " << report.seconds <<
+            " s.\n";
+        print_stage("read", report.read, report.seconds);
+        print_stage("embed", report.embed, report.seconds);
+        print_stage("write", report.write, report.seconds);
+        if (!report.failures.empty()) {
+            return -1;
+        }
+    } else if (mode == "--scan") {
+        if (payload_options.scatter) {
+            std::cout << "--scan only finds messages that weren't" <<
+                " scattered!\n" << get_help;
+            return -1;
+        }
+        std::ofstream report;
+        if (report_file) {
+            report.open(report_file);
+            if (!report) {
+                throw std::runtime_error("Cannot open report file!\n");
+            }
+        }
+        const ScanReport result = scan(argv[2],
+            extract_to ? extract_to : "", payload_options,
+            report_file ? report : std::cout);
+        if (report_file) {
+            std::cout << "Scanned " << result.bitmaps << " bitmaps in " <<
+                result.seconds << " s, found " << result.found <<
+                " messages, " << result.decoded << " decoded.\n";
+        }
+    } else if (client) {
+        if (!(mode == "-e" || mode == "--encode" ||
+            mode == "-d" || mode == "--decode") || shard || patch || range ||
+            list || extract || !files.empty()) {
+            std::cout << "--client only encodes or decodes a message!\n" <<
+                get_help;
+            return -1;
+        }
+        // The daemon has its own working directory.
+        DaemonRequest request;
+        request.payload_options = payload_options;
+        request.output_options = options;
+        const bool encode = mode == "-e" || mode == "--encode";
+        if (encode) {
+            request.op = DaemonRequest::Op::ENCODE;
+            request.message = read_message(argv[2], message_file);
+        }
+        const char* image = encode ? argv[3] : argv[2];
+        std::error_code ec;
+        const bool in_place =
+            encode && std::filesystem::equivalent(argv[3], argv[4], ec);
+        if (!pass_fd) {
+            request.image = std::filesystem::absolute(image).string();
+            if (encode) {
+                request.output = std::filesystem::absolute(argv[4]).string();
+            }
+        } else {
+            // Left open until the process exits.
+            request.image_fd = ::open(image,
+                (in_place ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+            if (request.image_fd < 0) {
+                throw std::runtime_error("Cannot open input image!\n");
+            }
+            if (encode && !in_place) {
+                request.output_fd = ::open(argv[4],
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (request.output_fd < 0) {
+                    throw std::runtime_error("Cannot open output image!\n");
+                }
+            }
+        }
+        const DaemonResponse response = DaemonClient(client).call(request);
+        if (!response.ok) {
+            throw std::runtime_error(response.data);
+        }
+        if (request.op == DaemonRequest::Op::DECODE) {
+            std::cout << response.data << std::endl;
+        }
+    } else if ((mode == "-e" || mode == "--encode") && shard) {
+        std::vector<std::pair<const char*, const char*>> images;
+        for (int i = first_image; i < argc; i += 2) {
+            images.emplace_back(argv[i], argv[i + 1]);
+        }
+        payload_options.archive = !files.empty();
+        encode_shards(files.empty() ? read_message(argv[2], message_file) :
+            build_archive(files), images, payload_options, options);
+    } else if ((mode == "-d" || mode == "--decode") && shard) {
+        const std::vector<const char*> images(argv + 2, argv + argc);
+        std::cout << decode_shards(images, payload_options) << std::endl;
+    } else if ((mode == "-e" || mode == "--encode") && !files.empty()) {
+        payload_options.archive = true;
+        EasyLSB steg(build_archive(files), argv[2], argv[3]);
+        steg.set_output_options(options);
+        steg.set_payload_options(payload_options);
+        if (patch) {
+            steg.encode_patch();
+        } else {
+            steg.encode();
+        }
     } else if (mode == "-e" || mode == "--encode") {
-        EasyLSB steg(argv[2], argv[3], argv[4]);
-        steg.encode();
+        EasyLSB steg(read_message(argv[2], message_file), argv[3], argv[4]);
+        steg.set_output_options(options);
+        steg.set_payload_options(payload_options);
+        if (patch) {
+            steg.encode_patch();
+        } else {
+            steg.encode();
+        }
+    } else if (mode == "-u" || mode == "--update") {
+        EasyLSB steg(read_message(argv[2], message_file), argv[3],
+            argc == 5 ? argv[4] : argv[3]);
+        steg.set_output_options(options);
+        steg.set_payload_options(payload_options);
+        std::cout << steg.update() << " bytes changed.\n";
+    } else if (mode == "-a" || mode == "--apply") {
+        Patch::load(argv[2]).apply(argv[3], argc == 5 ? argv[4] : nullptr,
+            options);
     } else {
         EasyLSB unsteg(argv[2]);
-        unsteg.decode();
+        unsteg.set_payload_options(payload_options);
+        if (list) {
+            for (const ArchiveEntry& entry : unsteg.list_archive()) {
+                std::cout << entry.length << " " << entry.name << "\n";
+            }
+            return 0;
+        } else if (extract) {
+            // The file exactly as it was added, so it can be redirected.
+            unsteg.decode_file(extract);
+            std::cout.write(unsteg.message().data(),
+                static_cast<std::streamsize>(unsteg.message().size()));
+            return 0;
+        } else if (range) {
+            unsteg.decode_range(range_offset, range_length);
+        } else {
+            unsteg.decode();
+        }
+        // Output the result.
+        std::cout << unsteg.message() << std::endl;
     }
 }
+#endif  // EASYLSB_NO_MAIN
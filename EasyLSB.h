@@ -3,13 +3,18 @@
 EasyLSB.h
 
 An encoder and decoder for messages hidden inside bitmap
-images by least significant bit steganography. Uses my
-BitmapParser library.
+images by least significant bit steganography. Bitmaps
+are worked on in place in their file buffer (see carrier.h),
+and binary PGM and PPM images and PNG images are streamed
+(see row_stream.h).
 
-The first 16 least significant bits is the length field
-before the actual message bits. Length is expressed in
-chars of the message (i.e. bytes of the message since
-sizeof(char) = 1 by standard).
+The message bits start with a versioned header of variable length
+(see PayloadHeader in payload.h): 12 bytes holding the length and
+checksum of the message bits that follow, which may be compressed,
+and up to PayloadHeader::MAX_SIZE bytes once the fields for
+encryption, parity and shards are present. Images from earlier
+versions, where the first 16 bits are just the length in chars of
+the message, still decode.
 
 The style confroms to Google's coding style guide for C++,
 and has been checked with cpplint.
@@ -21,63 +26,43 @@ June 29, 2019
 #ifndef EASYLSB_H_
 #define EASYLSB_H_
 
-// Already includes iostream, string, and vector.
-#include "bitmapparser.h"
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "archive.h"
+#include "carrier.h"
+#include "channel_order.h"
+#include "payload.h"
+#include "row_stream.h"
 
 /*
-EasyLSB class, extending from BitmapParser.
-Inheritance allows easier addition of the channel accessor.
+EasyLSB class, holding the carrier image it works on.
+Bits are written into and read out of the carrier by the
+kernel in lsb_kernel.h, a row (or chunk of rows) at a time.
 */
-class EasyLSB : public BitmapParser {
+class EasyLSB {
  private:
-    /*
-    The channel accessor is an iterator-like object
-    for retrieving and changing channel data.
-    Supports read, increment, and reassignment of channels.
-    */
-    class ChannelAccessor {
-     private:
-        // Only 3 possible colors, so use an enum class.
-        enum class Color { RED, GREEN, BLUE };
-        // Need an instance of EasyLSB to access.
-        EasyLSB* e;
-        size_t row;
-        size_t col;
-        /*
-        If the message cannot fit in the least significant bits
-        of all the channels, it will wrap around the pixels array
-        and be stored in the 2nd least significant,
-        3rd least... all the way up to the most significant (8th) bit.
-        This variable counts the number of wraps.
-        */
-        size_t wraparounds;
-        Color color;
-        // Pointer to color channel.
-        uint8_t* ptr;
-
-     public:
-        // Constructor - makes accessor point to red channel of row 0, col 0.
-        explicit ChannelAccessor(EasyLSB* easy);
-        // Channel accessor, mutator, increment.
-        uint8_t get_channel() const;
-        void replace_channel(uint8_t new_value);
-        void next_channel();
-        // Accessor for getting number of wraps.
-        size_t get_wraparounds() const;
-        // Returns the appropriate mask for each wrap.
-        uint8_t wrap_mask(size_t wraparounds) const;
-        // Returns the appropriate bitmask for each wrap round.
-        uint8_t bitmask(size_t wraparounds) const;
-    };
     // Constants for readability
     const size_t BITS_PER_BYTE = 8;
+    // Length field of images from earlier versions, which have no header.
     const size_t NUM_LENGTH_BITS = 16;
-    const size_t MAX_MSG_LENGTH = 65535;
+    const size_t MAX_MSG_LENGTH = 4294967295;
+    // Streamed images are processed about this many bytes at a time.
+    const size_t CHUNK_BYTES = 1 << 20;
+    // Or this many when decoding a range, which usually needs few rows.
+    const size_t RANGE_CHUNK_BYTES = 1 << 16;
+    /*
+    Input file name, needed to reopen streamed images.
+    Bitmaps are loaded into the carrier by the constructor.
+    */
+    const char* infile;
     /*
-    No need to remember input file name because it's passed
-    directly to superclass BitmapParser, but we need to hold
-    on to the output file in order to call BitmapParser::save()
-    when we are done with stego.
+    We need to hold on to the output file in order to call
+    Carrier::save() (or stream into it) when we are done with stego.
     If mode is decode, this is nullptr.
     */
     const char* outfile;
@@ -87,15 +72,91 @@ class EasyLSB : public BitmapParser {
     The decoded message will be stored here.
     */
     std::string msg;
-    // For keeping track of which channels we are at.
-    ChannelAccessor c;
-    // Helper function for constructor.
+    /*
+    The image being encoded into or decoded from.
+    nullptr for streamed images, which are read from infile.
+    */
+    std::unique_ptr<Carrier> image;
+    // How to write the output image.
+    OutputOptions options;
+    // How to transform msg before embedding it.
+    PayloadOptions payload_options;
+    // The keyed order the stream is embedded in, once it's been needed.
+    std::unique_ptr<ChannelOrder> order;
+    // The header of the message decode() last decoded.
+    PayloadHeader decoded;
+    /*
+    What begin_parts() set up: the whole stream, its layout, the rows
+    per part, and the rows the stream goes into.
+    */
+    std::vector<uint8_t> parts_stream;
+    StreamLayout parts_layout{};
+    size_t part_rows = 0;
+    size_t used_rows = 0;
+    // Helper functions for constructor.
     void check_size() const;
+    // Header followed by the payload made from msg, as embedded in the image.
+    std::vector<uint8_t> build_stream() const;
+    /*
+    Bytes in the whole stream embedded in the image, given its first
+    bytes: a header, or the length field of an older image. 0 if they
+    can't belong to a message.
+    */
+    size_t stream_size(const std::vector<uint8_t>& prefix) const;
+    // Sets msg to the message in a whole stream.
+    void read_stream(const std::vector<uint8_t>& stream);
+    /*
+    Throws std::runtime_error if the first bytes of the stream aren't
+    the magic bytes, unless images from earlier versions are allowed.
+    */
+    void check_magic(const std::vector<uint8_t>& prefix) const;
+    // Runs msg through the pipeline into the carrier.
+    void embed_message();
+    /*
+    Embed or extract size bytes of the stream at byte offset of it,
+    in the carrier.
+    */
+    void embed_range(size_t offset, const uint8_t* data, size_t size);
+    void extract_range(size_t offset, uint8_t* data, size_t size);
+    /*
+    The order to embed in an image of rows rows of row_channels
+    channels, or nullptr if the stream isn't scattered. Throws
+    std::runtime_error if there is no secret to key it with.
+    */
+    const ChannelOrder* channel_order(size_t rows, size_t row_channels);
+    // encode() and decode() for streamed images.
+    void encode_stream();
+    void decode_stream();
+    /*
+    Reads the streamed image from the start until every row holding
+    part of stream, as long as it is, has been extracted into it.
+    Only for scattered streams.
+    */
+    void extract_scattered(std::vector<uint8_t>* stream);
+    // Gets to use the header and a reader for the message after it.
+    using MessageUser = std::function<void(const PayloadHeader& header,
+        PayloadReader* reader)>;
+    /*
+    Reads the header, and if there is one, has use read the parts of
+    the message it needs. Returns false if there is no header, as in
+    images from earlier versions. Throws std::runtime_error if there
+    is no message, as decode() does.
+    */
+    bool read_message(const MessageUser& use);
+    // extract_range() for streamed images, reading rows through cursor.
+    void extract_rows(RowCursor* cursor, size_t offset, uint8_t* data,
+        size_t size);
 
  public:
-    // Constructor for encode.
-    EasyLSB(const char* message, const char* filename_in,
-        const char* filename_out);
+    /*
+    Constructor for encode. A bitmap is looked up in cache, if given,
+    and read into it if it isn't there (see carrier_cache.h).
+    */
+    EasyLSB(const std::string& message, const char* filename_in,
+        const char* filename_out, CarrierCache* cache = nullptr);
+    // Constructor for encode into a bitmap already read whole into file.
+    EasyLSB(const std::string& message, const char* filename_in,
+        const char* filename_out, std::shared_ptr<const CachedImage> file);
     // Constructor for decode.
     explicit EasyLSB(const char* filename_in);
     /*
@@ -104,8 +165,71 @@ class EasyLSB : public BitmapParser {
     on the message.
     */
     void encode();
+    /*
+    Same as encode(), but instead of the output image, writes a patch
+    of just the bytes encoding changed to the output file. Bitmaps only.
+    */
+    void encode_patch();
+    /*
+    Replaces the message already encoded in the image with msg,
+    writing only the bytes whose bits actually change, and returns
+    how many bytes that was. Bitmaps only.
+    */
+    size_t update();
+    /*
+    encode() split up, so a large bitmap can be embedded into by
+    several threads at once. begin_parts() builds the whole stream and
+    loads the rows it goes into, and returns how many parts, each
+    about part_bytes of those rows, embedding them is split into, or
+    0 for a streamed image, which can only be encode()d whole.
+    embed_part() embeds one part; parts are different rows, so they
+    can run in any order and at the same time. finish_parts() writes
+    the output image once every part is in.
+    */
+    size_t begin_parts(size_t part_bytes);
+    void embed_part(size_t part);
+    void finish_parts();
+    /*
+    Works on a bitmap through a shared mapping of its file (see
+    carrier.h) instead of reading and writing its rows, to decode or to
+    encode in place. Returns whether the image is mapped; streamed
+    images, and bitmaps encoded into another file, are left as they are.
+    Mapped images can't be patched or updated.
+    */
+    bool map_image();
+    // Whether the image is a bitmap rather than a streamed image.
+    bool is_bitmap() const;
     // Decodes a message into msg.
     void decode();
+    /*
+    Decodes just length bytes of the message, from byte offset of it
+    on, into msg, reading only the part of the image holding them.
+    Throws std::runtime_error if the range goes past the end of the
+    message.
+    */
+    void decode_range(size_t offset, size_t length);
+    /*
+    The files in the archive encoded in the image, reading only its
+    table of contents. Throws std::runtime_error if the message isn't
+    an archive.
+    */
+    std::vector<ArchiveEntry> list_archive();
+    /*
+    Decodes just the file called name out of the archive encoded in
+    the image into msg, reading only the table of contents and that
+    file's part of the image.
+    */
+    void decode_file(const std::string& name);
+    // The message given to or decoded by this object.
+    const std::string& message() const;
+    // The header decode() found, default for images without one.
+    const PayloadHeader& decoded_header() const;
+    // Number of bits the image can hold.
+    size_t capacity() const;
+    // Settings used when encode() writes the output image.
+    void set_output_options(const OutputOptions& output_options);
+    // Transforms encode() applies to the message.
+    void set_payload_options(const PayloadOptions& options);
 };
 
 #endif  // EASYLSB_H_
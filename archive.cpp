@@ -0,0 +1,114 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+archive.cpp
+
+Archives of several files. See archive.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "archive.h"
+
+#include <set>
+#include <stdexcept>
+
+#include "crc32c.h"
+
+// Bytes of the size field, and of an entry before its name.
+static const size_t TOC_SIZE_BYTES = 4;
+static const size_t ENTRY_BYTES = 13;
+static const size_t MAX_NAME_SIZE = 255;
+
+static void append_be32(std::string* out, size_t value) {
+    out->push_back(static_cast<char>(value >> 24));
+    out->push_back(static_cast<char>(value >> 16));
+    out->push_back(static_cast<char>(value >> 8));
+    out->push_back(static_cast<char>(value));
+}
+
+static size_t get_be32(const std::string& data, size_t offset) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + offset;
+    return static_cast<size_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t checksum(const std::string& data) {
+    return crc32c(0, reinterpret_cast<const uint8_t*>(data.data()),
+        data.size());
+}
+
+std::string build_archive(
+    const std::vector<std::pair<std::string, std::string>>& files) {
+    size_t toc_size = TOC_SIZE_BYTES;
+    std::set<std::string> names;
+    for (const auto& file : files) {
+        if (file.first.empty() || file.first.size() > MAX_NAME_SIZE) {
+            throw std::runtime_error(
+                "File names must be 1 to 255 bytes long!\n");
+        }
+        if (!names.insert(file.first).second) {
+            throw std::runtime_error("File is in the archive twice!\n");
+        }
+        toc_size += ENTRY_BYTES + file.first.size();
+    }
+    std::string archive;
+    append_be32(&archive, toc_size);
+    size_t offset = toc_size;
+    for (const auto& file : files) {
+        append_be32(&archive, offset);
+        append_be32(&archive, file.second.size());
+        append_be32(&archive, checksum(file.second));
+        archive.push_back(static_cast<char>(file.first.size()));
+        archive += file.first;
+        offset += file.second.size();
+    }
+    for (const auto& file : files) {
+        archive += file.second;
+    }
+    return archive;
+}
+
+/*
+The size goes first, so the table takes two reads: the size, then
+the rest of it, which is usually in the same block of the message.
+*/
+std::vector<ArchiveEntry> read_archive_toc(PayloadReader* reader) {
+    const size_t size = get_be32(reader->read(0, TOC_SIZE_BYTES), 0);
+    if (size < TOC_SIZE_BYTES) {
+        throw std::runtime_error("Archive is damaged!\n");
+    }
+    const std::string toc = reader->read(TOC_SIZE_BYTES,
+        size - TOC_SIZE_BYTES);
+    std::vector<ArchiveEntry> entries;
+    for (size_t i = 0; i < toc.size();) {
+        if (toc.size() - i < ENTRY_BYTES ||
+            toc.size() - i - ENTRY_BYTES <
+            static_cast<uint8_t>(toc[i + ENTRY_BYTES - 1])) {
+            throw std::runtime_error("Archive is damaged!\n");
+        }
+        ArchiveEntry entry;
+        entry.offset = get_be32(toc, i);
+        entry.length = get_be32(toc, i + 4);
+        entry.checksum = static_cast<uint32_t>(get_be32(toc, i + 8));
+        const size_t name_size = static_cast<uint8_t>(toc[i + 12]);
+        entry.name = toc.substr(i + ENTRY_BYTES, name_size);
+        entries.push_back(entry);
+        i += ENTRY_BYTES + name_size;
+    }
+    return entries;
+}
+
+std::string read_archive_file(PayloadReader* reader,
+    const std::string& name) {
+    for (const ArchiveEntry& entry : read_archive_toc(reader)) {
+        if (entry.name != name) {
+            continue;
+        }
+        const std::string contents = reader->read(entry.offset, entry.length);
+        if (checksum(contents) != entry.checksum) {
+            throw std::runtime_error("File checksum does not match!\n");
+        }
+        return contents;
+    }
+    throw std::runtime_error("No such file in archive!\n");
+}
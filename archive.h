@@ -0,0 +1,66 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+archive.h
+
+Several files hidden in one carrier: the message is an archive,
+flagged as such in the header (payload.h), starting with a table of
+contents, big endian:
+    size                4 bytes, of the table, this field included
+and for each file:
+    offset              4 bytes, where its contents are in the message
+    length              4 bytes
+    checksum            4 bytes, CRC-32C (crc32c.h) of its contents
+    name size           1 byte
+    name
+followed by the contents of the files, one after the other.
+
+The archive is compressed, encrypted and error corrected like any
+other message. Since a PayloadReader can read any slice of it on its
+own, getting one file out only reads the table and that file's part
+of the image, not the files before or after it.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "payload.h"
+
+struct ArchiveEntry {
+    std::string name;
+    size_t offset;
+    size_t length;
+    uint32_t checksum;
+};
+
+/*
+The message holding files, given as pairs of name and contents.
+Throws std::runtime_error if a name is empty, longer than 255 bytes
+or given twice.
+*/
+std::string build_archive(
+    const std::vector<std::pair<std::string, std::string>>& files);
+
+/*
+The table of contents of the archive read by reader. Throws
+std::runtime_error if it is damaged.
+*/
+std::vector<ArchiveEntry> read_archive_toc(PayloadReader* reader);
+
+/*
+The contents of the file called name in the archive read by reader,
+checked against its checksum. Throws std::runtime_error if there is
+no such file, or if it is damaged.
+*/
+std::string read_archive_file(PayloadReader* reader,
+    const std::string& name);
+
+#endif  // ARCHIVE_H_
@@ -0,0 +1,320 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+batch.cpp
+
+Encoding a batch of jobs on a work stealing pool. See batch.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "EasyLSB.h"
+#include "carrier_cache.h"
+#include "file_reader.h"
+#include "pipeline.h"
+#include "work_stealing_pool.h"
+
+/*
+Bytes of rows per part of a large bitmap: large enough that a part
+takes far longer to embed than to be stolen, small enough that a
+200 MB scan makes dozens of them.
+*/
+static const size_t PART_BYTES = 4 << 20;
+/*
+Threads reading and writing images. Mostly waiting on the disk, so a
+couple each keep it busy, whatever the number of processors.
+*/
+static const size_t READ_THREADS = 2;
+static const size_t WRITE_THREADS = 2;
+/*
+Jobs each reader takes at a time, whose message files and images are
+read all at once, and bytes read from the start of each: a message or
+bitmap that fits is used from there, anything larger is read as usual.
+*/
+static const size_t READ_WINDOW = 32;
+static const size_t READ_BUFFER_BYTES = 256 << 10;
+
+using Clock = std::chrono::steady_clock;
+
+// A job on its way through the pipeline.
+struct LoadedJob {
+    // Index of the job in the batch.
+    size_t index = 0;
+    std::unique_ptr<EasyLSB> steg;
+    // From begin_parts(), 0 for a streamed image.
+    size_t parts = 0;
+    // Set once a part has thrown, so the rest are skipped.
+    std::atomic<bool> failed{false};
+};
+
+// Adds up the time threads spend working in one stage.
+class StageTimer {
+ private:
+    std::atomic<int64_t> nanoseconds;
+
+ public:
+    StageTimer() : nanoseconds(0) {}
+    // Runs work, counting the time it takes.
+    template <class Work>
+    void time(const Work& work) {
+        const Clock::time_point start = Clock::now();
+        work();
+        nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count();
+    }
+    StageUse use(size_t threads) const {
+        StageUse stage;
+        stage.threads = threads;
+        stage.busy = nanoseconds / 1e9;
+        return stage;
+    }
+};
+
+std::vector<BatchJob> read_batch(const char* filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        throw std::runtime_error("Cannot open job file!\n");
+    }
+    std::vector<BatchJob> jobs;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.message_file) || job.message_file[0] == '#') {
+            continue;
+        }
+        std::string extra;
+        if (!(fields >> job.image >> job.output) || fields >> extra) {
+            throw std::runtime_error(
+                "Each job must be <message> <image> <output>!\n");
+        }
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+static std::string read_message_file(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open message file!\n");
+    }
+    return std::string((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+}
+
+/*
+The readers take windows of jobs in order, read their message files
+and images with a FileReader (through io_uring where there is one),
+and push each loaded job onto the embed queue, waiting while that is
+full. The calling thread takes loaded jobs off it, along with any
+others already waiting, up to one per worker, and runs every part of
+every one of them as one batch on the pool, so no task ever blocks
+waiting for the readers; a large bitmap's parts are stolen like any
+other task. The writers then save the images, and drop them. A job
+that throws is recorded and dropped, and the rest go on. Anything
+else that throws aborts both queues, which stops every stage, and is
+rethrown once they all have.
+*/
+BatchReport encode_batch(const std::vector<BatchJob>& jobs,
+    const PayloadOptions& options, const OutputOptions& output_options,
+    size_t threads) {
+    const Clock::time_point start = Clock::now();
+    WorkStealingPool pool(threads);
+    BoundedQueue<std::unique_ptr<LoadedJob>> loaded(pool.size());
+    BoundedQueue<std::unique_ptr<LoadedJob>> embedded(pool.size());
+    StageTimer reading;
+    StageTimer embedding;
+    StageTimer writing;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<BatchFailure> failures;
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        loaded.abort();
+        embedded.abort();
+    };
+    auto record = [&](size_t job, const std::exception& e) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        failures.push_back({job, e.what()});
+    };
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> readers_left(READ_THREADS);
+    std::vector<std::thread> stages;
+    for (size_t t = 0; t < READ_THREADS; ++t) {
+        stages.emplace_back([&] {
+            try {
+                FileReader files(2 * READ_WINDOW, READ_BUFFER_BYTES);
+                size_t first;
+                while ((first = next.fetch_add(READ_WINDOW)) < jobs.size()) {
+                    const size_t count =
+                        std::min(READ_WINDOW, jobs.size() - first);
+                    std::vector<std::string> paths;
+                    for (size_t j = first; j < first + count; ++j) {
+                        paths.push_back(jobs[j].message_file);
+                        paths.push_back(jobs[j].image);
+                    }
+                    std::vector<std::unique_ptr<std::string>> messages(count);
+                    std::vector<std::shared_ptr<const CachedImage>> images(
+                        count);
+                    reading.time([&] {
+                        files.read(paths, [&](size_t i, const uint8_t* data,
+                            size_t size, int error) {
+                            if (error || size == files.buffer_bytes()) {
+                                return;
+                            } else if (i % 2 == 0) {
+                                messages[i / 2] =
+                                    std::make_unique<std::string>(data,
+                                        data + size);
+                            } else if (size >= 2 && data[0] == 'B' &&
+                                data[1] == 'M') {
+                                images[i / 2] = image_from_bytes(data, size);
+                            }
+                        });
+                    });
+                    for (size_t j = 0; j < count; ++j) {
+                        const BatchJob& batch_job = jobs[first + j];
+                        auto job = std::make_unique<LoadedJob>();
+                        job->index = first + j;
+                        try {
+                            reading.time([&] {
+                                const std::string message = messages[j] ?
+                                    std::move(*messages[j]) :
+                                    read_message_file(batch_job.message_file);
+                                job->steg = images[j] ?
+                                    std::make_unique<EasyLSB>(message,
+                                        batch_job.image.c_str(),
+                                        batch_job.output.c_str(),
+                                        std::move(images[j])) :
+                                    std::make_unique<EasyLSB>(message,
+                                        batch_job.image.c_str(),
+                                        batch_job.output.c_str());
+                                job->steg->set_output_options(output_options);
+                                job->steg->set_payload_options(options);
+                                job->parts = job->steg->begin_parts(
+                                    PART_BYTES);
+                            });
+                        } catch (const std::exception& e) {
+                            record(job->index, e);
+                            continue;
+                        }
+                        if (!loaded.push(std::move(job))) {
+                            return;
+                        }
+                    }
+                }
+                if (--readers_left == 0) {
+                    loaded.close();
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+    for (size_t t = 0; t < WRITE_THREADS; ++t) {
+        stages.emplace_back([&] {
+            try {
+                std::unique_ptr<LoadedJob> job;
+                while (embedded.pop(job)) {
+                    try {
+                        writing.time([&] { job->steg->finish_parts(); });
+                    } catch (const std::exception& e) {
+                        record(job->index, e);
+                    }
+                    job.reset();
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+    try {
+        std::vector<std::unique_ptr<LoadedJob>> group;
+        // A job, and which of its parts; a streamed image is one task.
+        std::vector<std::pair<LoadedJob*, size_t>> tasks;
+        std::unique_ptr<LoadedJob> job;
+        bool running = true;
+        while (running && loaded.pop(job)) {
+            group.clear();
+            group.push_back(std::move(job));
+            while (group.size() < pool.size() && loaded.try_pop(job)) {
+                group.push_back(std::move(job));
+            }
+            tasks.clear();
+            for (const std::unique_ptr<LoadedJob>& loaded_job : group) {
+                const size_t count = std::max<size_t>(1, loaded_job->parts);
+                for (size_t part = 0; part < count; ++part) {
+                    tasks.emplace_back(loaded_job.get(), part);
+                }
+            }
+            pool.run(tasks.size(), [&](size_t t) {
+                LoadedJob& task_job = *tasks[t].first;
+                if (task_job.failed) {
+                    return;
+                }
+                try {
+                    embedding.time([&] {
+                        if (task_job.parts == 0) {
+                            task_job.steg->encode();
+                        } else {
+                            task_job.steg->embed_part(tasks[t].second);
+                        }
+                    });
+                } catch (const std::exception& e) {
+                    if (!task_job.failed.exchange(true)) {
+                        record(task_job.index, e);
+                    }
+                }
+            });
+            for (std::unique_ptr<LoadedJob>& embedded_job : group) {
+                if (embedded_job->failed || embedded_job->parts == 0) {
+                    continue;
+                } else if (!embedded.push(std::move(embedded_job))) {
+                    // Aborted: something has already failed the batch.
+                    running = false;
+                    break;
+                }
+            }
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    embedded.close();
+    for (std::thread& stage : stages) {
+        stage.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    BatchReport report;
+    report.seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    report.read = reading.use(READ_THREADS);
+    report.embed = embedding.use(pool.size());
+    report.write = writing.use(WRITE_THREADS);
+    std::sort(failures.begin(), failures.end(),
+        [](const BatchFailure& a, const BatchFailure& b) {
+            return a.job < b.job;
+        });
+    report.failures = std::move(failures);
+    return report;
+}
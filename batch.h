@@ -0,0 +1,97 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+batch.h
+
+Encoding many messages into many images in one run, such as a night's
+worth of scans, from a job file listing what goes where.
+
+A batch runs as a pipeline of three stages, so reading one image,
+embedding into another and writing a third all go on at once:
+
+    read    Reader threads read each job's message, open its image,
+            build the stream and read the rows it goes into. The
+            message files and images of a few dozen jobs at a time
+            are read together (file_reader.h), so a batch of
+            thumbnails doesn't pay for a system call per file.
+    embed   The calling thread takes the loaded jobs as they come and
+            has a work stealing pool (work_stealing_pool.h) embed
+            their streams. A small bitmap is one task, but a large one
+            is split into parts of a few MB of rows each (see
+            EasyLSB::begin_parts()), run as tasks of their own, so a
+            200 MB scan near the end of the batch is shared out among
+            all the workers instead of leaving one of them to finish
+            it while the rest sit idle.
+    write   Writer threads write out the output images.
+
+The stages are connected by bounded queues (pipeline.h): a stage that
+gets ahead waits for the next one to take a job off its queue, so
+only a few jobs are ever in memory at once, however long the batch.
+Streamed images are read, embedded and written as they go, so the
+embed stage encodes them whole.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "output_file.h"
+#include "payload.h"
+
+struct BatchJob {
+    // The file holding the message, and the images to encode it between.
+    std::string message_file;
+    std::string image;
+    std::string output;
+};
+
+// How busy one stage of a batch was.
+struct StageUse {
+    size_t threads = 0;
+    // Seconds its threads spent working, rather than waiting, in all.
+    double busy = 0;
+};
+
+// A job that couldn't be encoded, and why.
+struct BatchFailure {
+    // Index of the job in the batch.
+    size_t job = 0;
+    // what() of the exception it threw.
+    std::string error;
+};
+
+struct BatchReport {
+    // Seconds the whole batch took.
+    double seconds = 0;
+    StageUse read;
+    StageUse embed;
+    StageUse write;
+    // The jobs that failed, in batch order.
+    std::vector<BatchFailure> failures;
+};
+
+/*
+The jobs in a job file, one to a line: the message filename, image
+filename and output filename, separated by whitespace. Blank lines
+and lines starting with # are skipped. Throws std::runtime_error if the
+file can't be read or a line isn't a job.
+*/
+std::vector<BatchJob> read_batch(const char* filename);
+
+/*
+Encodes every job, with the same options, embedding on threads
+workers (one per processor if 0). A job that fails, such as one whose
+message file is missing, is added to the report's failures, and the
+rest of the batch goes on. Only a failure of the batch itself, such
+as the kernel not taking a batch of reads, throws std::runtime_error.
+*/
+BatchReport encode_batch(const std::vector<BatchJob>& jobs,
+    const PayloadOptions& options, const OutputOptions& output_options,
+    size_t threads = 0);
+
+#endif  // BATCH_H_
@@ -0,0 +1,100 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+bench.cpp
+
+End-to-end throughput of encode() and decode(), with and without
+compressing, encrypting and error correcting the message first, and
+with it scattered over the image in a keyed order rather than in
+sequence, for one image and one message. Encrypted and scattered
+times include deriving the keys.
+
+Usage:
+EasyLSB_bench <image filename> <message filename> [<runs>]
+
+Each run encodes the message file into a temporary copy of the image,
+decodes it back and checks it came out the same; the best of the
+runs is reported.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "EasyLSB.h"
+#include "payload.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Seconds since start.
+static double since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void run(const char* label, const char* image, const std::string& msg,
+    const PayloadOptions& payload_options, int runs) {
+    const std::string out = (std::filesystem::temp_directory_path() /
+        "easylsb_bench.out").string();
+    double best_encode = 1e9;
+    double best_decode = 1e9;
+    for (int i = 0; i < runs; ++i) {
+        Clock::time_point start = Clock::now();
+        EasyLSB steg(msg.c_str(), image, out.c_str());
+        steg.set_payload_options(payload_options);
+        steg.encode();
+        best_encode = std::min(best_encode, since(start));
+        start = Clock::now();
+        EasyLSB unsteg(out.c_str());
+        unsteg.set_payload_options(payload_options);
+        unsteg.decode();
+        best_decode = std::min(best_decode, since(start));
+        if (unsteg.message() != msg) {
+            throw std::runtime_error("Decoded message is different!\n");
+        }
+    }
+    std::remove(out.c_str());
+    const double megabytes = msg.size() / 1e6;
+    std::printf("%-12s %8zu bytes embedded, encode %8.2f MB/s (%.3f ms),"
+        " decode %8.2f MB/s (%.3f ms)\n", label,
+        build_payload(msg, payload_options).size(),
+        megabytes / best_encode, best_encode * 1e3,
+        megabytes / best_decode, best_decode * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        std::cout << "Usage: EasyLSB_bench <image filename>" <<
+            " <message filename> [<runs>]\n";
+        return -1;
+    }
+    std::ifstream in(argv[2], std::ios::binary);
+    if (!in) {
+        std::cout << "Cannot open message file!\n";
+        return -1;
+    }
+    const std::string msg((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    const int runs = argc == 4 ? std::stoi(argv[3]) : 10;
+    PayloadOptions plain;
+    PayloadOptions compressed;
+    compressed.compress = true;
+    PayloadOptions encrypted;
+    encrypted.secret = "benchmark passphrase";
+    PayloadOptions corrected;
+    corrected.parity = 32;
+    PayloadOptions scattered = encrypted;
+    scattered.scatter = true;
+    std::printf("%zu byte message, best of %d runs\n", msg.size(), runs);
+    run("plain", argv[1], msg, plain, runs);
+    run("compressed", argv[1], msg, compressed, runs);
+    run("encrypted", argv[1], msg, encrypted, runs);
+    run("reed-solomon", argv[1], msg, corrected, runs);
+    run("scattered", argv[1], msg, scattered, runs);
+    return 0;
+}
@@ -0,0 +1,338 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+carrier.cpp
+
+Bitmaps handled in place in their file. See carrier.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "carrier.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <stdexcept>
+
+#include "carrier_cache.h"
+#include "channel_order.h"
+
+// Sizes of the two bitmap headers.
+static const size_t FILE_HEADER_SIZE = 14;
+static const size_t INFO_HEADER_SIZE = 40;
+// BI_RGB, i.e. no compression.
+static const uint32_t BI_RGB = 0;
+
+static uint32_t load_le32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[3]) << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static uint16_t load_le16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[1] << 8 | p[0]);
+}
+
+// Reads exactly size bytes at offset, or throws.
+static void read_fully(int fd, uint8_t* data, size_t size, size_t offset) {
+    while (size > 0) {
+        const ssize_t n = pread(fd, data, size, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            throw std::runtime_error("Cannot read input image!\n");
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<size_t>(n);
+    }
+}
+
+Carrier::Carrier(const char* filename, CarrierCache* cache)
+    : path(filename), fd(::open(filename, O_RDONLY | O_CLOEXEC)),
+    file_size(0), window_offset(0), window_rows(0), mapping(nullptr) {
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open input image!\n");
+    }
+    try {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw std::runtime_error("Cannot read input image!\n");
+        }
+        file_size = static_cast<size_t>(st.st_size);
+        if (cache) {
+            cached = cache->get(fd, st);
+        }
+        if (cached) {
+            raster = cached->raster;
+            return;
+        }
+        uint8_t header[FILE_HEADER_SIZE + INFO_HEADER_SIZE] = {0};
+        const size_t header_size =
+            file_size < sizeof(header) ? file_size : sizeof(header);
+        read_fully(fd, header, header_size, 0);
+        raster = parse_bitmap(header, header_size, file_size);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+Carrier::Carrier(const char* filename,
+    std::shared_ptr<const CachedImage> file)
+    : path(filename), fd(-1), raster(file->raster),
+    file_size(file->bytes.size()), window_offset(0), window_rows(0),
+    mapping(nullptr), cached(std::move(file)) {}
+
+Carrier::~Carrier() {
+    if (mapping) {
+        ::munmap(mapping, file_size);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+/*
+The file header is "BM", the file size, 4 reserved bytes and the
+offset of the pixel array. The info header that follows is at least
+a BITMAPINFOHEADER (later versions only add fields at the end):
+its size, width, height (negative for top-down), planes, bits per
+pixel and compression, all little endian.
+*/
+RasterLayout Carrier::parse_bitmap(const uint8_t* header,
+    size_t header_size, size_t file_size) {
+    if (header_size < FILE_HEADER_SIZE + INFO_HEADER_SIZE ||
+        header[0] != 'B' || header[1] != 'M') {
+        throw std::runtime_error("Unsupported image format!\n");
+    }
+    const uint8_t* info = header + FILE_HEADER_SIZE;
+    const int32_t width = static_cast<int32_t>(load_le32(info + 4));
+    const int32_t height = static_cast<int32_t>(load_le32(info + 8));
+    const uint16_t bits_per_pixel = load_le16(info + 14);
+    if (load_le32(info) < INFO_HEADER_SIZE ||
+        load_le32(info + 16) != BI_RGB || width <= 0 || height == 0 ||
+        (bits_per_pixel != 24 && bits_per_pixel != 48)) {
+        throw std::runtime_error("Unsupported bitmap image!\n");
+    }
+    RasterLayout raster;
+    raster.data_offset = load_le32(header + 10);
+    raster.rows = height < 0 ? -static_cast<int64_t>(height) : height;
+    raster.bottom_up = height > 0;
+    raster.row_channels = static_cast<size_t>(width) * 3;
+    raster.bytes_per_sample = bits_per_pixel / 24;
+    raster.little_endian = true;
+    raster.bgr = true;
+    raster.channel_bits = raster.bytes_per_sample * 8;
+    // Rows are padded to a multiple of 4 bytes.
+    raster.stride = (raster.row_channels * raster.bytes_per_sample + 3) &
+        ~static_cast<size_t>(3);
+    if (raster.data_offset > file_size ||
+        (file_size - raster.data_offset) / raster.stride < raster.rows) {
+        throw std::runtime_error("Bitmap image data is truncated!\n");
+    }
+    return raster;
+}
+
+const RasterLayout& Carrier::layout() const {
+    return raster;
+}
+
+void Carrier::read_at(uint8_t* data, size_t size, size_t offset) const {
+    if (cached) {
+        std::copy(cached->bytes.begin() + offset,
+            cached->bytes.begin() + offset + size, data);
+    } else {
+        read_fully(fd, data, size, offset);
+    }
+}
+
+/*
+fd was opened read-only, if at all, so a writable mapping, or one of
+a file that was read whole, needs the file opened again; the mapping
+keeps it open after that. Every row then counts as
+loaded, and row() points into the mapping.
+*/
+void Carrier::map(bool writable) {
+    const bool reopen = writable || fd < 0;
+    const int map_fd = reopen ? ::open(path.c_str(),
+        (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC) : fd;
+    if (map_fd < 0) {
+        throw std::runtime_error("Cannot open output image!\n");
+    }
+    void* p = ::mmap(nullptr, file_size,
+        writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, map_fd, 0);
+    if (reopen) {
+        ::close(map_fd);
+    }
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("Cannot map image!\n");
+    }
+    mapping = static_cast<uint8_t*>(p);
+    window.clear();
+    original.clear();
+    window_offset = 0;
+    window_rows = raster.rows;
+}
+
+/*
+Traversal rows [0, count) are stored next to each other: at the end
+of the pixel array for a bottom-up bitmap, at its start otherwise.
+Rows already loaded may have been embedded into, so only the new rows
+are read, in front of the window for a bottom-up bitmap and after it
+otherwise. The window at least doubles each time, so a stream
+embedded a piece at a time isn't copied over and over.
+*/
+void Carrier::load_rows(size_t count) {
+    if (count > raster.rows) {
+        count = raster.rows;
+    }
+    if (count <= window_rows || mapping) {
+        return;
+    }
+    count = std::min(std::max(count, 2 * window_rows), raster.rows);
+    const size_t added = (count - window_rows) * raster.stride;
+    std::vector<uint8_t> rows(added);
+    if (raster.bottom_up) {
+        const size_t offset = raster.row_offset(count - 1);
+        read_at(rows.data(), added, offset);
+        window.insert(window.begin(), rows.begin(), rows.end());
+        original.insert(original.begin(), rows.begin(), rows.end());
+        window_offset = offset;
+    } else {
+        read_at(rows.data(), added, raster.row_offset(window_rows));
+        window.insert(window.end(), rows.begin(), rows.end());
+        original.insert(original.end(), rows.begin(), rows.end());
+        window_offset = raster.row_offset(0);
+    }
+    window_rows = count;
+}
+
+uint8_t* Carrier::row(size_t row) {
+    return (mapping ? mapping : window.data()) +
+        (raster.row_offset(row) - window_offset);
+}
+
+const uint8_t* Carrier::row(size_t row) const {
+    return (mapping ? mapping : window.data()) +
+        (raster.row_offset(row) - window_offset);
+}
+
+/*
+Rows past the last channel of the stream aren't read or touched at
+all, so a short message only ever visits the top few rows. A piece of
+the stream only visits the rows its channels are in. In a keyed order
+the rows are counted in that order, and they could be anywhere, so
+the whole image is loaded.
+*/
+void Carrier::embed(const StreamLayout& layout, const uint8_t* stream) {
+    ChannelRun runs[2];
+    const size_t count = stream_channel_runs(layout, runs);
+    const size_t channels = raster.row_channels;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t end = (runs[i].first + runs[i].count + channels - 1) /
+            channels;
+        load_rows(layout.order ? raster.rows : end);
+        embed_rows(layout, stream, runs[i].first / channels, end);
+    }
+}
+
+void Carrier::embed_rows(const StreamLayout& layout, const uint8_t* stream,
+    size_t first_row, size_t end_row) {
+    const size_t channels = raster.row_channels;
+    for (size_t r = first_row; r < end_row; ++r) {
+        if (layout.order) {
+            layout.order->embed_row(row(layout.order->physical_row(r)), r,
+                layout, stream);
+        } else {
+            embed_samples(row(r), r * channels, channels, layout, stream);
+        }
+    }
+}
+
+/*
+Extracting doesn't need the rows afterwards, so rows past the loaded
+ones are read straight from the file, just the ones the run covers,
+rather than loading every row before them too. Reading a small range
+out of the middle of a large message then only reads its few rows.
+*/
+void Carrier::extract(const StreamLayout& layout, uint8_t* stream) {
+    ChannelRun runs[2];
+    const size_t count = stream_channel_runs(layout, runs);
+    const size_t channels = raster.row_channels;
+    for (size_t i = 0; i < count; ++i) {
+        const size_t first = runs[i].first / channels;
+        const size_t end = (runs[i].first + runs[i].count + channels - 1) /
+            channels;
+        if (layout.order) {
+            load_rows(raster.rows);
+            for (size_t r = first; r < end; ++r) {
+                layout.order->extract_row(row(layout.order->physical_row(r)),
+                    r, layout, stream);
+            }
+            continue;
+        }
+        for (size_t r = first; r < std::min(end, window_rows); ++r) {
+            extract_samples(row(r), r * channels, channels, layout, stream);
+        }
+        if (end <= window_rows) {
+            continue;
+        }
+        // Rows [unloaded, end) are next to each other in the file.
+        const size_t unloaded = std::max(first, window_rows);
+        const size_t offset =
+            raster.row_offset(raster.bottom_up ? end - 1 : unloaded);
+        std::vector<uint8_t> rows((end - unloaded) * raster.stride);
+        read_at(rows.data(), rows.size(), offset);
+        for (size_t r = unloaded; r < end; ++r) {
+            extract_samples(rows.data() + (raster.row_offset(r) - offset),
+                r * channels, channels, layout, stream);
+        }
+    }
+}
+
+void Carrier::save(const char* filename,
+    const OutputOptions& options) const {
+    if (mapping) {
+        if (options.sync && ::msync(mapping, file_size, MS_SYNC) != 0) {
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+        return;
+    }
+    std::error_code ec;
+    if (std::filesystem::equivalent(path, filename, ec)) {
+        // Encoding in place: the rest of the file is already right.
+        OutputFile out(filename, options, OutputFile::Mode::PATCH);
+        out.write_at(window.data(), window.size(), window_offset);
+        out.close();
+        return;
+    }
+    OutputFile out(filename, options);
+    if (cached) {
+        // The file is in memory already: write it around the window.
+        uint8_t* bytes = const_cast<uint8_t*>(cached->bytes.data());
+        const size_t end = window_offset + window.size();
+        iovec pieces[3] = {{bytes, window_offset},
+            {const_cast<uint8_t*>(window.data()), window.size()},
+            {bytes + end, file_size - end}};
+        out.write(pieces, 3);
+    } else {
+        out.copy_from(fd);
+        out.write_at(window.data(), window.size(), window_offset);
+    }
+    out.close();
+}
+
+Patch Carrier::diff() const {
+    if (mapping) {
+        throw std::runtime_error("Mapped images can't be patched!\n");
+    }
+    Patch patch(file_size);
+    patch.add_differences(original.data(), window.data(), window.size(),
+        window_offset);
+    return patch;
+}
@@ -0,0 +1,169 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+carrier.h
+
+Carriers that are loaded whole rather than streamed: bitmaps.
+
+Bitmaps store rows bottom-up, each padded to a multiple of 4 bytes,
+and pixels as blue, green, red. Rather than copying the pixels out
+into top-down rows and back again, the carrier maps EasyLSB's
+traversal row r (counting from the top) onto the stored row through
+the stride, and the kernel (lsb_kernel.h) handles the blue, green,
+red order, so it works right in the bytes read from the file.
+
+Only the headers and the rows that hold part of the message are ever
+read: a short message touches a handful of rows at the top of the
+image, which are one contiguous range of the file. Saving clones the
+input (a reflink where the filesystem supports it) and writes just
+that range over the clone, or over the input itself when encoding in
+place. The carrier also keeps the range as it was read, so it can
+tell exactly which bytes encoding changed (see patch.h).
+
+Alternatively, the carrier can work on a shared mapping of the whole
+file (map()), reading and embedding straight into the page cache, or
+the shared memory of a memfd, with no copy in between. Embedding into
+a writable mapping changes the file itself, so it is only for encoding
+in place, and it keeps no copy of the original rows to patch from.
+
+Supported are uncompressed 24 bit bitmaps (8 bit channels) and
+48 bit bitmaps (16 bit channels, least significant byte first),
+stored either bottom-up or top-down.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef CARRIER_H_
+#define CARRIER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lsb_kernel.h"
+#include "output_file.h"
+#include "patch.h"
+
+class CarrierCache;
+struct CachedImage;
+
+// Where an uncompressed image keeps its samples within its file.
+struct RasterLayout {
+    // File offset of the first stored row.
+    size_t data_offset;
+    // Bytes from one stored row to the next, padding included.
+    size_t stride;
+    size_t rows;
+    // True if the first stored row is the bottom row of the image.
+    bool bottom_up;
+    // Channels (samples) in one row.
+    size_t row_channels;
+    size_t bytes_per_sample;
+    bool little_endian;
+    bool bgr;
+    // Usable bit planes per channel.
+    size_t channel_bits;
+
+    // File offset of traversal row row (0 is the top row).
+    size_t row_offset(size_t row) const {
+        return data_offset + (bottom_up ? rows - 1 - row : row) * stride;
+    }
+    size_t num_channels() const {
+        return row_channels * rows;
+    }
+    // The kernel's view of a stream_bits long stream in this image.
+    StreamLayout stream_layout(size_t stream_bits) const {
+        return {num_channels(), channel_bits, bytes_per_sample,
+            little_endian, bgr, stream_bits};
+    }
+};
+
+class Carrier {
+ private:
+    std::string path;
+    // Kept open so rows can be read as they are needed.
+    int fd;
+    RasterLayout raster;
+    size_t file_size;
+    /*
+    Stored bytes of traversal rows [0, window_rows), exactly as they
+    are on disk, starting at file offset window_offset.
+    */
+    std::vector<uint8_t> window;
+    size_t window_offset;
+    size_t window_rows;
+    // The window as it was read, before anything was embedded into it.
+    std::vector<uint8_t> original;
+    // The whole file, once mapped; the window is unused then.
+    uint8_t* mapping;
+    // The whole file as it was read into a cache, if it came from one.
+    std::shared_ptr<const CachedImage> cached;
+
+    // Reads size bytes at offset, from the cached file if there is one.
+    void read_at(uint8_t* data, size_t size, size_t offset) const;
+
+ public:
+    /*
+    Opens filename and parses its headers, without reading any pixels.
+    With a cache (carrier_cache.h), the file is looked up in it, or read
+    into it whole, and rows are copied from there rather than read.
+    */
+    explicit Carrier(const char* filename, CarrierCache* cache = nullptr);
+    /*
+    A bitmap already read whole into file, as by a FileReader
+    (file_reader.h), so nothing is read from filename, which is only
+    kept to tell whether saving is in place.
+    */
+    Carrier(const char* filename, std::shared_ptr<const CachedImage> file);
+    ~Carrier();
+    Carrier(const Carrier&) = delete;
+    Carrier& operator=(const Carrier&) = delete;
+    /*
+    Works out where the samples of a bitmap are from its headers,
+    given at least the first header_size bytes of a file_size byte file.
+    Throws std::runtime_error if it isn't a supported bitmap.
+    */
+    static RasterLayout parse_bitmap(const uint8_t* header,
+        size_t header_size, size_t file_size);
+    const RasterLayout& layout() const;
+    /*
+    Maps the whole file, shared, before any rows are loaded, so every
+    row is read from and embedded into the file itself. writable is
+    for encoding in place. Throws std::runtime_error if it can't be.
+    */
+    void map(bool writable);
+    // Reads traversal rows [0, count) with one pread(), if not read yet.
+    void load_rows(size_t count);
+    // Samples of traversal row row, which must have been loaded.
+    uint8_t* row(size_t row);
+    const uint8_t* row(size_t row) const;
+    /*
+    Runs the kernel over every row that holds part of the stream, or
+    of the piece of it layout.first_bit says stream starts at.
+    */
+    void embed(const StreamLayout& layout, const uint8_t* stream);
+    /*
+    Runs the kernel over traversal rows [first_row, end_row) only
+    (counted in layout's order, if it has one), which must be loaded.
+    Nothing else is touched, so different rows can be embedded into
+    from different threads at once.
+    */
+    void embed_rows(const StreamLayout& layout, const uint8_t* stream,
+        size_t first_row, size_t end_row);
+    void extract(const StreamLayout& layout, uint8_t* stream);
+    /*
+    Writes the image out to filename: a clone of the input with the
+    loaded rows written over it, or just those rows if filename is
+    the input file itself. A mapped image was embedded into in place,
+    so there is nothing left to write but to sync it, if asked.
+    */
+    void save(const char* filename, const OutputOptions& options) const;
+    /*
+    The bytes of the loaded rows that differ from the input file.
+    Throws std::runtime_error for a mapped image.
+    */
+    Patch diff() const;
+};
+
+#endif  // CARRIER_H_
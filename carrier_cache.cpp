@@ -0,0 +1,108 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+carrier_cache.cpp
+
+The least recently used bitmaps cache. See carrier_cache.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "carrier_cache.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <iterator>
+#include <stdexcept>
+
+static int64_t modified_time(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+        st.st_mtim.tv_nsec;
+}
+
+std::shared_ptr<const CachedImage> image_from_bytes(const uint8_t* data,
+    size_t size) {
+    auto image = std::make_shared<CachedImage>();
+    image->bytes.assign(data, data + size);
+    image->raster = Carrier::parse_bitmap(data, size, size);
+    image->size = static_cast<off_t>(size);
+    image->modified = 0;
+    return image;
+}
+
+CarrierCache::CarrierCache(size_t budget) {
+    counters.budget = budget;
+}
+
+void CarrierCache::drop(std::list<Entry>::iterator entry) {
+    counters.bytes -= entry->second->bytes.size();
+    --counters.entries;
+    ++counters.evictions;
+    index.erase(entry->first);
+    entries.erase(entry);
+}
+
+/*
+The file is read without the lock held, so other threads aren't held
+up behind a large read. Two threads missing the same file at once
+both read it, and the second one to finish replaces the first's entry.
+*/
+std::shared_ptr<const CachedImage> CarrierCache::get(int fd,
+    const struct stat& st) {
+    const Key key(st.st_dev, st.st_ino);
+    const int64_t modified = modified_time(st);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto found = index.find(key);
+        if (found != index.end()) {
+            const std::shared_ptr<const CachedImage>& image =
+                found->second->second;
+            if (image->size == st.st_size && image->modified == modified) {
+                ++counters.hits;
+                entries.splice(entries.begin(), entries, found->second);
+                return image;
+            }
+            drop(found->second);
+        }
+        ++counters.misses;
+        if (static_cast<size_t>(st.st_size) > counters.budget) {
+            return nullptr;
+        }
+    }
+    auto image = std::make_shared<CachedImage>();
+    image->size = st.st_size;
+    image->modified = modified;
+    image->bytes.resize(static_cast<size_t>(st.st_size));
+    size_t done = 0;
+    while (done < image->bytes.size()) {
+        const ssize_t n = ::pread(fd, image->bytes.data() + done,
+            image->bytes.size() - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            throw std::runtime_error("Cannot read input image!\n");
+        }
+        done += static_cast<size_t>(n);
+    }
+    image->raster = Carrier::parse_bitmap(image->bytes.data(),
+        image->bytes.size(), image->bytes.size());
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto found = index.find(key);
+    if (found != index.end()) {
+        drop(found->second);
+    }
+    while (counters.bytes + image->bytes.size() > counters.budget) {
+        drop(std::prev(entries.end()));
+    }
+    entries.emplace_front(key, image);
+    index[key] = entries.begin();
+    counters.bytes += image->bytes.size();
+    ++counters.entries;
+    return image;
+}
+
+CacheStats CarrierCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
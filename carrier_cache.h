@@ -0,0 +1,99 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+carrier_cache.h
+
+A bounded cache of bitmaps, for a long running process (the daemon,
+see daemon.h) that keeps encoding messages into the same few template
+images.
+
+Each entry is a whole bitmap file as it is on disk, along with its
+parsed layout, so a carrier (carrier.h) opened on a cached file skips
+parsing the headers and copies its rows out of memory instead of
+reading them from the file. Entries are found by device and inode,
+and only used while the file's size and modification time are what
+they were when it was read; a file that has been written to since is
+read again. The least recently used entries are dropped to keep the
+cache within its memory budget, and a file larger than the whole
+budget isn't cached at all.
+
+The cache is shared by every thread; the entries themselves are never
+changed once read, so a carrier keeps using one safely even after it
+has been dropped from the cache.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef CARRIER_CACHE_H_
+#define CARRIER_CACHE_H_
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "carrier.h"
+
+// A bitmap file as it was read, and its layout.
+struct CachedImage {
+    std::vector<uint8_t> bytes;
+    RasterLayout raster;
+    // What the file was when it was read, to tell if it has changed.
+    off_t size;
+    int64_t modified;
+};
+
+struct CacheStats {
+    // Carriers opened from a cached file, and those that weren't.
+    size_t hits = 0;
+    size_t misses = 0;
+    // Entries dropped to make room, or because their file changed.
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget = 0;
+};
+
+/*
+A bitmap file that has already been read whole, size bytes at data, as
+a CachedImage of its own, outside any cache. Throws std::runtime_error
+if it isn't a supported bitmap.
+*/
+std::shared_ptr<const CachedImage> image_from_bytes(const uint8_t* data,
+    size_t size);
+
+class CarrierCache {
+ private:
+    using Key = std::pair<dev_t, ino_t>;
+    using Entry = std::pair<Key, std::shared_ptr<const CachedImage>>;
+
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::map<Key, std::list<Entry>::iterator> index;
+    CacheStats counters;
+
+    // Drops entry, which mutex must be held for.
+    void drop(std::list<Entry>::iterator entry);
+
+ public:
+    // A cache holding up to budget bytes of files.
+    explicit CarrierCache(size_t budget);
+    CarrierCache(const CarrierCache&) = delete;
+    CarrierCache& operator=(const CarrierCache&) = delete;
+    /*
+    The bitmap open as fd, whose fstat() is st, from the cache, or read
+    into it if it isn't there or has changed. nullptr if it's too large
+    to cache. Throws std::runtime_error if it isn't a supported bitmap.
+    */
+    std::shared_ptr<const CachedImage> get(int fd, const struct stat& st);
+    CacheStats stats();
+};
+
+#endif  // CARRIER_CACHE_H_
@@ -0,0 +1,171 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+channel_order.cpp
+
+The keyed channel order. See channel_order.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "channel_order.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "crypto.h"
+
+namespace {
+
+/*
+Salt and PBKDF2 rounds for the order's key. The salt is fixed, since
+the order has to be found before anything stored in the image can be
+read; it differs from any salt encryption uses, so the order's key
+is unrelated to the message's.
+*/
+const char ORDER_SALT[] = "EasyLSB channel order";
+const uint32_t ORDER_KDF_ITERATIONS = 100000;
+
+// Random numbers from the ChaCha20 key stream, a buffer at a time.
+class KeyStream {
+ private:
+    uint8_t key[KEY_SIZE];
+    uint8_t nonce[NONCE_SIZE] = {};
+    uint32_t counter = 0;
+    uint8_t buffer[4096];
+    size_t used = sizeof(buffer);
+
+ public:
+    explicit KeyStream(const uint8_t stream_key[KEY_SIZE]) {
+        std::memcpy(key, stream_key, KEY_SIZE);
+    }
+    uint64_t next() {
+        if (used == sizeof(buffer)) {
+            std::memset(buffer, 0, sizeof(buffer));
+            chacha20_xor(key, nonce, counter, buffer, sizeof(buffer));
+            counter += sizeof(buffer) / 64;
+            used = 0;
+        }
+        // Little endian, so every host finds the same order.
+        uint64_t value = 0;
+        for (size_t i = sizeof(value); i > 0; --i) {
+            value = value << 8 | buffer[used + i - 1];
+        }
+        used += sizeof(value);
+        return value;
+    }
+    /*
+    A number in [0, n). The bias of taking 64 random bits modulo
+    n < 2^32 is under 2^-32, far too small to matter here.
+    */
+    uint32_t below(size_t n) {
+        return static_cast<uint32_t>(next() % n);
+    }
+};
+
+// 0, 1, ..., size - 1 in an order chosen by keys.
+std::vector<uint32_t> shuffled(size_t size, KeyStream* keys) {
+    std::vector<uint32_t> order(size);
+    for (size_t i = 0; i < size; ++i) {
+        order[i] = static_cast<uint32_t>(i);
+    }
+    for (size_t i = size; i > 1; --i) {
+        std::swap(order[i - 1], order[keys->below(i)]);
+    }
+    return order;
+}
+
+/*
+A row's channel offsets and gathered samples, kept from row to row
+so rows don't each allocate them. One per thread, since parts of an
+image are embedded by several threads at once.
+*/
+struct RowScratch {
+    std::vector<uint32_t> offsets;
+    std::vector<uint8_t> gathered;
+};
+thread_local RowScratch row_scratch;
+
+}  // namespace
+
+ChannelOrder::ChannelOrder(const std::string& secret, size_t rows,
+    size_t channels) : row_channels(channels), logical(rows) {
+    uint8_t key[KEY_SIZE];
+    pbkdf2_sha256(secret, reinterpret_cast<const uint8_t*>(ORDER_SALT),
+        sizeof(ORDER_SALT) - 1, ORDER_KDF_ITERATIONS, key, KEY_SIZE);
+    KeyStream keys(key);
+    physical = shuffled(rows, &keys);
+    for (size_t r = 0; r < rows; ++r) {
+        logical[physical[r]] = static_cast<uint32_t>(r);
+    }
+    positions = shuffled(channels, &keys);
+    shifts.resize(rows);
+    for (size_t r = 0; r < rows; ++r) {
+        shifts[r] = keys.below(channels);
+    }
+}
+
+size_t ChannelOrder::physical_row(size_t logical_row) const {
+    return physical[logical_row];
+}
+
+size_t ChannelOrder::logical_row(size_t physical_row) const {
+    return logical[physical_row];
+}
+
+/*
+Bitmaps store each pixel blue, green, red, so channel c of a row,
+counting red, green, blue, is stored at 3 * (c / 3) + 2 - c % 3.
+*/
+void ChannelOrder::row_offsets(size_t row, bool bgr,
+    std::vector<uint32_t>* offsets) const {
+    offsets->resize(row_channels);
+    size_t j = shifts[row];
+    for (size_t i = 0; i < row_channels; ++i) {
+        const uint32_t c = positions[j];
+        (*offsets)[i] = bgr ? c - c % 3 + 2 - c % 3 : c;
+        if (++j == row_channels) {
+            j = 0;
+        }
+    }
+}
+
+/*
+The gathered samples are contiguous and in kernel order, so they go
+through the kernel as the row_channels channels starting at
+row * row_channels, which are exactly the stream bits of the row.
+*/
+void ChannelOrder::embed_row(uint8_t* samples, size_t row,
+    const StreamLayout& layout, const uint8_t* stream) const {
+    const size_t bps = layout.bytes_per_sample;
+    std::vector<uint32_t>& offsets = row_scratch.offsets;
+    std::vector<uint8_t>& gathered = row_scratch.gathered;
+    row_offsets(row, layout.bgr, &offsets);
+    gathered.resize(row_channels * bps);
+    for (size_t i = 0; i < row_channels; ++i) {
+        std::memcpy(&gathered[i * bps], samples + offsets[i] * bps, bps);
+    }
+    StreamLayout in_order = layout;
+    in_order.bgr = false;
+    embed_samples(gathered.data(), row * row_channels, row_channels,
+        in_order, stream);
+    for (size_t i = 0; i < row_channels; ++i) {
+        std::memcpy(samples + offsets[i] * bps, &gathered[i * bps], bps);
+    }
+}
+
+void ChannelOrder::extract_row(const uint8_t* samples, size_t row,
+    const StreamLayout& layout, uint8_t* stream) const {
+    const size_t bps = layout.bytes_per_sample;
+    std::vector<uint32_t>& offsets = row_scratch.offsets;
+    std::vector<uint8_t>& gathered = row_scratch.gathered;
+    row_offsets(row, layout.bgr, &offsets);
+    gathered.resize(row_channels * bps);
+    for (size_t i = 0; i < row_channels; ++i) {
+        std::memcpy(&gathered[i * bps], samples + offsets[i] * bps, bps);
+    }
+    StreamLayout in_order = layout;
+    in_order.bgr = false;
+    extract_samples(gathered.data(), row * row_channels, row_channels,
+        in_order, stream);
+}
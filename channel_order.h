@@ -0,0 +1,73 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+channel_order.h
+
+A keyed order to embed the stream in, so that instead of filling the
+image from the top left, the message is spread all over it in a way
+only someone with the passphrase or key file can retrace.
+
+Shuffling every channel would take a table as large as the image and
+turn each bit into a cache miss. Instead, the image's rows are the
+blocks of a two level permutation: the rows are shuffled, and within
+each row the channels are shuffled, by one shuffle of a row's worth of
+positions that every row rotates by its own keyed amount. That takes
+a table per row and per channel of a row, no matter how large the
+image is, and the kernel still sees whole rows: a row's samples are
+gathered into the shuffled order, run through the kernel as if they
+were the row the stream would otherwise fill (lsb_kernel.h), and
+scattered back.
+
+The shuffles are Fisher-Yates, driven by ChaCha20 keyed by PBKDF2
+of the secret, so the order is no easier to guess than the key. It
+hides where the message is; keeping what it says secret is still
+the job of encryption (payload.h).
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef CHANNEL_ORDER_H_
+#define CHANNEL_ORDER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lsb_kernel.h"
+
+class ChannelOrder {
+ private:
+    size_t row_channels;
+    // Physical row of each logical row, and the other way around.
+    std::vector<uint32_t> physical;
+    std::vector<uint32_t> logical;
+    // The shuffled channels of a row.
+    std::vector<uint32_t> positions;
+    // How far each logical row rotates positions.
+    std::vector<uint32_t> shifts;
+
+    /*
+    Offsets, in samples, of the channels of a row in the order the
+    kernel walks logical row row, given how the row stores its pixels.
+    */
+    void row_offsets(size_t row, bool bgr,
+        std::vector<uint32_t>* offsets) const;
+
+ public:
+    // The order secret gives an image of rows rows of channels each.
+    ChannelOrder(const std::string& secret, size_t rows, size_t channels);
+    size_t physical_row(size_t logical_row) const;
+    size_t logical_row(size_t physical_row) const;
+    /*
+    Writes the bits of stream that belong to logical row row into
+    samples, which point at the row physical_row(row).
+    */
+    void embed_row(uint8_t* samples, size_t row, const StreamLayout& layout,
+        const uint8_t* stream) const;
+    // Reverse of embed_row(). stream must start out zeroed.
+    void extract_row(const uint8_t* samples, size_t row,
+        const StreamLayout& layout, uint8_t* stream) const;
+};
+
+#endif  // CHANNEL_ORDER_H_
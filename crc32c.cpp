@@ -0,0 +1,102 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+crc32c.cpp
+
+CRC-32C with SSE4.2 or lookup tables. See crc32c.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C polynomial, bit reversed.
+static const uint32_t POLYNOMIAL = 0x82F63B78;
+
+/*
+tables[0] is the usual byte at a time table; tables[k] advances the
+CRC of a byte over k more zero bytes, so 8 bytes can be looked up
+at once and XORed together.
+*/
+struct CrcTables {
+    uint32_t tables[8][256];
+
+    CrcTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc & 1 ? crc >> 1 ^ POLYNOMIAL : crc >> 1;
+            }
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                const uint32_t crc = tables[k - 1][i];
+                tables[k][i] = crc >> 8 ^ tables[0][crc & 0xFF];
+            }
+        }
+    }
+};
+
+static uint32_t crc32c_tables(uint32_t crc, const uint8_t* data,
+    size_t size) {
+    static const CrcTables crc_tables;
+    const uint32_t (*t)[256] = crc_tables.tables;
+    while (size >= 8) {
+        const uint32_t low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+            static_cast<uint32_t>(data[3]) << 24);
+        crc = t[7][low & 0xFF] ^ t[6][low >> 8 & 0xFF] ^
+            t[5][low >> 16 & 0xFF] ^ t[4][low >> 24] ^
+            t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = crc >> 8 ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data,
+    size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+using CrcCore = uint32_t (*)(uint32_t crc, const uint8_t* data, size_t size);
+
+static CrcCore pick_crc_core() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_tables;
+}
+
+static const CrcCore crc32c_core = pick_crc_core();
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t size) {
+    return ~crc32c_core(~crc, data, size);
+}
@@ -0,0 +1,29 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+crc32c.h
+
+CRC-32C (Castagnoli), the checksum EasyLSB keeps of every payload so
+decoding can tell a message from a damaged one, or from an image
+that never held one.
+
+Processors with SSE4.2 have an instruction for it that does 8 bytes
+at a time; elsewhere it is computed with lookup tables, 8 bytes at a
+time as well (slicing by 8). Which one is used is decided at load time.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+CRC-32C of size bytes of data, continuing from crc, the CRC of the
+bytes before them (0 to start with).
+*/
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t size);
+
+#endif  // CRC32C_H_
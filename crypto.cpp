@@ -0,0 +1,845 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+crypto.cpp
+
+ChaCha20-Poly1305, SHA-256 and PBKDF2. See crypto.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "crypto.h"
+
+#include <sys/random.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+// 128 bit products for Poly1305.
+__extension__ typedef unsigned __int128 uint128;
+
+static uint32_t load_le32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[3]) << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static void store_le32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+    p[2] = static_cast<uint8_t>(value >> 16);
+    p[3] = static_cast<uint8_t>(value >> 24);
+}
+
+static uint64_t load_le64(const uint8_t* p) {
+    return static_cast<uint64_t>(load_le32(p + 4)) << 32 | load_le32(p);
+}
+
+static void store_le64(uint8_t* p, uint64_t value) {
+    store_le32(p, static_cast<uint32_t>(value));
+    store_le32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+static uint32_t rotl32(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+/*
+SHA-256 (FIPS 180-4).
+*/
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+namespace {
+
+class Sha256 {
+ private:
+    uint32_t state[8];
+    uint8_t buffer[64];
+    size_t buffered;
+    uint64_t total;
+
+    void compress(const uint8_t* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = static_cast<uint32_t>(block[4 * i]) << 24 |
+                block[4 * i + 1] << 16 | block[4 * i + 2] << 8 |
+                block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const uint32_t s0 = rotl32(w[i - 15], 25) ^
+                rotl32(w[i - 15], 14) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotl32(w[i - 2], 15) ^
+                rotl32(w[i - 2], 13) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            const uint32_t s1 = rotl32(e, 26) ^ rotl32(e, 21) ^ rotl32(e, 7);
+            const uint32_t ch = (e & f) ^ (~e & g);
+            const uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+            const uint32_t s0 = rotl32(a, 30) ^ rotl32(a, 19) ^ rotl32(a, 10);
+            const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+ public:
+    Sha256() : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+        buffered(0), total(0) {}
+
+    void update(const uint8_t* data, size_t size) {
+        total += size;
+        if (buffered > 0) {
+            const size_t take = size < 64 - buffered ? size : 64 - buffered;
+            std::memcpy(buffer + buffered, data, take);
+            buffered += take;
+            data += take;
+            size -= take;
+            if (buffered < 64) {
+                return;
+            }
+            compress(buffer);
+            buffered = 0;
+        }
+        for (; size >= 64; data += 64, size -= 64) {
+            compress(data);
+        }
+        std::memcpy(buffer, data, size);
+        buffered = size;
+    }
+
+    void finish(uint8_t out[SHA256_SIZE]) {
+        const uint64_t bits = total * 8;
+        const uint8_t one = 0x80;
+        update(&one, 1);
+        const uint8_t zero = 0;
+        while (buffered != 56) {
+            update(&zero, 1);
+        }
+        uint8_t length[8];
+        for (int i = 0; i < 8; ++i) {
+            length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+            out[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+            out[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+            out[4 * i + 3] = static_cast<uint8_t>(state[i]);
+        }
+    }
+};
+
+// HMAC-SHA-256 with the key's inner and outer states computed once.
+class HmacSha256 {
+ private:
+    Sha256 inner;
+    Sha256 outer;
+
+ public:
+    HmacSha256(const uint8_t* key, size_t key_size) {
+        uint8_t block[64] = {0};
+        if (key_size > 64) {
+            sha256(key, key_size, block);
+        } else {
+            std::memcpy(block, key, key_size);
+        }
+        uint8_t pad[64];
+        for (int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x36;
+        }
+        inner.update(pad, 64);
+        for (int i = 0; i < 64; ++i) {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        outer.update(pad, 64);
+    }
+
+    // MAC of data under the key, leaving the key's states as they were.
+    void mac(const uint8_t* data, size_t size,
+        uint8_t out[SHA256_SIZE]) const {
+        Sha256 in = inner;
+        in.update(data, size);
+        uint8_t digest[SHA256_SIZE];
+        in.finish(digest);
+        Sha256 out_hash = outer;
+        out_hash.update(digest, SHA256_SIZE);
+        out_hash.finish(out);
+    }
+};
+
+}  // namespace
+
+void sha256(const uint8_t* data, size_t size, uint8_t out[SHA256_SIZE]) {
+    Sha256 hash;
+    hash.update(data, size);
+    hash.finish(out);
+}
+
+void pbkdf2_sha256(const std::string& secret, const uint8_t* salt,
+    size_t salt_size, uint32_t iterations, uint8_t* out, size_t out_size) {
+    const HmacSha256 hmac(reinterpret_cast<const uint8_t*>(secret.data()),
+        secret.size());
+    std::string first(reinterpret_cast<const char*>(salt), salt_size);
+    first.append(4, '\0');
+    for (uint32_t block = 1; out_size > 0; ++block) {
+        for (int i = 0; i < 4; ++i) {
+            first[salt_size + i] = static_cast<char>(block >> (24 - 8 * i));
+        }
+        uint8_t u[SHA256_SIZE];
+        uint8_t t[SHA256_SIZE];
+        hmac.mac(reinterpret_cast<const uint8_t*>(first.data()),
+            first.size(), u);
+        std::memcpy(t, u, SHA256_SIZE);
+        for (uint32_t i = 1; i < iterations; ++i) {
+            hmac.mac(u, SHA256_SIZE, u);
+            for (size_t j = 0; j < SHA256_SIZE; ++j) {
+                t[j] ^= u[j];
+            }
+        }
+        const size_t take = out_size < SHA256_SIZE ? out_size : SHA256_SIZE;
+        std::memcpy(out, t, take);
+        out += take;
+        out_size -= take;
+    }
+}
+
+/*
+ChaCha20 (RFC 8439, section 2.4).
+*/
+
+static const size_t CHACHA_BLOCK = 64;
+
+static void chacha20_setup(uint32_t state[16], const uint8_t key[KEY_SIZE],
+    const uint8_t nonce[NONCE_SIZE], uint32_t counter) {
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; ++i) {
+        state[4 + i] = load_le32(key + 4 * i);
+    }
+    state[12] = counter;
+    for (int i = 0; i < 3; ++i) {
+        state[13 + i] = load_le32(nonce + 4 * i);
+    }
+}
+
+#define QUARTER_ROUND(x, a, b, c, d) \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTL(x[d], 16); \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTL(x[b], 12); \
+    x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTL(x[d], 8); \
+    x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTL(x[b], 7);
+
+#define DOUBLE_ROUND(x) \
+    QUARTER_ROUND(x, 0, 4, 8, 12) \
+    QUARTER_ROUND(x, 1, 5, 9, 13) \
+    QUARTER_ROUND(x, 2, 6, 10, 14) \
+    QUARTER_ROUND(x, 3, 7, 11, 15) \
+    QUARTER_ROUND(x, 0, 5, 10, 15) \
+    QUARTER_ROUND(x, 1, 6, 11, 12) \
+    QUARTER_ROUND(x, 2, 7, 8, 13) \
+    QUARTER_ROUND(x, 3, 4, 9, 14)
+
+// One block of key stream, for the tail and the Poly1305 key.
+static void chacha20_block(const uint32_t state[16],
+    uint8_t out[CHACHA_BLOCK]) {
+#define ROTL(v, n) rotl32(v, n)
+    uint32_t x[16];
+    std::memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; ++i) {
+        DOUBLE_ROUND(x)
+    }
+    for (int i = 0; i < 16; ++i) {
+        store_le32(out + 4 * i, x[i] + state[i]);
+    }
+#undef ROTL
+}
+
+// Word i of 8 and of 16 consecutive blocks.
+typedef uint32_t Lanes8 __attribute__((vector_size(32)));
+typedef uint32_t Lanes16 __attribute__((vector_size(64)));
+
+/*
+XORs LANES blocks of key stream, from block counter state[12], into
+data. Word i of every block sits in x[i], one block per lane, so each
+vector instruction works on all LANES blocks at once.
+*/
+template <class Lanes>
+__attribute__((always_inline))
+inline void chacha20_lanes(const uint32_t state[16], uint8_t* data) {
+    const size_t LANES = sizeof(Lanes) / sizeof(uint32_t);
+#define ROTL(v, n) ((v) << (n) | (v) >> (32 - (n)))
+    Lanes x[16];
+    Lanes start[16];
+    for (int i = 0; i < 16; ++i) {
+        start[i] = Lanes{} + state[i];
+    }
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        start[12][lane] += static_cast<uint32_t>(lane);
+    }
+    std::memcpy(x, start, sizeof(x));
+    for (int i = 0; i < 10; ++i) {
+        DOUBLE_ROUND(x)
+    }
+    for (int i = 0; i < 16; ++i) {
+        x[i] += start[i];
+    }
+    // Words are XORed in memory order, so this needs a little endian host.
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        uint8_t* block = data + lane * CHACHA_BLOCK;
+        for (int i = 0; i < 16; ++i) {
+            uint32_t word;
+            std::memcpy(&word, block + 4 * i, sizeof(word));
+            word ^= x[i][lane];
+            std::memcpy(block + 4 * i, &word, sizeof(word));
+        }
+    }
+#undef ROTL
+}
+
+/*
+The vector core, built for the widest registers the processor has:
+16 blocks at a time in AVX-512's 32 registers, which also rotate in
+one instruction, 8 at a time otherwise (AVX2, or SSE2 where that's
+all there is). Returns how many blocks it did.
+*/
+typedef size_t (*ChaChaCore)(const uint32_t state[16], uint8_t* data);
+
+static size_t chacha20_lanes8(const uint32_t state[16], uint8_t* data) {
+    chacha20_lanes<Lanes8>(state, data);
+    return 8;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static size_t chacha20_avx2(const uint32_t state[16], uint8_t* data) {
+    chacha20_lanes<Lanes8>(state, data);
+    return 8;
+}
+
+__attribute__((target("avx512f")))
+static size_t chacha20_avx512(const uint32_t state[16], uint8_t* data) {
+    chacha20_lanes<Lanes16>(state, data);
+    return 16;
+}
+#endif
+
+static ChaChaCore pick_chacha_core() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return chacha20_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        return chacha20_avx2;
+    }
+#endif
+    return chacha20_lanes8;
+}
+
+static const ChaChaCore chacha20_core = pick_chacha_core();
+// Most blocks any core does at once.
+static const size_t CHACHA_MAX_LANES = 16;
+
+void chacha20_xor(const uint8_t key[KEY_SIZE],
+    const uint8_t nonce[NONCE_SIZE], uint32_t counter, uint8_t* data,
+    size_t size) {
+    uint32_t state[16];
+    chacha20_setup(state, key, nonce, counter);
+    const bool little_endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+    while (little_endian && size >= CHACHA_MAX_LANES * CHACHA_BLOCK) {
+        const size_t blocks = chacha20_core(state, data);
+        state[12] += static_cast<uint32_t>(blocks);
+        data += blocks * CHACHA_BLOCK;
+        size -= blocks * CHACHA_BLOCK;
+    }
+    uint8_t block[CHACHA_BLOCK];
+    while (size > 0) {
+        chacha20_block(state, block);
+        ++state[12];
+        const size_t take = size < CHACHA_BLOCK ? size : CHACHA_BLOCK;
+        for (size_t i = 0; i < take; ++i) {
+            data[i] ^= block[i];
+        }
+        data += take;
+        size -= take;
+    }
+}
+
+/*
+Poly1305 (RFC 8439, section 2.5), with the accumulator in three
+limbs of 44, 44 and 42 bits.
+
+Each block multiplies the accumulator by r, so block by block it is
+one long chain of dependent multiplications. With AVX2, runs of
+blocks go to a vector core instead, which keeps four accumulators in
+five 26 bit limbs, one per 64 bit lane, so the products fit
+vpmuludq's 32 x 32 bit multiplies. Lane j takes blocks j, j + 4,
+j + 8 and so on, multiplying by r^4 between them; at the end the
+lanes are multiplied by r^4, r^3, r^2 and r and added up, which
+comes to the same as going block by block.
+*/
+
+static const uint64_t MASK26 = 0x3ffffff;
+static const uint64_t MASK42 = 0x3ffffffffff;
+static const uint64_t MASK44 = 0xfffffffffff;
+
+// The accumulator h, in 44 bit limbs, as five 26 bit limbs.
+static void poly1305_split26(const uint64_t h[3], uint64_t out[5]) {
+    out[0] = h[0] & MASK26;
+    out[1] = (h[0] >> 26) + ((h[1] & 0xff) << 18);
+    out[2] = (h[1] >> 8) & MASK26;
+    out[3] = (h[1] >> 34) + ((h[2] & 0xffff) << 10);
+    out[4] = h[2] >> 16;
+}
+
+/*
+Five 26 bit limbs, each of them allowed a few bits more, back as
+44 bit limbs, carried as far as Poly1305::blocks() leaves them.
+*/
+static void poly1305_join26(const uint64_t limbs[5], uint64_t h[3]) {
+    uint64_t h0 = limbs[0] + ((limbs[1] & 0x3ffff) << 26);
+    uint64_t h1 = (limbs[1] >> 18) + (limbs[2] << 8) +
+        ((limbs[3] & 0x3ff) << 34);
+    uint64_t h2 = (limbs[3] >> 10) + (limbs[4] << 16);
+    uint64_t c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= MASK44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= MASK42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= MASK44;
+    h1 += c;
+    h[0] = h0;
+    h[1] = h1;
+    h[2] = h2;
+}
+
+// out = a * b mod 2^130 - 5, in 26 bit limbs.
+static void poly1305_mul26(const uint64_t a[5], const uint64_t b[5],
+    uint64_t out[5]) {
+    uint64_t d[5];
+    for (int i = 0; i < 5; ++i) {
+        d[i] = 0;
+        for (int j = 0; j < 5; ++j) {
+            // Limbs past the top wrap around times 5, as 2^130 = 5.
+            d[i] += a[j] * (j <= i ? b[i - j] : b[i + 5 - j] * 5);
+        }
+    }
+    uint64_t c = 0;
+    for (int i = 0; i < 5; ++i) {
+        d[i] += c;
+        c = d[i] >> 26;
+        out[i] = d[i] & MASK26;
+    }
+    out[0] += c * 5;
+    out[1] += out[0] >> 26;
+    out[0] &= MASK26;
+}
+
+/*
+Runs of blocks for the vector core, when there is one: it takes
+size bytes, a multiple of 64, of blocks with the 2^128 bit set, and
+returns false if it can't.
+*/
+typedef bool (*PolyCore)(uint64_t h[3], const uint64_t r[3],
+    const uint8_t* data, size_t size);
+// Bytes of blocks worth going to the vector core for.
+static const size_t POLY_VECTOR_MIN = 256;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Carries limb i of d into the next one, limb 4 into limb 0 times 5.
+__attribute__((target("avx2")))
+static inline void poly1305_carry(__m256i d[5], int i) {
+    __m256i c = _mm256_srli_epi64(d[i], 26);
+    d[i] = _mm256_and_si256(d[i], _mm256_set1_epi64x(MASK26));
+    if (i == 4) {
+        c = _mm256_add_epi64(c, _mm256_slli_epi64(c, 2));
+    }
+    d[(i + 1) % 5] = _mm256_add_epi64(d[(i + 1) % 5], c);
+}
+
+// h = h * r, in each lane, where s is 5 * r.
+__attribute__((target("avx2")))
+static inline void poly1305_mul_lanes(__m256i h[5], const __m256i r[5],
+    const __m256i s[5]) {
+    __m256i d[5];
+    for (int i = 0; i < 5; ++i) {
+        d[i] = _mm256_mul_epu32(h[0], r[i]);
+        for (int j = 1; j < 5; ++j) {
+            d[i] = _mm256_add_epi64(d[i],
+                _mm256_mul_epu32(h[j], j <= i ? r[i - j] : s[i + 5 - j]));
+        }
+    }
+    // Two carry chains side by side, which leaves limbs a bit over 26
+    // bits; the products still have room for that.
+    poly1305_carry(d, 0);
+    poly1305_carry(d, 3);
+    poly1305_carry(d, 1);
+    poly1305_carry(d, 4);
+    poly1305_carry(d, 2);
+    poly1305_carry(d, 0);
+    poly1305_carry(d, 3);
+    for (int i = 0; i < 5; ++i) {
+        h[i] = d[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static bool poly1305_avx2(uint64_t h[3], const uint64_t r[3],
+    const uint8_t* data, size_t size) {
+    // powers[k] is r^(k + 1).
+    uint64_t powers[4][5];
+    poly1305_split26(r, powers[0]);
+    for (int k = 1; k < 4; ++k) {
+        poly1305_mul26(powers[k - 1], powers[0], powers[k]);
+    }
+    uint64_t start[5];
+    poly1305_split26(h, start);
+    __m256i acc[5];
+    __m256i r4[5];
+    __m256i s4[5];
+    for (int i = 0; i < 5; ++i) {
+        acc[i] = _mm256_set_epi64x(0, 0, 0, start[i]);
+        r4[i] = _mm256_set1_epi64x(powers[3][i]);
+        s4[i] = _mm256_set1_epi64x(powers[3][i] * 5);
+    }
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+    for (; size >= 64; data += 64, size -= 64) {
+        const __m256i a =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        const __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32));
+        // The low and high halves of the four blocks, in block order.
+        const __m256i lo =
+            _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+        const __m256i hi =
+            _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+        const __m256i m[5] = {
+            _mm256_and_si256(lo, mask),
+            _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask),
+            _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52),
+                _mm256_slli_epi64(hi, 12)), mask),
+            _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask),
+            _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit)};
+        for (int i = 0; i < 5; ++i) {
+            acc[i] = _mm256_add_epi64(acc[i], m[i]);
+        }
+        if (size > 64) {
+            poly1305_mul_lanes(acc, r4, s4);
+        }
+    }
+    __m256i r_lanes[5];
+    __m256i s_lanes[5];
+    for (int i = 0; i < 5; ++i) {
+        r_lanes[i] = _mm256_set_epi64x(powers[0][i], powers[1][i],
+            powers[2][i], powers[3][i]);
+        s_lanes[i] = _mm256_set_epi64x(powers[0][i] * 5, powers[1][i] * 5,
+            powers[2][i] * 5, powers[3][i] * 5);
+    }
+    poly1305_mul_lanes(acc, r_lanes, s_lanes);
+    uint64_t sum[5];
+    for (int i = 0; i < 5; ++i) {
+        uint64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc[i]);
+        sum[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    poly1305_join26(sum, h);
+    return true;
+}
+#endif
+
+static bool poly1305_scalar(uint64_t*, const uint64_t*, const uint8_t*,
+    size_t) {
+    return false;
+}
+
+static PolyCore pick_poly_core() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return poly1305_avx2;
+    }
+#endif
+    return poly1305_scalar;
+}
+
+static const PolyCore poly1305_core = pick_poly_core();
+
+namespace {
+
+class Poly1305 {
+ private:
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    uint8_t buffer[16];
+    size_t buffered;
+
+    // Adds blocks of 16 bytes to the accumulator and multiplies by r.
+    void blocks(const uint8_t* data, size_t size, uint64_t hibit) {
+        const uint64_t mask44 = MASK44;
+        const uint64_t mask42 = MASK42;
+        const size_t run = size & ~static_cast<size_t>(63);
+        if (hibit != 0 && run >= POLY_VECTOR_MIN &&
+            poly1305_core(h, r, data, run)) {
+            data += run;
+            size -= run;
+        }
+        const uint64_t s1 = r[1] * (5 << 2);
+        const uint64_t s2 = r[2] * (5 << 2);
+        uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+        for (; size >= 16; data += 16, size -= 16) {
+            const uint64_t t0 = load_le64(data);
+            const uint64_t t1 = load_le64(data + 8);
+            h0 += t0 & mask44;
+            h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+            h2 += ((t1 >> 24) & mask42) | hibit;
+            const uint128 d0 = static_cast<uint128>(h0) * r[0] +
+                static_cast<uint128>(h1) * s2 + static_cast<uint128>(h2) * s1;
+            uint128 d1 = static_cast<uint128>(h0) * r[1] +
+                static_cast<uint128>(h1) * r[0] +
+                static_cast<uint128>(h2) * s2;
+            uint128 d2 = static_cast<uint128>(h0) * r[2] +
+                static_cast<uint128>(h1) * r[1] +
+                static_cast<uint128>(h2) * r[0];
+            uint64_t c = static_cast<uint64_t>(d0 >> 44);
+            h0 = static_cast<uint64_t>(d0) & mask44;
+            d1 += c;
+            c = static_cast<uint64_t>(d1 >> 44);
+            h1 = static_cast<uint64_t>(d1) & mask44;
+            d2 += c;
+            c = static_cast<uint64_t>(d2 >> 42);
+            h2 = static_cast<uint64_t>(d2) & mask42;
+            h0 += c * 5;
+            c = h0 >> 44;
+            h0 &= mask44;
+            h1 += c;
+        }
+        h[0] = h0;
+        h[1] = h1;
+        h[2] = h2;
+    }
+
+ public:
+    explicit Poly1305(const uint8_t key[32]) : h{0, 0, 0}, buffered(0) {
+        const uint64_t t0 = load_le64(key);
+        const uint64_t t1 = load_le64(key + 8);
+        // Clamp r as the RFC says.
+        r[0] = t0 & 0xffc0fffffff;
+        r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+        r[2] = (t1 >> 24) & 0x00ffffffc0f;
+        pad[0] = load_le64(key + 16);
+        pad[1] = load_le64(key + 24);
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        if (buffered > 0) {
+            const size_t take = size < 16 - buffered ? size : 16 - buffered;
+            std::memcpy(buffer + buffered, data, take);
+            buffered += take;
+            data += take;
+            size -= take;
+            if (buffered < 16) {
+                return;
+            }
+            blocks(buffer, 16, static_cast<uint64_t>(1) << 40);
+            buffered = 0;
+        }
+        const size_t whole = size & ~static_cast<size_t>(15);
+        blocks(data, whole, static_cast<uint64_t>(1) << 40);
+        std::memcpy(buffer, data + whole, size - whole);
+        buffered = size - whole;
+    }
+
+    // Zero padding up to the next 16 bytes, as the AEAD construction has.
+    void pad16() {
+        if (buffered > 0) {
+            std::memset(buffer + buffered, 0, 16 - buffered);
+            blocks(buffer, 16, static_cast<uint64_t>(1) << 40);
+            buffered = 0;
+        }
+    }
+
+    void finish(uint8_t tag[TAG_SIZE]) {
+        const uint64_t mask44 = 0xfffffffffff;
+        const uint64_t mask42 = 0x3ffffffffff;
+        if (buffered > 0) {
+            buffer[buffered] = 1;
+            std::memset(buffer + buffered + 1, 0, 15 - buffered);
+            blocks(buffer, 16, 0);
+        }
+        uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+        // Fully carry h.
+        uint64_t c = h1 >> 44;
+        h1 &= mask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+        c = h1 >> 44;
+        h1 &= mask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+        // g = h - (2^130 - 5), kept if h was at least 2^130 - 5.
+        uint64_t g0 = h0 + 5;
+        c = g0 >> 44;
+        g0 &= mask44;
+        uint64_t g1 = h1 + c;
+        c = g1 >> 44;
+        g1 &= mask44;
+        uint64_t g2 = h2 + c - (static_cast<uint64_t>(1) << 42);
+        const uint64_t keep_g = (g2 >> 63) - 1;
+        h0 = (h0 & ~keep_g) | (g0 & keep_g);
+        h1 = (h1 & ~keep_g) | (g1 & keep_g);
+        h2 = (h2 & ~keep_g) | (g2 & keep_g);
+        // tag = h + pad mod 2^128.
+        const uint64_t lo = h0 | h1 << 44;
+        const uint64_t hi = h1 >> 20 | h2 << 24;
+        const uint128 sum_lo = static_cast<uint128>(lo) + pad[0];
+        const uint64_t sum_hi = hi + pad[1] +
+            static_cast<uint64_t>(sum_lo >> 64);
+        store_le64(tag, static_cast<uint64_t>(sum_lo));
+        store_le64(tag + 8, sum_hi);
+    }
+};
+
+}  // namespace
+
+/*
+ChaCha20-Poly1305 (RFC 8439, section 2.8): the Poly1305 key is the
+first half of key stream block 0, and the data is encrypted from
+block 1 on. The MAC covers the padded AAD and ciphertext followed by
+both their lengths.
+
+The data is gone through in chunks small enough to stay in the first
+level cache, each encrypted and then MACed (or MACed and then
+decrypted) before going on to the next, so it is read from memory
+once rather than once for each.
+*/
+static const size_t AEAD_CHUNK = 16384;
+
+// Poly1305 keyed for nonce, with the padded AAD already added.
+static Poly1305 aead_mac(const uint8_t key[KEY_SIZE],
+    const uint8_t nonce[NONCE_SIZE], const uint8_t* aad, size_t aad_size) {
+    uint32_t state[16];
+    chacha20_setup(state, key, nonce, 0);
+    uint8_t block[CHACHA_BLOCK];
+    chacha20_block(state, block);
+    Poly1305 poly(block);
+    poly.update(aad, aad_size);
+    poly.pad16();
+    return poly;
+}
+
+static void aead_finish(Poly1305* poly, size_t aad_size, size_t size,
+    uint8_t tag[TAG_SIZE]) {
+    poly->pad16();
+    uint8_t lengths[16];
+    store_le64(lengths, aad_size);
+    store_le64(lengths + 8, size);
+    poly->update(lengths, sizeof(lengths));
+    poly->finish(tag);
+}
+
+void aead_seal(const uint8_t key[KEY_SIZE], const uint8_t nonce[NONCE_SIZE],
+    const uint8_t* aad, size_t aad_size, uint8_t* data, size_t size,
+    uint8_t tag[TAG_SIZE]) {
+    Poly1305 poly = aead_mac(key, nonce, aad, aad_size);
+    for (size_t done = 0; done < size; done += AEAD_CHUNK) {
+        const size_t take =
+            size - done < AEAD_CHUNK ? size - done : AEAD_CHUNK;
+        const uint32_t counter =
+            1 + static_cast<uint32_t>(done / CHACHA_BLOCK);
+        chacha20_xor(key, nonce, counter, data + done, take);
+        poly.update(data + done, take);
+    }
+    aead_finish(&poly, aad_size, size, tag);
+}
+
+bool aead_open(const uint8_t key[KEY_SIZE], const uint8_t nonce[NONCE_SIZE],
+    const uint8_t* aad, size_t aad_size, uint8_t* data, size_t size,
+    const uint8_t tag[TAG_SIZE]) {
+    Poly1305 poly = aead_mac(key, nonce, aad, aad_size);
+    for (size_t done = 0; done < size; done += AEAD_CHUNK) {
+        const size_t take =
+            size - done < AEAD_CHUNK ? size - done : AEAD_CHUNK;
+        const uint32_t counter =
+            1 + static_cast<uint32_t>(done / CHACHA_BLOCK);
+        poly.update(data + done, take);
+        chacha20_xor(key, nonce, counter, data + done, take);
+    }
+    uint8_t expected[TAG_SIZE];
+    aead_finish(&poly, aad_size, size, expected);
+    // Compare without stopping early, so timing gives nothing away.
+    uint8_t difference = 0;
+    for (size_t i = 0; i < TAG_SIZE; ++i) {
+        difference |= expected[i] ^ tag[i];
+    }
+    if (difference != 0) {
+        // Encrypt it again, so nothing that failed is left decrypted.
+        chacha20_xor(key, nonce, 1, data, size);
+        return false;
+    }
+    return true;
+}
+
+void random_bytes(uint8_t* data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = getrandom(data, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            throw std::runtime_error("Cannot get random bytes!\n");
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
@@ -0,0 +1,62 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+crypto.h
+
+The cryptography behind encrypted messages: ChaCha20-Poly1305
+authenticated encryption (RFC 8439), and PBKDF2 over HMAC-SHA-256
+(RFC 8018) to turn a passphrase or key file into a key.
+
+Everything is implemented here so EasyLSB keeps its only dependency
+zlib. ChaCha20 works on 8 blocks at a time in vector registers, with
+AVX2 and AVX-512 (16 blocks) versions picked at load time on
+processors that have them. Poly1305 uses 64 bit limbs, or with AVX2
+works on 4 blocks at a time in 26 bit limbs.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef CRYPTO_H_
+#define CRYPTO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+const size_t KEY_SIZE = 32;
+const size_t NONCE_SIZE = 12;
+const size_t TAG_SIZE = 16;
+const size_t SHA256_SIZE = 32;
+
+// SHA-256 of data, written to out.
+void sha256(const uint8_t* data, size_t size, uint8_t out[SHA256_SIZE]);
+
+// PBKDF2-HMAC-SHA-256 of secret and salt, out_size bytes of it.
+void pbkdf2_sha256(const std::string& secret, const uint8_t* salt,
+    size_t salt_size, uint32_t iterations, uint8_t* out, size_t out_size);
+
+/*
+XORs the ChaCha20 key stream, starting at block counter, into size
+bytes of data.
+*/
+void chacha20_xor(const uint8_t key[KEY_SIZE],
+    const uint8_t nonce[NONCE_SIZE], uint32_t counter, uint8_t* data,
+    size_t size);
+
+// Encrypts size bytes of data in place and writes their tag.
+void aead_seal(const uint8_t key[KEY_SIZE], const uint8_t nonce[NONCE_SIZE],
+    const uint8_t* aad, size_t aad_size, uint8_t* data, size_t size,
+    uint8_t tag[TAG_SIZE]);
+
+/*
+Checks tag, and only if it matches, decrypts size bytes of data in
+place and returns true.
+*/
+bool aead_open(const uint8_t key[KEY_SIZE], const uint8_t nonce[NONCE_SIZE],
+    const uint8_t* aad, size_t aad_size, uint8_t* data, size_t size,
+    const uint8_t tag[TAG_SIZE]);
+
+// Fills data with random bytes from the kernel.
+void random_bytes(uint8_t* data, size_t size);
+
+#endif  // CRYPTO_H_
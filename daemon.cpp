@@ -0,0 +1,656 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+daemon.cpp
+
+The daemon's socket, protocol and workers. See daemon.h.
+
+A request is laid out as:
+op (1 byte), flags (1 byte: 1 compress, 2 scatter, 4 legacy, 8 sync,
+16 image descriptor, 32 output descriptor), parity (1 byte), zlib
+compression level plus one (1 byte, 0 for the default), then the image
+path, output path, message and secret, each a 4 byte big endian length
+followed by its bytes. Descriptors, the image's first, come as
+SCM_RIGHTS control messages along with the bytes of the request.
+A response is a status byte (1 if the request succeeded) followed by
+the decoded message, the cache's counters or the error message.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "daemon.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include "EasyLSB.h"
+#include "carrier_cache.h"
+#include "reed_solomon.h"
+#include "thread_pool.h"
+
+static const uint8_t FLAG_COMPRESS = 1;
+static const uint8_t FLAG_SCATTER = 2;
+static const uint8_t FLAG_LEGACY = 4;
+static const uint8_t FLAG_SYNC = 8;
+static const uint8_t FLAG_IMAGE_FD = 16;
+static const uint8_t FLAG_OUTPUT_FD = 32;
+// Descriptors a request can come with.
+static const size_t MAX_FDS = 2;
+// Requests and responses are refused past this size.
+static const size_t MAX_FRAME = 1 << 30;
+static const size_t LENGTH_SIZE = 4;
+/*
+Most bytes of a frame received at a time before it has proved to be
+as long as it says, so a buffer only grows as its bytes arrive.
+*/
+static const size_t RECEIVE_CHUNK = 64 * 1024;
+
+static void put_be32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_string(const std::string& s, std::vector<uint8_t>* out) {
+    out->resize(out->size() + LENGTH_SIZE);
+    put_be32(out->data() + out->size() - LENGTH_SIZE,
+        static_cast<uint32_t>(s.size()));
+    out->insert(out->end(), s.begin(), s.end());
+}
+
+// Reads a string at *offset, moving it past the string.
+static bool get_string(const uint8_t* data, size_t size, size_t* offset,
+    std::string* s) {
+    if (size - *offset < LENGTH_SIZE) {
+        return false;
+    }
+    const size_t length = get_be32(data + *offset);
+    *offset += LENGTH_SIZE;
+    if (size - *offset < length) {
+        return false;
+    }
+    s->assign(reinterpret_cast<const char*>(data + *offset), length);
+    *offset += length;
+    return true;
+}
+
+void DaemonRequest::serialize(std::vector<uint8_t>* out) const {
+    uint8_t flags = 0;
+    if (payload_options.compress) {
+        flags |= FLAG_COMPRESS;
+    }
+    if (payload_options.scatter) {
+        flags |= FLAG_SCATTER;
+    }
+    if (payload_options.legacy) {
+        flags |= FLAG_LEGACY;
+    }
+    if (output_options.sync) {
+        flags |= FLAG_SYNC;
+    }
+    if (image_fd >= 0) {
+        flags |= FLAG_IMAGE_FD;
+    }
+    if (output_fd >= 0) {
+        flags |= FLAG_OUTPUT_FD;
+    }
+    out->push_back(static_cast<uint8_t>(op));
+    out->push_back(flags);
+    out->push_back(static_cast<uint8_t>(payload_options.parity));
+    out->push_back(static_cast<uint8_t>(output_options.compression_level + 1));
+    put_string(image, out);
+    put_string(output, out);
+    put_string(message, out);
+    put_string(payload_options.secret, out);
+}
+
+bool DaemonRequest::parse(const uint8_t* data, size_t size,
+    const std::vector<int>& fds, DaemonRequest* out) {
+    if (size < 4 || (data[0] != static_cast<uint8_t>(Op::ENCODE) &&
+        data[0] != static_cast<uint8_t>(Op::DECODE) &&
+        data[0] != static_cast<uint8_t>(Op::STATS)) ||
+        data[2] > ReedSolomon::MAX_PARITY || data[3] > 10) {
+        return false;
+    }
+    const bool image_fd = data[1] & FLAG_IMAGE_FD;
+    const bool output_fd = data[1] & FLAG_OUTPUT_FD;
+    if (fds.size() != static_cast<size_t>(image_fd) + output_fd) {
+        return false;
+    }
+    out->image_fd = image_fd ? fds[0] : -1;
+    out->output_fd = output_fd ? fds.back() : -1;
+    out->op = static_cast<Op>(data[0]);
+    out->payload_options = PayloadOptions();
+    out->payload_options.compress = data[1] & FLAG_COMPRESS;
+    out->payload_options.scatter = data[1] & FLAG_SCATTER;
+    out->payload_options.legacy = data[1] & FLAG_LEGACY;
+    out->payload_options.parity = data[2];
+    out->output_options = OutputOptions();
+    out->output_options.sync = data[1] & FLAG_SYNC;
+    out->output_options.compression_level = data[3] - 1;
+    size_t offset = 4;
+    return get_string(data, size, &offset, &out->image) &&
+        get_string(data, size, &offset, &out->output) &&
+        get_string(data, size, &offset, &out->message) &&
+        get_string(data, size, &offset, &out->payload_options.secret) &&
+        offset == size;
+}
+
+/*
+Sends all of data, and fd_count descriptors from fds along with its
+first bytes. Returns false if the connection is gone.
+*/
+static bool send_all(int fd, const uint8_t* data, size_t size,
+    const int* fds = nullptr, size_t fd_count = 0) {
+    while (size > 0) {
+        ssize_t sent;
+        if (fd_count > 0) {
+            iovec piece = {const_cast<uint8_t*>(data), size};
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+            msghdr message;
+            std::memset(&message, 0, sizeof(message));
+            message.msg_iov = &piece;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+            cmsghdr* header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+            std::memcpy(CMSG_DATA(header), fds, sizeof(int) * fd_count);
+            sent = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (sent > 0) {
+                fd_count = 0;
+            }
+        } else {
+            sent = ::send(fd, data, size, MSG_NOSIGNAL);
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+/*
+Receives up to size bytes with one recvmsg(), adding any descriptors
+that come along to fds, which the caller has to close. Returns what
+recvmsg() does.
+*/
+static ssize_t receive_some(int fd, uint8_t* data, size_t size,
+    std::vector<int>* fds) {
+    iovec piece = {data, size};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &piece;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    const ssize_t received = ::recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    for (cmsghdr* header = received >= 0 ? CMSG_FIRSTHDR(&message) :
+        nullptr; header; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET &&
+            header->cmsg_type == SCM_RIGHTS) {
+            const size_t count =
+                (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; ++i) {
+                int passed;
+                std::memcpy(&passed, CMSG_DATA(header) + i * sizeof(int),
+                    sizeof(int));
+                fds->push_back(passed);
+            }
+        }
+    }
+    return received;
+}
+
+/*
+Bytes of a frame to receive next, given the size bytes of it already
+in data, or 0 once it is whole. A frame that says it is too large
+is reported through too_large.
+*/
+static size_t frame_wanted(const uint8_t* data, size_t size,
+    bool* too_large) {
+    *too_large = false;
+    if (size < LENGTH_SIZE) {
+        return LENGTH_SIZE - size;
+    }
+    const size_t length = get_be32(data);
+    if (length > MAX_FRAME) {
+        *too_large = true;
+        return 0;
+    }
+    const size_t whole = LENGTH_SIZE + length;
+    return size < whole ? std::min(whole - size, std::max(RECEIVE_CHUNK,
+        size)) : 0;
+}
+
+/*
+Blocks until one whole length prefixed frame is in buffer, length
+included, and the descriptors sent with it are in fds. Returns false
+at the end of the connection, or if the frame is too large.
+*/
+static bool receive_frame(int fd, std::vector<uint8_t>* buffer,
+    std::vector<int>* fds) {
+    buffer->clear();
+    bool too_large;
+    while (size_t wanted = frame_wanted(buffer->data(), buffer->size(),
+        &too_large)) {
+        const size_t have = buffer->size();
+        buffer->resize(have + wanted);
+        const ssize_t received =
+            receive_some(fd, buffer->data() + have, wanted, fds);
+        buffer->resize(have + (received > 0 ? received : 0));
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+    }
+    return !too_large;
+}
+
+// A path the daemon can open a descriptor it was sent through.
+static std::string descriptor_path(int fd) {
+    return "/proc/self/fd/" + std::to_string(fd);
+}
+
+// Fills in the length of a frame built after LENGTH_SIZE blank bytes.
+static void finish_frame(std::vector<uint8_t>* frame) {
+    put_be32(frame->data(),
+        static_cast<uint32_t>(frame->size() - LENGTH_SIZE));
+}
+
+// The cache's counters, a "name value" line each.
+static std::string format_stats(CarrierCache* cache) {
+    const CacheStats stats = cache ? cache->stats() : CacheStats();
+    const size_t lookups = stats.hits + stats.misses;
+    return "hits " + std::to_string(stats.hits) +
+        "\nmisses " + std::to_string(stats.misses) +
+        "\nhit_rate " + std::to_string(lookups ?
+            static_cast<double>(stats.hits) / lookups : 0.0) +
+        "\nevictions " + std::to_string(stats.evictions) +
+        "\nentries " + std::to_string(stats.entries) +
+        "\nbytes " + std::to_string(stats.bytes) +
+        "\nbudget " + std::to_string(stats.budget) + "\n";
+}
+
+/*
+An image sent as a descriptor is worked on through a shared mapping
+where it can be, so a bitmap in a memfd is read and embedded into
+right in the client's memory. That is only safe once its size is
+sealed, or the client could shrink it under the mapping and bring
+the daemon down with SIGBUS, so a descriptor that can't be sealed is
+read and written like a path instead. Only images encoded from a
+path are cached: a descriptor's file is the client's to change, and
+images decoded are rarely the same twice.
+*/
+static void handle(const uint8_t* data, size_t size,
+    const std::vector<int>& fds, CarrierCache* cache,
+    DaemonRequest* request, DaemonResponse* response) {
+    response->ok = false;
+    response->data.clear();
+    if (!DaemonRequest::parse(data, size, fds, request)) {
+        response->data = "Request is malformed!\n";
+        return;
+    }
+    if (request->op == DaemonRequest::Op::STATS) {
+        response->data = format_stats(cache);
+        response->ok = true;
+        return;
+    }
+    const bool passed = request->image_fd >= 0;
+    bool sealed = false;
+    if (passed) {
+        request->image = descriptor_path(request->image_fd);
+        sealed = ::fcntl(request->image_fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0;
+    }
+    if (request->output_fd >= 0) {
+        request->output = descriptor_path(request->output_fd);
+    }
+    try {
+        if (request->op == DaemonRequest::Op::ENCODE) {
+            // Without an output, the image is encoded in place.
+            const bool in_place = request->output.empty();
+            EasyLSB steg(request->message, request->image.c_str(),
+                in_place ? request->image.c_str() : request->output.c_str(),
+                passed ? nullptr : cache);
+            steg.set_output_options(request->output_options);
+            steg.set_payload_options(request->payload_options);
+            if (passed && in_place && !steg.is_bitmap()) {
+                throw std::runtime_error(
+                    "Only bitmaps can be encoded in place!\n");
+            }
+            if (sealed) {
+                steg.map_image();
+            }
+            steg.encode();
+        } else {
+            EasyLSB unsteg(request->image.c_str());
+            unsteg.set_payload_options(request->payload_options);
+            if (sealed) {
+                unsteg.map_image();
+            }
+            unsteg.decode();
+            response->data = unsteg.message();
+        }
+        response->ok = true;
+    } catch (const std::exception& e) {
+        response->data = e.what();
+    }
+}
+
+// The request a worker parses into, kept from one request to the next.
+struct WorkerBuffers {
+    DaemonRequest request;
+    DaemonResponse response;
+};
+
+/*
+A client's connection, with the part of a request received and of a
+response sent so far, which wait here until the socket is ready for
+more. Only the worker the poller handed the connection to touches it.
+*/
+struct Connection {
+    int fd;
+    // The frame being received, length included.
+    std::vector<uint8_t> in;
+    // Descriptors that came with it, closed once it is served.
+    std::vector<int> fds;
+    std::vector<uint8_t> out;
+    size_t sent = 0;
+
+    explicit Connection(int socket) : fd(socket) {}
+    ~Connection() {
+        for (int passed : fds) {
+            ::close(passed);
+        }
+        ::close(fd);
+    }
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+};
+
+/*
+Serves a connection as far as it can go without blocking, up to one
+request a turn: sends the rest of the last response, then receives
+and serves a request, and sends as much of its response as it can.
+Returns the event to wait for before going on, EPOLLIN or EPOLLOUT,
+or 0 once the client has closed the connection, or it is no longer
+usable. Having to be handed the connection again for the next
+request puts it behind every other connection that is ready, so one
+busy client can't keep a worker to itself.
+*/
+static uint32_t serve_connection(Connection* connection,
+    CarrierCache* cache, WorkerBuffers* buffers) {
+    const int fd = connection->fd;
+    std::vector<uint8_t>& in = connection->in;
+    std::vector<uint8_t>& out = connection->out;
+    bool served = false;
+    while (true) {
+        while (connection->sent < out.size()) {
+            const ssize_t sent = ::send(fd, out.data() + connection->sent,
+                out.size() - connection->sent, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return EPOLLOUT;
+            }
+            if (sent <= 0) {
+                return 0;
+            }
+            connection->sent += static_cast<size_t>(sent);
+        }
+        if (served) {
+            return EPOLLIN;
+        }
+        bool too_large;
+        if (size_t wanted = frame_wanted(in.data(), in.size(), &too_large)) {
+            const size_t have = in.size();
+            in.resize(have + wanted);
+            const ssize_t received = receive_some(fd, in.data() + have,
+                wanted, &connection->fds);
+            in.resize(have + (received > 0 ? received : 0));
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return EPOLLIN;
+            }
+            if (received <= 0) {
+                return 0;
+            }
+            // More than a request can carry, so no request at all.
+            if (connection->fds.size() > MAX_FDS) {
+                return 0;
+            }
+            continue;
+        }
+        if (too_large) {
+            return 0;
+        }
+        handle(in.data() + LENGTH_SIZE, in.size() - LENGTH_SIZE,
+            connection->fds, cache, &buffers->request, &buffers->response);
+        // The image was unmapped along with its EasyLSB; done with these.
+        for (int passed : connection->fds) {
+            ::close(passed);
+        }
+        connection->fds.clear();
+        in.clear();
+        DaemonResponse& response = buffers->response;
+        // The status byte and data have to fit in a frame the client takes.
+        if (response.data.size() >= MAX_FRAME) {
+            response.ok = false;
+            response.data = "Response is too large!\n";
+        }
+        out.assign(LENGTH_SIZE, 0);
+        out.push_back(response.ok ? 1 : 0);
+        out.insert(out.end(), response.data.begin(), response.data.end());
+        finish_frame(&out);
+        connection->sent = 0;
+        served = true;
+    }
+}
+
+/*
+Has the poller report a connection, or the listening socket if
+connection is nullptr, once when it is next ready for events. Until
+it is watched again, no other worker will be handed it.
+*/
+static bool watch(int poller, int fd, int op, uint32_t events,
+    Connection* connection) {
+    epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = connection;
+    return ::epoll_ctl(poller, op, fd, &event) == 0;
+}
+
+// Accepts every pending connection, and watches it for requests.
+static void accept_all(int listener, int poller) {
+    while (true) {
+        const int fd = ::accept4(listener, nullptr, nullptr,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // Out of descriptors or not, the rest are left for later.
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        Connection* connection = new Connection(fd);
+        if (!watch(poller, fd, EPOLL_CTL_ADD, EPOLLIN, connection)) {
+            delete connection;
+        }
+    }
+}
+
+static sockaddr_un socket_address(const char* path) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    const size_t length = std::strlen(path);
+    if (length >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path is too long!\n");
+    }
+    // The memset above leaves the terminating zero.
+    std::memcpy(address.sun_path, path, length);
+    return address;
+}
+
+static int connect_socket(const char* path) {
+    const sockaddr_un address = socket_address(path);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address),
+        sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void serve(const char* path, size_t threads, size_t cache_bytes) {
+    const sockaddr_un address = socket_address(path);
+    struct stat st;
+    if (::stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        // Only replace the socket if nothing answers on it any more.
+        const int live = connect_socket(path);
+        if (live >= 0) {
+            ::close(live);
+            throw std::runtime_error("A daemon is already listening there!\n");
+        }
+        ::unlink(path);
+    }
+    const int listener =
+        ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int poller = ::epoll_create1(EPOLL_CLOEXEC);
+    if (listener < 0 || poller < 0 ||
+        ::bind(listener, reinterpret_cast<const sockaddr*>(&address),
+            sizeof(address)) != 0 ||
+        ::listen(listener, SOMAXCONN) != 0 ||
+        !watch(poller, listener, EPOLL_CTL_ADD, EPOLLIN, nullptr)) {
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        if (poller >= 0) {
+            ::close(poller);
+        }
+        throw std::runtime_error("Cannot listen on socket!\n");
+    }
+    /*
+    Every worker waits on the poller, and takes whichever connection
+    has bytes to read or room to write next, so an idle or slow
+    connection ties up no worker.
+    */
+    std::unique_ptr<CarrierCache> cache;
+    if (cache_bytes > 0) {
+        cache = std::make_unique<CarrierCache>(cache_bytes);
+    }
+    ThreadPool pool(threads);
+    try {
+        pool.run(pool.size(), [listener, poller, &cache](size_t) {
+            WorkerBuffers buffers;
+            while (true) {
+                epoll_event event;
+                const int ready = ::epoll_wait(poller, &event, 1, -1);
+                if (ready < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ready < 0) {
+                    throw std::runtime_error("Cannot wait for requests!\n");
+                }
+                Connection* connection =
+                    static_cast<Connection*>(event.data.ptr);
+                if (!connection) {
+                    accept_all(listener, poller);
+                    watch(poller, listener, EPOLL_CTL_MOD, EPOLLIN, nullptr);
+                    continue;
+                }
+                uint32_t next = 0;
+                try {
+                    next = serve_connection(connection, cache.get(),
+                        &buffers);
+                } catch (const std::bad_alloc&) {
+                    // Just this connection is dropped.
+                }
+                if (!next || !watch(poller, connection->fd, EPOLL_CTL_MOD,
+                    next, connection)) {
+                    delete connection;
+                }
+            }
+        });
+    } catch (...) {
+        ::close(poller);
+        ::close(listener);
+        throw;
+    }
+}
+
+DaemonClient::DaemonClient(const char* path) : fd(connect_socket(path)) {
+    if (fd < 0) {
+        throw std::runtime_error("Cannot connect to daemon!\n");
+    }
+}
+
+DaemonClient::~DaemonClient() {
+    ::close(fd);
+}
+
+DaemonResponse DaemonClient::call(const DaemonRequest& request) {
+    buffer.assign(LENGTH_SIZE, 0);
+    request.serialize(&buffer);
+    if (buffer.size() - LENGTH_SIZE > MAX_FRAME) {
+        throw std::runtime_error("Request is too large!\n");
+    }
+    finish_frame(&buffer);
+    int fds[MAX_FDS];
+    size_t fd_count = 0;
+    if (request.image_fd >= 0) {
+        fds[fd_count++] = request.image_fd;
+    }
+    if (request.output_fd >= 0) {
+        fds[fd_count++] = request.output_fd;
+    }
+    std::vector<int> unexpected;
+    const bool answered =
+        send_all(fd, buffer.data(), buffer.size(), fds, fd_count) &&
+        receive_frame(fd, &buffer, &unexpected);
+    for (int passed : unexpected) {
+        ::close(passed);
+    }
+    if (!answered || buffer.size() <= LENGTH_SIZE) {
+        throw std::runtime_error("Connection to daemon lost!\n");
+    }
+    DaemonResponse response;
+    response.ok = buffer[LENGTH_SIZE] == 1;
+    response.data.assign(
+        reinterpret_cast<const char*>(buffer.data()) + LENGTH_SIZE + 1,
+        buffer.size() - LENGTH_SIZE - 1);
+    return response;
+}
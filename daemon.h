@@ -0,0 +1,134 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+daemon.h
+
+EasyLSB as a long running daemon, taking encode and decode requests
+over a Unix domain socket, so a service hiding many short messages
+doesn't pay for starting a process per message.
+
+A request names the input image (and the output image, to encode)
+by path, and carries the message and the payload options inline; the
+response carries the decoded message, or the error message of the
+exception the request failed with. Both are sent as a 4 byte big
+endian length followed by that many bytes, and a connection can carry
+any number of requests, one after the other.
+
+Instead of paths, the images can be sent as file descriptors
+(SCM_RIGHTS), of regular files or of memfds holding the image. A
+bitmap sent in a memfd is mapped (see carrier.h) rather than read, and
+without an output it is embedded into in place, so a client keeping
+its images in shared memory gets the result back in that same memory,
+with nothing copied between the processes.
+
+The daemon runs on a pool of worker threads (thread_pool.h) that all
+wait on one epoll instance watching the socket and every connection.
+Whichever worker wakes up accepts new connections, or goes on with a
+connection as far as it can without blocking, but no further than one
+request, so a client that keeps sending takes turns with the others.
+A connection isn't handed to another worker until it is ready again,
+and one passing more descriptors than a request takes is dropped.
+Connections are non-blocking
+and keep the part of a request received, or of a response sent, until
+the rest can go through, so a connection that is idle, sends half a
+request or doesn't read its response holds up no worker, and there
+can be many more clients than workers. A request's buffer only grows
+as its bytes arrive, whatever length it claims, and each connection
+keeps its buffers, so once warmed up a request allocates nothing but
+what encoding or decoding itself needs. Template images encoded into
+over and over are kept in a cache, parsed, so encoding one only
+copies its rows from memory.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "output_file.h"
+#include "payload.h"
+
+struct DaemonRequest {
+    // STATS asks for the counters of the daemon's carrier cache.
+    enum class Op : uint8_t { ENCODE = 'e', DECODE = 'd', STATS = 's' };
+    Op op = Op::DECODE;
+    /*
+    Paths as the daemon sees them, so they should be absolute. output
+    is only used to encode.
+    */
+    std::string image;
+    std::string output;
+    // The message to encode.
+    std::string message;
+    // Only compress, secret, parity, scatter and legacy are sent.
+    PayloadOptions payload_options;
+    // Only compression_level and sync are sent.
+    OutputOptions output_options;
+    /*
+    Descriptors to send instead of the paths, -1 for none. A bitmap
+    sent without an output, path or descriptor, is encoded in place,
+    through a shared mapping, so a memfd comes back holding the
+    encoded image without a byte of it being copied. The daemon only
+    maps a memfd after sealing it against shrinking (F_SEAL_SHRINK),
+    which can't be undone: the client can't shrink it afterwards
+    either. A regular file, or a memfd created without
+    MFD_ALLOW_SEALING, can't be sealed and is read and written
+    instead.
+    */
+    int image_fd = -1;
+    int output_fd = -1;
+
+    // Appends the request, without its length or descriptors, to out.
+    void serialize(std::vector<uint8_t>* out) const;
+    /*
+    Returns false if data isn't a whole, well formed request, sent with
+    the descriptors fds. The request's descriptors are taken from fds.
+    */
+    static bool parse(const uint8_t* data, size_t size,
+        const std::vector<int>& fds, DaemonRequest* out);
+};
+
+struct DaemonResponse {
+    bool ok = false;
+    /*
+    The decoded message, or the cache's counters as "name value"
+    lines, or the error message if not ok.
+    */
+    std::string data;
+};
+
+/*
+Listens on a Unix domain socket at path, replacing a stale socket
+left there, and serves requests on threads workers (one per processor
+if 0) until the process is killed. Bitmaps encoded from a path are
+kept in a carrier cache (carrier_cache.h) of up to cache_bytes, or
+none if 0. Throws std::runtime_error if the socket can't be set up.
+*/
+void serve(const char* path, size_t threads = 0, size_t cache_bytes = 0);
+
+// One connection to a daemon, for any number of requests.
+class DaemonClient {
+ private:
+    int fd;
+    // Reused from one request to the next.
+    std::vector<uint8_t> buffer;
+
+ public:
+    // Throws std::runtime_error if no daemon is listening at path.
+    explicit DaemonClient(const char* path);
+    ~DaemonClient();
+    DaemonClient(const DaemonClient&) = delete;
+    DaemonClient& operator=(const DaemonClient&) = delete;
+    /*
+    Sends request and waits for its response. Throws std::runtime_error
+    if the connection is lost, but not if the request itself failed.
+    */
+    DaemonResponse call(const DaemonRequest& request);
+};
+
+#endif  // DAEMON_H_
@@ -0,0 +1,94 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+file_reader.h
+
+Reading the start of many files at once, for batches of thousands of
+small images, where opening, reading and closing each one with a
+system call at a time costs more than the work done on it.
+
+With io_uring, each file is opened, read and closed by a chain of
+three linked requests: the open puts the file in a slot of the ring's
+own file table, rather than the process's, and the read and close
+refer to it by that slot. A whole window of files is submitted to the
+kernel with one system call, and each read lands in one of a set of
+buffers registered with the ring up front, so the kernel doesn't pin
+and map the pages of every read. A buffer is handed to the caller as
+soon as its read completes, just where the kernel left it, and reused
+once the caller returns.
+
+Without io_uring (an older kernel, or one where it has been turned
+off, as it is in many containers), files are opened and read with
+pread() one after another, through the same interface.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef FILE_READER_H_
+#define FILE_READER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+Called with the index of a file in a batch and the bytes read from
+its start (or offset): the rest of the file if size is less than the
+reader's buffer_bytes(). error is an errno value if the file couldn't be opened
+or read, and data nullptr then. data is only valid during the call.
+*/
+using ReadDone = std::function<void(size_t index, const uint8_t* data,
+    size_t size, int error)>;
+
+class FileReader {
+ private:
+    struct Ring;
+
+    size_t depth;
+    size_t bytes;
+    // depth buffers of bytes each, one after the other.
+    std::vector<uint8_t> buffers;
+    // nullptr if reading with pread().
+    std::unique_ptr<Ring> ring;
+
+    // Sets up ring, or leaves it nullptr if io_uring isn't available.
+    void open_ring();
+    void read_uring(const std::vector<std::string>& paths,
+        const std::vector<size_t>& offsets, const ReadDone& done);
+    void read_pread(const std::vector<std::string>& paths,
+        const std::vector<size_t>& offsets, const ReadDone& done);
+
+ public:
+    /*
+    Reads up to buffer_bytes of each file, with up to depth files in
+    flight, through io_uring unless it isn't available or use_uring is
+    false.
+    */
+    explicit FileReader(size_t depth = 64, size_t buffer_bytes = 256 << 10,
+        bool use_uring = true);
+    ~FileReader();
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+    // Whether reads go through io_uring, rather than pread().
+    bool uring() const;
+    size_t buffer_bytes() const;
+    /*
+    Reads the start of each of paths, calling done for each one as its
+    read completes, on the calling thread, in whatever order they
+    complete. An exception thrown by done is rethrown here, once the
+    reads in flight are done.
+    */
+    void read(const std::vector<std::string>& paths, const ReadDone& done);
+    /*
+    The same, but reading each file from byte offsets[i] on, rather than
+    from its start, such as to get at the rows a header said where to
+    find.
+    */
+    void read(const std::vector<std::string>& paths,
+        const std::vector<size_t>& offsets, const ReadDone& done);
+};
+
+#endif  // FILE_READER_H_
@@ -0,0 +1,189 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+loadgen.cpp
+
+Load generator for the daemon (daemon.h): a number of clients, each
+on its own connection and thread, send requests as fast as they are
+answered, and the latency of every request is recorded. Each request
+pair encodes the message into a temporary copy of the image, then
+decodes it back and checks it came out the same.
+
+Usage:
+EasyLSB_loadgen <socket path> <image filename> <message filename>
+    [<clients> [<requests per client>]] [--memfd]
+
+With --memfd, each client keeps its copy of the image in a memfd
+instead, and sends its descriptor with every request, so a bitmap is
+encoded in place in the client's memory and decoded from there.
+
+Latency percentiles are reported for encoding and decoding
+separately, along with the requests per second all clients got
+through together.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "daemon.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Seconds since start.
+static double since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(const char* label, std::vector<double>* latencies) {
+    if (latencies->empty()) {
+        return;
+    }
+    std::sort(latencies->begin(), latencies->end());
+    auto percentile = [latencies](double p) {
+        const size_t i = static_cast<size_t>(p / 100 * latencies->size());
+        return (*latencies)[std::min(i, latencies->size() - 1)] * 1e3;
+    };
+    std::printf("%-7s p50 %8.3f ms, p90 %8.3f ms, p99 %8.3f ms,"
+        " p99.9 %8.3f ms, max %8.3f ms\n", label, percentile(50),
+        percentile(90), percentile(99), percentile(99.9),
+        latencies->back() * 1e3);
+}
+
+// A memfd holding a copy of image, or -1 if it can't be made.
+static int memfd_copy(const std::string& image) {
+    std::ifstream in(image, std::ios::binary);
+    const std::string bytes((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    const int fd = ::memfd_create("easylsb_loadgen",
+        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || !in ||
+        ::write(fd, bytes.data(), bytes.size()) !=
+            static_cast<ssize_t>(bytes.size())) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    bool memfd = false;
+    if (argc > 1 && std::string(argv[argc - 1]) == "--memfd") {
+        memfd = true;
+        --argc;
+    }
+    if (argc < 4 || argc > 6) {
+        std::cout << "Usage: EasyLSB_loadgen <socket path> <image filename>" <<
+            " <message filename> [<clients> [<requests per client>]]" <<
+            " [--memfd]\n";
+        return -1;
+    }
+    std::ifstream in(argv[3], std::ios::binary);
+    if (!in) {
+        std::cout << "Cannot open message file!\n";
+        return -1;
+    }
+    const std::string msg((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    const int clients = argc >= 5 ? std::stoi(argv[4]) : 4;
+    const int requests = argc == 6 ? std::stoi(argv[5]) : 1000;
+    const std::string image = std::filesystem::absolute(argv[2]).string();
+    const std::string extension =
+        std::filesystem::path(argv[2]).extension().string();
+    std::mutex mutex;
+    std::vector<double> encode_latencies;
+    std::vector<double> decode_latencies;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+    const Clock::time_point start = Clock::now();
+    for (int c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            std::vector<double> encodes;
+            std::vector<double> decodes;
+            const std::string out = (std::filesystem::temp_directory_path() /
+                ("easylsb_loadgen" + std::to_string(c) + extension)).string();
+            int fd = -1;
+            try {
+                DaemonClient client(argv[1]);
+                DaemonRequest encode;
+                encode.op = DaemonRequest::Op::ENCODE;
+                encode.message = msg;
+                DaemonRequest decode;
+                if (memfd) {
+                    fd = memfd_copy(image);
+                    if (fd < 0) {
+                        throw std::runtime_error("Cannot copy image!\n");
+                    }
+                    encode.image_fd = fd;
+                    decode.image_fd = fd;
+                } else {
+                    encode.image = image;
+                    encode.output = out;
+                    decode.image = out;
+                }
+                for (int i = 0; i < requests; ++i) {
+                    Clock::time_point sent = Clock::now();
+                    DaemonResponse response = client.call(encode);
+                    encodes.push_back(since(sent));
+                    if (!response.ok) {
+                        throw std::runtime_error(response.data);
+                    }
+                    sent = Clock::now();
+                    response = client.call(decode);
+                    decodes.push_back(since(sent));
+                    if (!response.ok) {
+                        throw std::runtime_error(response.data);
+                    }
+                    if (response.data != msg) {
+                        throw std::runtime_error(
+                            "Decoded message is different!\n");
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            std::remove(out.c_str());
+            std::lock_guard<std::mutex> lock(mutex);
+            encode_latencies.insert(encode_latencies.end(), encodes.begin(),
+                encodes.end());
+            decode_latencies.insert(decode_latencies.end(), decodes.begin(),
+                decodes.end());
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    const double seconds = since(start);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    std::printf("%zu byte message, %d clients%s, %zu requests in %.3f s"
+        " (%.0f requests/s)\n", msg.size(), clients, memfd ? " (memfd)" : "",
+        encode_latencies.size() + decode_latencies.size(), seconds,
+        (encode_latencies.size() + decode_latencies.size()) / seconds);
+    report("encode", &encode_latencies);
+    report("decode", &decode_latencies);
+    return 0;
+}
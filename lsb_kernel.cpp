@@ -0,0 +1,184 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+lsb_kernel.cpp
+
+Embed and extract kernels over raw sample bytes.
+See lsb_kernel.h for how stream bits map onto channels.
+
+The loops are templates over how a sample is stored, so the
+per-channel work compiles down to plain loads and stores with
+no branching on the format.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "lsb_kernel.h"
+
+namespace {
+
+struct Byte {
+    static const size_t SIZE = 1;
+    static uint16_t load(const uint8_t* p) {
+        return p[0];
+    }
+    static void store(uint8_t* p, uint16_t value) {
+        p[0] = static_cast<uint8_t>(value);
+    }
+};
+
+struct BigEndian16 {
+    static const size_t SIZE = 2;
+    static uint16_t load(const uint8_t* p) {
+        return static_cast<uint16_t>(p[0] << 8 | p[1]);
+    }
+    static void store(uint8_t* p, uint16_t value) {
+        p[0] = static_cast<uint8_t>(value >> 8);
+        p[1] = static_cast<uint8_t>(value);
+    }
+};
+
+struct LittleEndian16 {
+    static const size_t SIZE = 2;
+    static uint16_t load(const uint8_t* p) {
+        return static_cast<uint16_t>(p[1] << 8 | p[0]);
+    }
+    static void store(uint8_t* p, uint16_t value) {
+        p[0] = static_cast<uint8_t>(value);
+        p[1] = static_cast<uint8_t>(value >> 8);
+    }
+};
+
+/*
+First plane of channel that holds a bit at or after first_bit, and
+that bit. Just plane 0 unless the stream is being done in pieces.
+*/
+inline size_t first_stream_bit(size_t channel, const StreamLayout& layout,
+    size_t* plane) {
+    if (channel >= layout.first_bit) {
+        *plane = 0;
+        return channel;
+    }
+    *plane = (layout.first_bit - channel + layout.num_channels - 1) /
+        layout.num_channels;
+    return channel + *plane * layout.num_channels;
+}
+
+// Bit k of the stream, most significant bit of each byte first.
+inline uint16_t stream_bit(const uint8_t* stream, size_t k) {
+    return (stream[k >> 3] >> (7 - (k & 7))) & 1;
+}
+
+// Where the i-th channel of a run is stored, in samples.
+template <bool BGR>
+inline size_t position(size_t i) {
+    return BGR ? i - i % 3 + 2 - i % 3 : i;
+}
+
+template <class Sample, bool BGR>
+void embed_run(uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, const uint8_t* stream) {
+    // Channels at or past stream_bits don't even get a plane 0 bit.
+    const size_t end = last_stream_channel(layout);
+    for (size_t i = 0; i < count && first + i < end; ++i) {
+        uint8_t* p = samples + position<BGR>(i) * Sample::SIZE;
+        uint16_t value = Sample::load(p);
+        // Same channel in the next plane is num_channels bits later.
+        size_t plane;
+        size_t k = first_stream_bit(first + i, layout, &plane);
+        for (; plane < layout.channel_bits && k < layout.stream_bits;
+            ++plane, k += layout.num_channels) {
+            const uint16_t mask = static_cast<uint16_t>(1u << plane);
+            value = static_cast<uint16_t>((value & ~mask) |
+                (stream_bit(stream, k - layout.first_bit) << plane));
+        }
+        Sample::store(p, value);
+    }
+}
+
+template <class Sample, bool BGR>
+void extract_run(const uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, uint8_t* stream) {
+    const size_t end = last_stream_channel(layout);
+    for (size_t i = 0; i < count && first + i < end; ++i) {
+        const uint16_t value =
+            Sample::load(samples + position<BGR>(i) * Sample::SIZE);
+        size_t plane;
+        size_t k = first_stream_bit(first + i, layout, &plane);
+        for (; plane < layout.channel_bits && k < layout.stream_bits;
+            ++plane, k += layout.num_channels) {
+            const uint8_t bit = (value >> plane) & 1;
+            const size_t j = k - layout.first_bit;
+            stream[j >> 3] |= static_cast<uint8_t>(bit << (7 - (j & 7)));
+        }
+    }
+}
+
+}  // namespace
+
+void embed_samples(uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, const uint8_t* stream) {
+    if (layout.bytes_per_sample == 1) {
+        if (layout.bgr) {
+            embed_run<Byte, true>(samples, first, count, layout, stream);
+        } else {
+            embed_run<Byte, false>(samples, first, count, layout, stream);
+        }
+    } else if (layout.little_endian) {
+        if (layout.bgr) {
+            embed_run<LittleEndian16, true>(samples, first, count, layout,
+                stream);
+        } else {
+            embed_run<LittleEndian16, false>(samples, first, count, layout,
+                stream);
+        }
+    } else {
+        embed_run<BigEndian16, false>(samples, first, count, layout, stream);
+    }
+}
+
+void extract_samples(const uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, uint8_t* stream) {
+    if (layout.bytes_per_sample == 1) {
+        if (layout.bgr) {
+            extract_run<Byte, true>(samples, first, count, layout, stream);
+        } else {
+            extract_run<Byte, false>(samples, first, count, layout, stream);
+        }
+    } else if (layout.little_endian) {
+        if (layout.bgr) {
+            extract_run<LittleEndian16, true>(samples, first, count, layout,
+                stream);
+        } else {
+            extract_run<LittleEndian16, false>(samples, first, count, layout,
+                stream);
+        }
+    } else {
+        extract_run<BigEndian16, false>(samples, first, count, layout,
+            stream);
+    }
+}
+
+size_t last_stream_channel(const StreamLayout& layout) {
+    return layout.stream_bits < layout.num_channels ?
+        layout.stream_bits : layout.num_channels;
+}
+
+size_t stream_channel_runs(const StreamLayout& layout, ChannelRun runs[2]) {
+    const size_t n = layout.num_channels;
+    if (layout.stream_bits <= layout.first_bit) {
+        return 0;
+    } else if (layout.stream_bits - layout.first_bit >= n) {
+        runs[0] = {0, n};
+        return 1;
+    }
+    const size_t begin = layout.first_bit % n;
+    const size_t end = begin + (layout.stream_bits - layout.first_bit);
+    if (end <= n) {
+        runs[0] = {begin, end - begin};
+        return 1;
+    }
+    runs[0] = {0, end - n};
+    runs[1] = {begin, n - begin};
+    return 2;
+}
@@ -0,0 +1,98 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+lsb_kernel.h
+
+The embed and extract kernels that run directly over raw sample
+bytes, whether those are a chunk of a streamed image or the rows of
+a bitmap sitting in its file buffer.
+
+EasyLSB writes one bit stream: the header (payload.h) followed by
+the payload, each byte most significant bit first. Walking the
+channels in order and wrapping around into higher bit planes means
+bit k of the stream always lands in channel k % num_channels, at
+bit plane k / num_channels. Since that only depends on k, any run of
+consecutive channels can be processed on its own, as long as the
+caller says where the run starts, and so can any part of the stream,
+as long as the caller says which bits it holds.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef LSB_KERNEL_H_
+#define LSB_KERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+class ChannelOrder;
+
+// Where the bit stream lives in the carrier, and how samples are stored.
+struct StreamLayout {
+    // Channels in the whole image, i.e. one bit plane.
+    size_t num_channels;
+    // Bit planes per channel, 8 or 16 (or fewer for odd maxvals).
+    size_t channel_bits;
+    // Bytes each sample takes up, 1 or 2.
+    size_t bytes_per_sample;
+    /*
+    16 bit samples are most significant byte first (Netpbm, PNG)
+    unless this is set (bitmaps).
+    */
+    bool little_endian;
+    /*
+    Bitmaps store pixels blue, green, red. The kernel still walks
+    them red, green, blue, so every group of three is reversed.
+    */
+    bool bgr;
+    // Length of the bit stream in bits.
+    size_t stream_bits;
+    /*
+    Bits before this one, a multiple of 8, are left alone, and the
+    stream passed to the kernel starts with byte first_bit / 8.
+    Lets a stream be embedded or extracted a piece at a time.
+    */
+    size_t first_bit = 0;
+    /*
+    If set, rows are filled in this keyed order instead (see
+    channel_order.h); channel numbers here are then logical ones.
+    */
+    const ChannelOrder* order = nullptr;
+};
+
+// Consecutive channels [first, first + count).
+struct ChannelRun {
+    size_t first;
+    size_t count;
+};
+
+/*
+Writes the bits of stream that belong to channels
+[first, first + count) into samples, which points at channel first.
+With bgr set, samples must start at the first channel of a pixel.
+*/
+void embed_samples(uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, const uint8_t* stream);
+
+/*
+Reverse of embed_samples(). ORs the bits found in channels
+[first, first + count) into stream, which must start out zeroed.
+*/
+void extract_samples(const uint8_t* samples, size_t first, size_t count,
+    const StreamLayout& layout, uint8_t* stream);
+
+/*
+One past the last channel that holds a bit of the stream.
+Once a decoder is past this channel it can stop reading.
+*/
+size_t last_stream_channel(const StreamLayout& layout);
+
+/*
+The channels holding bits [first_bit, stream_bits): a piece of the
+stream shorter than one bit plane can wrap around to the start of
+the next plane, so it takes up to two runs. Returns how many runs
+were written to runs.
+*/
+size_t stream_channel_runs(const StreamLayout& layout, ChannelRun runs[2]);
+
+#endif  // LSB_KERNEL_H_
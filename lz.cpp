@@ -0,0 +1,147 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+lz.cpp
+
+LZ4 style block compression. See lz.h for the format.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "lz.h"
+
+#include <cstring>
+#include <stdexcept>
+
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+static const size_t HASH_BITS = 14;
+
+static uint32_t load32(const uint8_t* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static size_t hash4(const uint8_t* p) {
+    return (load32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the part of a length that doesn't fit in its nibble.
+static void put_length(std::vector<uint8_t>& out, size_t length) {
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(length));
+}
+
+static void put_sequence(std::vector<uint8_t>& out, const uint8_t* literals,
+    size_t literal_count, size_t offset, size_t match_length) {
+    const size_t extra = match_length ? match_length - MIN_MATCH : 0;
+    out.push_back(static_cast<uint8_t>(
+        (literal_count < 15 ? literal_count : 15) << 4 |
+        (extra < 15 ? extra : 15)));
+    if (literal_count >= 15) {
+        put_length(out, literal_count - 15);
+    }
+    out.insert(out.end(), literals, literals + literal_count);
+    if (match_length == 0) {
+        return;
+    }
+    out.push_back(static_cast<uint8_t>(offset));
+    out.push_back(static_cast<uint8_t>(offset >> 8));
+    if (extra >= 15) {
+        put_length(out, extra - 15);
+    }
+}
+
+std::vector<uint8_t> lz_compress(const uint8_t* data, size_t size) {
+    std::vector<uint8_t> out;
+    out.reserve(size + size / 255 + 16);
+    // Position + 1 of the last 4 bytes seen with each hash, 0 for none.
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (size >= MIN_MATCH && pos <= size - MIN_MATCH) {
+        const size_t h = hash4(data + pos);
+        const size_t candidate = table[h];
+        table[h] = static_cast<uint32_t>(pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+            load32(data + candidate - 1) != load32(data + pos)) {
+            ++pos;
+            continue;
+        }
+        const size_t match = candidate - 1;
+        size_t length = MIN_MATCH;
+        while (pos + length < size && data[match + length] ==
+            data[pos + length]) {
+            ++length;
+        }
+        put_sequence(out, data + anchor, pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+    put_sequence(out, data + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+// Reads the part of a length that didn't fit in its nibble.
+static size_t get_length(const uint8_t*& in, const uint8_t* end) {
+    size_t length = 0;
+    uint8_t byte;
+    do {
+        if (in == end) {
+            throw std::runtime_error("Compressed message is damaged!\n");
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+void lz_decompress(const uint8_t* data, size_t size, uint8_t* out,
+    size_t out_size) {
+    const uint8_t* in = data;
+    const uint8_t* end = data + size;
+    size_t pos = 0;
+    while (in < end) {
+        const uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15) {
+            literal_count += get_length(in, end);
+        }
+        if (static_cast<size_t>(end - in) < literal_count ||
+            out_size - pos < literal_count) {
+            throw std::runtime_error("Compressed message is damaged!\n");
+        }
+        std::memcpy(out + pos, in, literal_count);
+        in += literal_count;
+        pos += literal_count;
+        if (in == end) {
+            break;
+        }
+        if (end - in < 2) {
+            throw std::runtime_error("Compressed message is damaged!\n");
+        }
+        const size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15) {
+            length += get_length(in, end);
+        }
+        length += MIN_MATCH;
+        if (offset == 0 || offset > pos || out_size - pos < length) {
+            throw std::runtime_error("Compressed message is damaged!\n");
+        }
+        // Byte by byte, since a match may overlap its own output.
+        const uint8_t* from = out + pos - offset;
+        for (size_t i = 0; i < length; ++i) {
+            out[pos + i] = from[i];
+        }
+        pos += length;
+    }
+    if (pos != out_size) {
+        throw std::runtime_error("Compressed message is damaged!\n");
+    }
+}
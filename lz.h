@@ -0,0 +1,37 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+lz.h
+
+A small, fast LZ77 codec for compressing messages before they are
+embedded. Text compresses 2-4x, and every byte saved is 8 channels
+(or bit planes) of the image left untouched.
+
+The format is LZ4's block format: a sequence is a token byte (literal
+count in the high nibble, match length minus 4 in the low nibble,
+15 meaning more length bytes follow), the literals, then a 2 byte
+little endian offset back into the output and any extra match length
+bytes. The last sequence has literals only. Matches are found with a
+single hash table of 4 byte prefixes, which is greedy but quick.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compresses size bytes of data. Incompressible data grows slightly.
+std::vector<uint8_t> lz_compress(const uint8_t* data, size_t size);
+
+/*
+Decompresses size bytes of compressed data into exactly out_size
+bytes at out. Throws std::runtime_error if the data is damaged.
+*/
+void lz_decompress(const uint8_t* data, size_t size, uint8_t* out,
+    size_t out_size);
+
+#endif  // LZ_H_
@@ -0,0 +1,152 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+netpbm.cpp
+
+Streaming reader and writer for binary PGM and PPM images.
+See netpbm.h for the format.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "netpbm.h"
+
+#include <cctype>
+#include <stdexcept>
+
+/*
+The header is the magic number, width, height and maxval separated
+by whitespace, with '#' comments allowed between any two tokens.
+Exactly one whitespace char follows maxval, then the samples start.
+*/
+NetpbmReader::NetpbmReader(const char* filename)
+    : in(filename, std::ios::binary), rows_read(0) {
+    if (!in) {
+        throw std::runtime_error("Cannot open input image!\n");
+    }
+    char magic[2] = {0, 0};
+    in.read(magic, 2);
+    if (magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+        throw std::runtime_error("Unsupported image format!\n");
+    }
+    header_text.assign(magic, 2);
+    colors = magic[1] == '6' ? 3 : 1;
+    width = read_header_number();
+    height = read_header_number();
+    maxval = read_header_number();
+    if (width == 0 || height == 0 || maxval == 0 || maxval > 65535) {
+        throw std::runtime_error("Malformed Netpbm header!\n");
+    }
+    if (channel_bits() == 0) {
+        throw std::runtime_error("Netpbm maxval leaves no bit planes!\n");
+    }
+}
+
+size_t NetpbmReader::read_header_number() {
+    int ch = in.get();
+    while (ch != EOF && (std::isspace(ch) || ch == '#')) {
+        header_text += static_cast<char>(ch);
+        if (ch == '#') {
+            // Comment runs until the end of the line.
+            while ((ch = in.get()) != EOF && ch != '\n') {
+                header_text += static_cast<char>(ch);
+            }
+            continue;
+        }
+        ch = in.get();
+    }
+    if (ch == EOF || !std::isdigit(ch)) {
+        throw std::runtime_error("Malformed Netpbm header!\n");
+    }
+    size_t value = 0;
+    while (ch != EOF && std::isdigit(ch)) {
+        header_text += static_cast<char>(ch);
+        value = value * 10 + (ch - '0');
+        if (value > 0xFFFFFFFF) {
+            throw std::runtime_error("Malformed Netpbm header!\n");
+        }
+        ch = in.get();
+    }
+    if (ch == EOF || !std::isspace(ch)) {
+        throw std::runtime_error("Malformed Netpbm header!\n");
+    }
+    // The single whitespace char that ends the token.
+    header_text += static_cast<char>(ch);
+    return value;
+}
+
+const std::string& NetpbmReader::header() const {
+    return header_text;
+}
+
+size_t NetpbmReader::rows() const {
+    return height;
+}
+
+size_t NetpbmReader::row_channels() const {
+    return width * colors;
+}
+
+size_t NetpbmReader::bytes_per_sample() const {
+    return maxval > 255 ? 2 : 1;
+}
+
+/*
+8 or 16 for the common cases, but e.g. a 12 bit scanner writes
+maxval 4095 and only has 12 bit planes. A plane can only be written
+if setting it, and every plane below it, can't take a sample past
+maxval, which holds for exactly the planes where maxval's bits are
+all 1: maxval 100 (1100100 in binary) has none, and 101 has one.
+*/
+size_t NetpbmReader::channel_bits() const {
+    size_t bits = 0;
+    for (size_t m = maxval; (m & 1) != 0; m >>= 1) {
+        ++bits;
+    }
+    return bits;
+}
+
+size_t NetpbmReader::read_rows(uint8_t* buffer, size_t count) {
+    if (count > height - rows_read) {
+        count = height - rows_read;
+    }
+    const std::streamsize want =
+        static_cast<std::streamsize>(count * row_bytes());
+    in.read(reinterpret_cast<char*>(buffer), want);
+    if (in.gcount() != want) {
+        throw std::runtime_error("Netpbm image data is truncated!\n");
+    }
+    rows_read += count;
+    return count;
+}
+
+size_t NetpbmReader::skip_rows(size_t count) {
+    if (count > height - rows_read) {
+        count = height - rows_read;
+    }
+    in.seekg(static_cast<std::streamoff>(count * row_bytes()), std::ios::cur);
+    if (!in) {
+        throw std::runtime_error("Netpbm image data is truncated!\n");
+    }
+    rows_read += count;
+    return count;
+}
+
+std::unique_ptr<RowWriter> NetpbmReader::create_writer(const char* filename,
+    const OutputOptions& options) {
+    return std::make_unique<NetpbmWriter>(filename, *this, options);
+}
+
+NetpbmWriter::NetpbmWriter(const char* filename, const NetpbmReader& reader,
+    const OutputOptions& options)
+    : out(filename, options), row_bytes(reader.row_bytes()) {
+    out.write(reader.header().data(), reader.header().size());
+}
+
+void NetpbmWriter::write_rows(const uint8_t* buffer, size_t count) {
+    out.write(buffer, count * row_bytes);
+}
+
+void NetpbmWriter::close() {
+    out.close();
+}
@@ -0,0 +1,73 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+netpbm.h
+
+Streaming reader and writer for binary Netpbm images:
+PGM (P5, one gray channel per pixel) and PPM (P6, RGB).
+
+Netpbm pixel data is contiguous, top-down and unpadded, so the
+samples come off the disk already in EasyLSB's traversal order and
+go straight to the embed kernel (see row_stream.h).
+
+Samples are one byte if maxval < 256, otherwise two bytes,
+most significant byte first.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef NETPBM_H_
+#define NETPBM_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "row_stream.h"
+
+class NetpbmReader : public RowReader {
+ private:
+    std::ifstream in;
+    // Header exactly as it appeared in the file, comments included.
+    std::string header_text;
+    size_t width;
+    size_t height;
+    size_t maxval;
+    // 1 for PGM, 3 for PPM.
+    size_t colors;
+    // Rows handed out so far.
+    size_t rows_read;
+
+    // Reads one header token, skipping whitespace and comments.
+    size_t read_header_number();
+
+ public:
+    explicit NetpbmReader(const char* filename);
+    const std::string& header() const;
+    size_t rows() const override;
+    size_t row_channels() const override;
+    size_t bytes_per_sample() const override;
+    // Low bits set in maxval, i.e. planes that can't go past it.
+    size_t channel_bits() const override;
+    size_t read_rows(uint8_t* buffer, size_t count) override;
+    // Seeks past the rows; Netpbm pixel data is a plain array.
+    size_t skip_rows(size_t count) override;
+    std::unique_ptr<RowWriter> create_writer(const char* filename,
+        const OutputOptions& options) override;
+};
+
+class NetpbmWriter : public RowWriter {
+ private:
+    OutputFile out;
+    size_t row_bytes;
+
+ public:
+    // Creates filename and writes the header copied from reader.
+    NetpbmWriter(const char* filename, const NetpbmReader& reader,
+        const OutputOptions& options);
+    void write_rows(const uint8_t* buffer, size_t count) override;
+    void close() override;
+};
+
+#endif  // NETPBM_H_
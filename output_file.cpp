@@ -0,0 +1,238 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+output_file.cpp
+
+Output images written with writev(), O_DIRECT and posix_fadvise().
+See output_file.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "output_file.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+/*
+O_DIRECT needs the buffer, file offset and length aligned to the
+logical block size. 4096 covers every common device.
+*/
+static const size_t DIRECT_ALIGNMENT = 4096;
+// O_DIRECT writes are staged and sent this many bytes at a time.
+static const size_t BOUNCE_BYTES = 4 << 20;
+// Plain copies (when nothing faster works) go this many bytes at a time.
+static const size_t COPY_BYTES = 1 << 20;
+
+void AlignedDeleter::operator()(uint8_t* p) const {
+    std::free(p);
+}
+
+OutputFile::OutputFile(const char* filename,
+    const OutputOptions& output_options, Mode mode)
+    : fd(-1), options(output_options), direct(false), bounce_used(0) {
+    const int flags = mode == Mode::CREATE ?
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_WRONLY | O_CLOEXEC;
+    // Patches are small writes at odd offsets, which O_DIRECT can't do.
+    if (options.direct && mode == Mode::CREATE) {
+        fd = ::open(filename, flags | O_DIRECT, 0644);
+        // tmpfs and some others refuse O_DIRECT with EINVAL.
+        direct = fd >= 0;
+    }
+    if (fd < 0) {
+        fd = ::open(filename, flags, 0644);
+    }
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open output image!\n");
+    }
+    if (direct) {
+        void* p = nullptr;
+        if (posix_memalign(&p, DIRECT_ALIGNMENT, BOUNCE_BYTES) != 0) {
+            ::close(fd);
+            throw std::bad_alloc();
+        }
+        bounce.reset(static_cast<uint8_t*>(p));
+    }
+}
+
+// Closes without the checks close() does, e.g. when unwinding.
+OutputFile::~OutputFile() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+void OutputFile::write_all(iovec* pieces, int count) {
+    while (count > 0) {
+        const ssize_t written =
+            ::writev(fd, pieces, std::min(count, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+        // Skip what made it out, which may end partway into a piece.
+        size_t left = static_cast<size_t>(written);
+        while (count > 0 && left >= pieces->iov_len) {
+            left -= pieces->iov_len;
+            ++pieces;
+            --count;
+        }
+        if (count > 0) {
+            pieces->iov_base = static_cast<uint8_t*>(pieces->iov_base) + left;
+            pieces->iov_len -= left;
+        }
+    }
+}
+
+void OutputFile::write(const iovec* pieces, int count) {
+    if (!direct) {
+        // writev() takes non-const iovecs, and write_all() moves them.
+        std::vector<iovec> copy(pieces, pieces + count);
+        write_all(copy.data(), count);
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        const uint8_t* data = static_cast<const uint8_t*>(pieces[i].iov_base);
+        size_t size = pieces[i].iov_len;
+        while (size > 0) {
+            const size_t n = std::min(size, BOUNCE_BYTES - bounce_used);
+            std::memcpy(bounce.get() + bounce_used, data, n);
+            bounce_used += n;
+            data += n;
+            size -= n;
+            if (bounce_used == BOUNCE_BYTES) {
+                flush_bounce(false);
+            }
+        }
+    }
+}
+
+void OutputFile::write(const void* data, size_t size) {
+    iovec piece = {const_cast<void*>(data), size};
+    write(&piece, 1);
+}
+
+void OutputFile::copy_from(int src_fd) {
+    // Same data, no copying and no extra space on btrfs and XFS.
+    if (!direct && ioctl(fd, FICLONE, src_fd) == 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        throw std::runtime_error("Cannot read input image!\n");
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    size_t copied = 0;
+    /*
+    copy_file_range() keeps the data in the kernel, and some
+    filesystems turn it into a reflink or server side copy too.
+    */
+    if (!direct) {
+        loff_t src_offset = 0;
+        while (copied < size) {
+            const ssize_t n = copy_file_range(src_fd, &src_offset, fd,
+                nullptr, size - copied, 0);
+            if (n <= 0) {
+                break;
+            }
+            copied += static_cast<size_t>(n);
+        }
+    }
+    // Whatever is left (all of it, if nothing above worked).
+    std::vector<uint8_t> buffer(std::min(size - copied, COPY_BYTES));
+    while (copied < size) {
+        const ssize_t n = pread(src_fd, buffer.data(), buffer.size(),
+            static_cast<off_t>(copied));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            throw std::runtime_error("Cannot read input image!\n");
+        }
+        write(buffer.data(), static_cast<size_t>(n));
+        copied += static_cast<size_t>(n);
+    }
+}
+
+void OutputFile::write_at(const void* data, size_t size, uint64_t offset) {
+    if (direct) {
+        // Nothing staged may be left behind, and the patch isn't aligned.
+        flush_bounce(true);
+        const int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+        direct = false;
+    }
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, p, size, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+}
+
+/*
+Writes as much of the staging buffer as O_DIRECT allows. Only the
+final flush can leave an unaligned tail, which is written after
+switching O_DIRECT back off for the file.
+*/
+void OutputFile::flush_bounce(bool final) {
+    const size_t aligned = bounce_used & ~(DIRECT_ALIGNMENT - 1);
+    iovec piece = {bounce.get(), aligned};
+    write_all(&piece, aligned > 0 ? 1 : 0);
+    const size_t tail = bounce_used - aligned;
+    if (final && tail > 0) {
+        const int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            throw std::runtime_error("Cannot write output image!\n");
+        }
+        piece = {bounce.get() + aligned, tail};
+        write_all(&piece, 1);
+    } else if (tail > 0) {
+        std::memmove(bounce.get(), bounce.get() + aligned, tail);
+    }
+    bounce_used = final ? 0 : tail;
+}
+
+void OutputFile::close() {
+    if (direct) {
+        flush_bounce(true);
+    }
+    if (options.sync && fsync(fd) != 0) {
+        throw std::runtime_error("Cannot write output image!\n");
+    }
+    if (options.drop_cache) {
+        /*
+        DONTNEED skips dirty pages, so they have to be written back
+        first. Pages written with O_DIRECT never entered the cache.
+        */
+        if (!options.sync) {
+            fdatasync(fd);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    const int result = ::close(fd);
+    fd = -1;
+    if (result != 0) {
+        throw std::runtime_error("Cannot write output image!\n");
+    }
+}
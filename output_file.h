@@ -0,0 +1,99 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+output_file.h
+
+Writes output images with as few system calls as possible.
+
+Every writer in EasyLSB goes through OutputFile rather than an
+iostream. Pieces that belong together (a PNG chunk's length, type,
+data and CRC) go out as one writev(). A bitmap output starts out as a
+clone of the input, sharing its extents on filesystems with reflinks,
+and only the rows that carry the message are written over it.
+
+For batch runs writing far more data than fits in memory, the output
+can also bypass the page cache with O_DIRECT, or be dropped from it
+with posix_fadvise() once written, and can be fsync()ed before it is
+closed.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef OUTPUT_FILE_H_
+#define OUTPUT_FILE_H_
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+
+// Settings for writing output images.
+struct OutputOptions {
+    /*
+    zlib compression level for compressed formats, 0 (fastest,
+    largest) to 9 (slowest, smallest), or -1 for zlib's default.
+    */
+    int compression_level = -1;
+    // fsync() the output before closing it.
+    bool sync = false;
+    /*
+    Write with O_DIRECT, bypassing the page cache. Falls back to
+    ordinary writes on filesystems that don't support it.
+    */
+    bool direct = false;
+    /*
+    Once the output is written, wait for it to reach the disk and
+    tell the kernel its pages won't be needed again.
+    */
+    bool drop_cache = false;
+};
+
+// Frees memory from posix_memalign().
+struct AlignedDeleter {
+    void operator()(uint8_t* p) const;
+};
+
+class OutputFile {
+ public:
+    /*
+    CREATE creates or truncates the file. PATCH opens an existing
+    file to write over parts of it, leaving the rest alone.
+    */
+    enum class Mode { CREATE, PATCH };
+
+ private:
+    int fd;
+    OutputOptions options;
+    // True if fd was really opened with O_DIRECT.
+    bool direct;
+    // Aligned staging buffer for O_DIRECT, and how much of it is used.
+    std::unique_ptr<uint8_t, AlignedDeleter> bounce;
+    size_t bounce_used;
+
+    // Writes every byte of pieces, retrying short writes.
+    void write_all(iovec* pieces, int count);
+    // Sends the aligned part of the staging buffer to the disk.
+    void flush_bounce(bool final);
+
+ public:
+    OutputFile(const char* filename, const OutputOptions& output_options,
+        Mode mode = Mode::CREATE);
+    ~OutputFile();
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+    // Writes count pieces in order, as a single writev() where possible.
+    void write(const iovec* pieces, int count);
+    void write(const void* data, size_t size);
+    /*
+    Makes the file a copy of the open file src_fd: a reflink clone
+    (FICLONE) where the filesystem supports it, then copy_file_range(),
+    then plain reads and writes. Call it first, on an empty file.
+    */
+    void copy_from(int src_fd);
+    // Overwrites size bytes at offset, without moving anything else.
+    void write_at(const void* data, size_t size, uint64_t offset);
+    // Flushes, syncs and drops the cache as asked, then closes.
+    void close();
+};
+
+#endif  // OUTPUT_FILE_H_
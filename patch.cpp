@@ -0,0 +1,192 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+patch.cpp
+
+Binary patches of changed carrier bytes. See patch.h for the format.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "patch.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "crc32c.h"
+
+static const char PATCH_MAGIC[8] = {'E', 'L', 'S', 'B', 'P', 'A', 'T', '2'};
+// Offset and length of a run take 12 bytes, so merge across gaps shorter.
+static const size_t RUN_OVERHEAD = 12;
+
+static void put_le(std::vector<uint8_t>& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+static uint64_t get_le(const uint8_t* p, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    }
+    return value;
+}
+
+Patch::Patch(uint64_t size) : target_size(size), original_crc(0) {}
+
+void Patch::add_differences(const uint8_t* before, const uint8_t* after,
+    size_t size, uint64_t offset) {
+    size_t i = 0;
+    while (i < size) {
+        if (before[i] == after[i]) {
+            ++i;
+            continue;
+        }
+        // Extend the run until RUN_OVERHEAD unchanged bytes in a row.
+        size_t end = i + 1;
+        size_t same = 0;
+        for (size_t j = end; j < size && same < RUN_OVERHEAD; ++j) {
+            if (before[j] == after[j]) {
+                ++same;
+            } else {
+                same = 0;
+                end = j + 1;
+            }
+        }
+        original_crc = crc32c(original_crc, before + i, end - i);
+        runs.push_back({offset + i,
+            std::vector<uint8_t>(after + i, after + end)});
+        i = end;
+    }
+}
+
+size_t Patch::changed_bytes() const {
+    size_t total = 0;
+    for (const Run& run : runs) {
+        total += run.bytes.size();
+    }
+    return total;
+}
+
+size_t Patch::num_runs() const {
+    return runs.size();
+}
+
+void Patch::save(const char* filename, const OutputOptions& options) const {
+    std::vector<uint8_t> data(PATCH_MAGIC, PATCH_MAGIC + 8);
+    put_le(data, target_size, 8);
+    put_le(data, original_crc, 4);
+    put_le(data, runs.size(), 4);
+    for (const Run& run : runs) {
+        put_le(data, run.offset, 8);
+        put_le(data, run.bytes.size(), 4);
+        data.insert(data.end(), run.bytes.begin(), run.bytes.end());
+    }
+    OutputFile out(filename, options);
+    out.write(data.data(), data.size());
+    out.close();
+}
+
+Patch Patch::load(const char* filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open patch!\n");
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)),
+        std::istreambuf_iterator<char>());
+    if (data.size() < 24 || std::memcmp(data.data(), PATCH_MAGIC, 8) != 0) {
+        throw std::runtime_error("Not an EasyLSB patch!\n");
+    }
+    Patch patch(get_le(&data[8], 8));
+    patch.original_crc = static_cast<uint32_t>(get_le(&data[16], 4));
+    const uint64_t count = get_le(&data[20], 4);
+    size_t pos = 24;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (data.size() - pos < RUN_OVERHEAD) {
+            throw std::runtime_error("Patch is truncated!\n");
+        }
+        const uint64_t offset = get_le(&data[pos], 8);
+        const uint64_t length = get_le(&data[pos + 8], 4);
+        pos += RUN_OVERHEAD;
+        if (data.size() - pos < length || offset > patch.target_size ||
+            patch.target_size - offset < length) {
+            throw std::runtime_error("Patch is truncated!\n");
+        }
+        patch.runs.push_back({offset, std::vector<uint8_t>(
+            data.begin() + pos, data.begin() + pos + length)});
+        pos += length;
+    }
+    return patch;
+}
+
+// CRC-32C of the bytes of fd that runs would replace, in their order.
+uint32_t Patch::target_crc(int fd) const {
+    uint32_t crc = 0;
+    std::vector<uint8_t> buffer;
+    for (const Run& run : runs) {
+        buffer.resize(run.bytes.size());
+        size_t done = 0;
+        while (done < buffer.size()) {
+            const ssize_t n = ::pread(fd, buffer.data() + done,
+                buffer.size() - done, static_cast<off_t>(run.offset + done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                throw std::runtime_error("Cannot read input image!\n");
+            }
+            done += static_cast<size_t>(n);
+        }
+        crc = crc32c(crc, buffer.data(), buffer.size());
+    }
+    return crc;
+}
+
+void Patch::apply(const char* target, const char* output,
+    const OutputOptions& options) const {
+    const int fd = ::open(target, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("Cannot open input image!\n");
+    }
+    bool matches = false;
+    try {
+        matches = static_cast<uint64_t>(st.st_size) == target_size &&
+            target_crc(fd) == original_crc;
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (!matches) {
+        ::close(fd);
+        throw std::runtime_error("Patch is for a different image!\n");
+    }
+    std::error_code ec;
+    const bool in_place =
+        output == nullptr || std::filesystem::equivalent(target, output, ec);
+    try {
+        OutputFile out(in_place ? target : output, options,
+            in_place ? OutputFile::Mode::PATCH : OutputFile::Mode::CREATE);
+        if (!in_place) {
+            out.copy_from(fd);
+        }
+        for (const Run& run : runs) {
+            out.write_at(run.bytes.data(), run.bytes.size(), run.offset);
+        }
+        out.close();
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
@@ -0,0 +1,78 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+patch.h
+
+Binary patches: the bytes encode() changed in a carrier, as runs of
+new bytes at file offsets, instead of a whole re-encoded image.
+
+A short message only changes a few rows of a bitmap, so its patch is
+a few KB no matter how large the image is, and applying it is one
+pwrite() per run. Patches are only produced for bitmaps, since they
+are the carriers EasyLSB changes in place (see carrier.h).
+
+The patch also keeps the CRC-32C of the bytes its runs replace, as
+they were before, so it refuses to apply to any image but the one it
+was made from, even one of the same size, and to one it has already
+been applied to.
+
+File format, all integers little endian:
+    "ELSBPAT2"                  8 byte magic
+    uint64 target size          size of the file the patch applies to
+    uint32 original checksum    CRC-32C of the bytes the runs replace
+    uint32 run count
+    then for each run:
+        uint64 offset, uint32 length, length new bytes
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef PATCH_H_
+#define PATCH_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "output_file.h"
+
+class Patch {
+ private:
+    struct Run {
+        uint64_t offset;
+        std::vector<uint8_t> bytes;
+    };
+    uint64_t target_size;
+    // CRC-32C of the bytes the runs replace, in the order of the runs.
+    uint32_t original_crc;
+    std::vector<Run> runs;
+
+    // CRC-32C of the bytes of the open file fd that the runs replace.
+    uint32_t target_crc(int fd) const;
+
+ public:
+    // An empty patch for a target_size byte file.
+    explicit Patch(uint64_t size = 0);
+    /*
+    Records where after differs from before, two versions of the size
+    bytes starting at file offset offset. Changes only a few bytes
+    apart are merged into one run, which is smaller than two runs.
+    */
+    void add_differences(const uint8_t* before, const uint8_t* after,
+        size_t size, uint64_t offset);
+    // Number of bytes the patch writes.
+    size_t changed_bytes() const;
+    size_t num_runs() const;
+    void save(const char* filename, const OutputOptions& options) const;
+    // Reads a patch written by save(). Throws if it isn't one.
+    static Patch load(const char* filename);
+    /*
+    Applies the patch to target in place, or, if output is not
+    nullptr, to a copy of target created at output. Throws
+    std::runtime_error if target isn't the image the patch was made
+    from.
+    */
+    void apply(const char* target, const char* output,
+        const OutputOptions& options) const;
+};
+
+#endif  // PATCH_H_
@@ -0,0 +1,686 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+payload.cpp
+
+The message header and payload transforms. See payload.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "payload.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "crc32c.h"
+#include "crypto.h"
+#include "lz.h"
+#include "pipeline.h"
+#include "reed_solomon.h"
+
+static const uint8_t MAGIC[2] = {'E', 'L'};
+// Every PAYLOAD_* flag this version knows.
+static const uint8_t PAYLOAD_FLAGS = PAYLOAD_COMPRESSED | PAYLOAD_ENCRYPTED |
+    PAYLOAD_ECC | PAYLOAD_ARCHIVE | PAYLOAD_SHARD;
+// Flags that mean the payload is cut into framed blocks.
+static const uint8_t PAYLOAD_FRAMED = PAYLOAD_COMPRESSED | PAYLOAD_ENCRYPTED;
+// Offset of the checksum in a header.
+static const size_t CHECKSUM_OFFSET = 8;
+/*
+PBKDF2 rounds for the key. Slows down guessing passphrases, at the
+cost of a few tens of milliseconds per encode or decode.
+*/
+static const uint32_t KDF_ITERATIONS = 100000;
+
+static void put_be32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+size_t PayloadHeader::size() const {
+    size_t size = version < 2 ? V1_SIZE : SIZE;
+    if (flags & PAYLOAD_ECC) {
+        size += sizeof(parity);
+    }
+    if (flags & PAYLOAD_ENCRYPTED) {
+        size += SALT_SIZE + NONCE_PREFIX_SIZE;
+    }
+    if (flags & PAYLOAD_SHARD) {
+        size += SHARD_SIZE;
+    }
+    return size;
+}
+
+size_t PayloadHeader::stream_size() const {
+    if (flags & PAYLOAD_ECC) {
+        return size() + ReedSolomon(parity).encoded_size(length);
+    }
+    return size() + length;
+}
+
+void PayloadHeader::serialize(uint8_t* data) const {
+    data[0] = MAGIC[0];
+    data[1] = MAGIC[1];
+    data[2] = version;
+    data[3] = flags;
+    put_be32(data + 4, length);
+    uint8_t* rest = data + V1_SIZE;
+    if (version >= 2) {
+        put_be32(rest, checksum);
+        rest += SIZE - V1_SIZE;
+    }
+    if (flags & PAYLOAD_ECC) {
+        *rest++ = parity;
+    }
+    if (flags & PAYLOAD_ENCRYPTED) {
+        std::copy(salt, salt + SALT_SIZE, rest);
+        std::copy(nonce, nonce + NONCE_PREFIX_SIZE, rest + SALT_SIZE);
+    }
+    if (flags & PAYLOAD_SHARD) {
+        rest[0] = static_cast<uint8_t>(shard.index >> 8);
+        rest[1] = static_cast<uint8_t>(shard.index);
+        rest[2] = static_cast<uint8_t>(shard.count >> 8);
+        rest[3] = static_cast<uint8_t>(shard.count);
+        put_be32(rest + 4, shard.set);
+    }
+}
+
+/*
+The payload's CRC carries on over the header with the checksum
+field left out, so a damaged length, flags or salt is caught too.
+*/
+uint32_t PayloadHeader::expected_checksum(uint32_t payload_crc) const {
+    if (version < 2) {
+        return checksum;
+    }
+    uint8_t data[MAX_SIZE];
+    serialize(data);
+    const uint32_t crc = crc32c(payload_crc, data, CHECKSUM_OFFSET);
+    return crc32c(crc, data + SIZE, size() - SIZE);
+}
+
+bool PayloadHeader::has_magic(const uint8_t* data, size_t size) {
+    return size >= MAGIC_SIZE && data[0] == MAGIC[0] && data[1] == MAGIC[1];
+}
+
+bool PayloadHeader::parse(const uint8_t* data, size_t size,
+    PayloadHeader* header) {
+    if (size < V1_SIZE || !has_magic(data, size)) {
+        return false;
+    }
+    if (data[2] > VERSION) {
+        throw std::runtime_error("Message needs a newer EasyLSB!\n");
+    }
+    if (data[2] == 0 || data[3] & ~PAYLOAD_FLAGS) {
+        return false;
+    }
+    header->version = data[2];
+    header->flags = data[3];
+    header->length = get_be32(data + 4);
+    if (size < header->size()) {
+        return false;
+    }
+    const uint8_t* rest = data + V1_SIZE;
+    if (header->version >= 2) {
+        header->checksum = get_be32(rest);
+        rest += SIZE - V1_SIZE;
+    }
+    if (header->flags & PAYLOAD_ECC) {
+        header->parity = *rest++;
+        if (header->parity == 0 ||
+            header->parity > ReedSolomon::MAX_PARITY) {
+            return false;
+        }
+    }
+    if (header->flags & PAYLOAD_ENCRYPTED) {
+        std::copy(rest, rest + SALT_SIZE, header->salt);
+        std::copy(rest + SALT_SIZE, rest + SALT_SIZE + NONCE_PREFIX_SIZE,
+            header->nonce);
+    }
+    if (header->flags & PAYLOAD_SHARD) {
+        header->shard.index = static_cast<uint16_t>(rest[0] << 8 | rest[1]);
+        header->shard.count = static_cast<uint16_t>(rest[2] << 8 | rest[3]);
+        header->shard.set = get_be32(rest + 4);
+        if (header->flags != PAYLOAD_SHARD || header->version < 2 ||
+            header->shard.index >= header->shard.count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Throws if the payload, whose CRC-32C is payload_crc, isn't header's.
+static void check_payload(const PayloadHeader& header, uint32_t payload_crc) {
+    if (header.expected_checksum(payload_crc) != header.checksum) {
+        throw std::runtime_error("Message checksum does not match!\n");
+    }
+}
+
+// Compresses a block, unless that doesn't make it any smaller.
+static void compress_block(Block& block) {
+    std::vector<uint8_t> data(4);
+    put_be32(data.data(), static_cast<uint32_t>(block.data.size()));
+    const std::vector<uint8_t> packed =
+        lz_compress(block.data.data(), block.data.size());
+    data.insert(data.end(), packed.begin(), packed.end());
+    if (data.size() < block.data.size()) {
+        block.data.swap(data);
+        block.flags |= BLOCK_COMPRESSED;
+    }
+}
+
+static void decompress_block(Block& block) {
+    if (!(block.flags & BLOCK_COMPRESSED)) {
+        return;
+    }
+    const size_t size =
+        block.data.size() < 4 ? BLOCK_SIZE + 1 : get_be32(block.data.data());
+    if (size > BLOCK_SIZE) {
+        throw std::runtime_error("Message is damaged!\n");
+    }
+    std::vector<uint8_t> data(size);
+    lz_decompress(block.data.data() + 4, block.data.size() - 4, data.data(),
+        size);
+    block.data.swap(data);
+    block.flags &= ~BLOCK_COMPRESSED;
+}
+
+// Key for the payload following header, from the passphrase or key file.
+static void derive_key(const PayloadHeader& header,
+    const std::string& secret, uint8_t key[KEY_SIZE]) {
+    pbkdf2_sha256(secret, header.salt, PayloadHeader::SALT_SIZE,
+        KDF_ITERATIONS, key, KEY_SIZE);
+}
+
+// Nonce of block index: the header's nonce, then the index.
+static void block_nonce(const PayloadHeader& header, size_t index,
+    uint8_t nonce[NONCE_SIZE]) {
+    std::copy(header.nonce, header.nonce + PayloadHeader::NONCE_PREFIX_SIZE,
+        nonce);
+    put_be32(nonce + PayloadHeader::NONCE_PREFIX_SIZE,
+        static_cast<uint32_t>(index));
+}
+
+// Encrypts a block, flagging it if it is the last, and appends its tag.
+static void encrypt_block(const PayloadHeader& header,
+    const uint8_t key[KEY_SIZE], Block& block) {
+    if (block.last) {
+        block.flags |= BLOCK_FINAL;
+    }
+    uint8_t nonce[NONCE_SIZE];
+    block_nonce(header, block.index, nonce);
+    const size_t size = block.data.size();
+    block.data.resize(size + TAG_SIZE);
+    aead_seal(key, nonce, &block.flags, 1, block.data.data(), size,
+        block.data.data() + size);
+}
+
+/*
+Checks a block's tag and decrypts it. A block flagged as the last
+has to actually be the last, or blocks were dropped off the end.
+*/
+static void decrypt_block(const PayloadHeader& header,
+    const uint8_t key[KEY_SIZE], Block& block) {
+    uint8_t nonce[NONCE_SIZE];
+    block_nonce(header, block.index, nonce);
+    if (block.data.size() < TAG_SIZE) {
+        throw std::runtime_error("Message is damaged!\n");
+    }
+    const size_t size = block.data.size() - TAG_SIZE;
+    if (!aead_open(key, nonce, &block.flags, 1, block.data.data(), size,
+        block.data.data() + size)) {
+        throw std::runtime_error("Wrong passphrase or damaged message!\n");
+    }
+    if (static_cast<bool>(block.flags & BLOCK_FINAL) != block.last) {
+        throw std::runtime_error("Message is damaged!\n");
+    }
+    block.data.resize(size);
+    block.flags &= ~BLOCK_FINAL;
+}
+
+/*
+Codes the payload, which is written in order, a Reed-Solomon group
+at a time into the stream from offset first on.
+*/
+class EccWriter {
+ private:
+    const ReedSolomon& code;
+    const StreamWriter& write;
+    size_t offset;
+    std::vector<uint8_t> pending;
+    std::vector<uint8_t> group;
+
+ public:
+    EccWriter(const ReedSolomon& rs, const StreamWriter& writer,
+        size_t first)
+        : code(rs), write(writer), offset(first),
+        group(ReedSolomon::CODEWORD_SIZE * ReedSolomon::INTERLEAVE) {
+        pending.reserve(code.group_data());
+    }
+    void append(const uint8_t* data, size_t size) {
+        while (size > 0) {
+            const size_t take =
+                std::min(size, code.group_data() - pending.size());
+            pending.insert(pending.end(), data, data + take);
+            data += take;
+            size -= take;
+            if (pending.size() == code.group_data()) {
+                flush();
+            }
+        }
+    }
+    // Codes and writes whatever is pending, a short group at the end.
+    void flush() {
+        if (pending.empty()) {
+            return;
+        }
+        const size_t size = code.encoded_size(pending.size());
+        code.encode(pending.data(), pending.size(), group.data());
+        write(offset, group.data(), size);
+        offset += size;
+        pending.clear();
+    }
+};
+
+/*
+Reads the payload, starting at offset first of the stream and
+length bytes long before coding, back out of its Reed-Solomon
+groups. Reads come in order, so one corrected group is kept.
+*/
+class EccReader {
+ private:
+    const ReedSolomon& code;
+    const StreamReader& read_stream;
+    size_t first;
+    size_t length;
+    size_t cached;
+    std::vector<uint8_t> group;
+
+ public:
+    EccReader(const ReedSolomon& rs, const StreamReader& reader,
+        size_t first_byte, size_t payload_length)
+        : code(rs), read_stream(reader), first(first_byte),
+        length(payload_length), cached(SIZE_MAX),
+        group(ReedSolomon::CODEWORD_SIZE * ReedSolomon::INTERLEAVE) {}
+    // Same as a StreamReader, with offset counting as if not coded.
+    void read(size_t offset, uint8_t* data, size_t size) {
+        size_t position = offset - first;
+        while (size > 0) {
+            const size_t index = position / code.group_data();
+            const size_t start = index * code.group_data();
+            const size_t group_size =
+                std::min(code.group_data(), length - start);
+            if (index != cached) {
+                read_stream(first + index * group.size(), group.data(),
+                    code.encoded_size(group_size));
+                code.decode(group.data(), group_size);
+                cached = index;
+            }
+            const size_t take =
+                std::min(size, start + group_size - position);
+            std::copy(group.begin() + (position - start),
+                group.begin() + (position - start + take), data);
+            data += take;
+            size -= take;
+            position += take;
+        }
+    }
+};
+
+/*
+A shard is a piece of a stream that was already compressed, encrypted
+and coded, so it goes in as it is.
+*/
+static size_t write_shard(const std::string& shard, const ShardInfo& info,
+    const StreamWriter& write) {
+    PayloadHeader header;
+    header.flags = PAYLOAD_SHARD;
+    header.shard = info;
+    header.length = static_cast<uint32_t>(shard.size());
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(shard.data());
+    write(header.size(), data, shard.size());
+    header.checksum = header.expected_checksum(crc32c(0, data, shard.size()));
+    uint8_t serialized[PayloadHeader::MAX_SIZE];
+    header.serialize(serialized);
+    write(0, serialized, header.size());
+    return header.stream_size();
+}
+
+/*
+A message that fits in one block isn't worth starting threads for.
+Whether to compress has to be settled before any of the payload is
+written, since it may be going straight into the image, so the
+blocks are all compressed first and kept. They are used only if,
+framed, they come to less than the message would as it is: without
+framing, like a message that wasn't compressed at all, or for an
+encrypted message, which always keeps its framing and at least one
+block for the tag, in blocks of its own. Error correction codes
+whatever comes out, framed or not.
+*/
+size_t write_payload(const std::string& message,
+    const PayloadOptions& options, const StreamWriter& write) {
+    if (options.shard.count > 0) {
+        return write_shard(message, options.shard, write);
+    }
+    PayloadHeader header;
+    std::unique_ptr<ReedSolomon> code;
+    if (options.parity > 0) {
+        code = std::make_unique<ReedSolomon>(options.parity);
+        header.flags |= PAYLOAD_ECC;
+        header.parity = static_cast<uint8_t>(options.parity);
+    }
+    if (options.archive) {
+        header.flags |= PAYLOAD_ARCHIVE;
+    }
+    std::vector<BlockStage> stages;
+    uint8_t key[KEY_SIZE];
+    if (!options.secret.empty()) {
+        header.flags |= PAYLOAD_ENCRYPTED;
+        random_bytes(header.salt, sizeof(header.salt));
+        random_bytes(header.nonce, sizeof(header.nonce));
+        derive_key(header, options.secret, key);
+        stages.push_back([&header, &key](Block& block) {
+            encrypt_block(header, key, block);
+        });
+    }
+    const bool threaded = message.size() > BLOCK_SIZE;
+    const uint8_t* text = reinterpret_cast<const uint8_t*>(message.data());
+    size_t next = 0;
+    size_t index = 0;
+    BlockSource source = [&](Block& block) {
+        if (next >= message.size() && (index > 0 || options.secret.empty())) {
+            return false;
+        }
+        const size_t size = std::min(BLOCK_SIZE, message.size() - next);
+        block.index = index++;
+        block.flags = 0;
+        block.data.assign(text + next, text + next + size);
+        next += size;
+        block.last = next >= message.size();
+        return true;
+    };
+    std::vector<Block> packed;
+    size_t taken = 0;
+    if (options.compress) {
+        run_pipeline(source, {compress_block}, [&packed](Block& block) {
+            packed.push_back(std::move(block));
+        }, threaded);
+        size_t packed_size = 0;
+        for (const Block& block : packed) {
+            packed_size += 4 + block.data.size();
+        }
+        const size_t plain_size = message.size() +
+            (options.secret.empty() ? 0 : 4 * packed.size());
+        if (packed_size < plain_size) {
+            header.flags |= PAYLOAD_COMPRESSED;
+            source = [&packed, &taken](Block& block) {
+                if (taken == packed.size()) {
+                    return false;
+                }
+                block = std::move(packed[taken++]);
+                return true;
+            };
+        } else {
+            packed.clear();
+            next = 0;
+            index = 0;
+        }
+    }
+    size_t offset = header.size();
+    uint32_t crc = 0;
+    std::unique_ptr<EccWriter> ecc;
+    if (code) {
+        ecc = std::make_unique<EccWriter>(*code, write, offset);
+    }
+    // Writes the next piece of payload, through the coder if there is one.
+    auto put = [&](const uint8_t* data, size_t size) {
+        if (ecc) {
+            ecc->append(data, size);
+        } else {
+            write(offset, data, size);
+        }
+        offset += size;
+        crc = crc32c(crc, data, size);
+    };
+    BlockSink sink = [&](Block& block) {
+        if (header.flags & PAYLOAD_FRAMED) {
+            uint8_t frame[4];
+            put_be32(frame, static_cast<uint32_t>(block.data.size()));
+            frame[0] = block.flags;
+            put(frame, sizeof(frame));
+        }
+        put(block.data.data(), block.data.size());
+    };
+    if (!(header.flags & PAYLOAD_FRAMED)) {
+        // Nothing to transform, so the message goes straight in.
+        put(text, message.size());
+    } else {
+        run_pipeline(source, stages, sink, threaded);
+    }
+    if (ecc) {
+        ecc->flush();
+    }
+    if (offset - header.size() > UINT32_MAX) {
+        throw std::runtime_error("Message is too long!\n");
+    }
+    header.length = static_cast<uint32_t>(offset - header.size());
+    header.checksum = header.expected_checksum(crc);
+    uint8_t data[PayloadHeader::MAX_SIZE];
+    header.serialize(data);
+    write(0, data, header.size());
+    return header.stream_size();
+}
+
+std::vector<uint8_t> build_payload(const std::string& message,
+    const PayloadOptions& options) {
+    std::vector<uint8_t> stream;
+    write_payload(message, options,
+        [&stream](size_t offset, const uint8_t* data, size_t size) {
+        if (stream.size() < offset + size) {
+            stream.resize(offset + size);
+        }
+        std::copy(data, data + size, stream.begin() + offset);
+    });
+    return stream;
+}
+
+/*
+Reads the payload following header out of the stream read by
+stream_read, corrected if it was coded. stream_read has to outlive
+the reader.
+*/
+static StreamReader payload_reader(const PayloadHeader& header,
+    const StreamReader& stream_read) {
+    if (!(header.flags & PAYLOAD_ECC)) {
+        return stream_read;
+    }
+    std::shared_ptr<ReedSolomon> code =
+        std::make_shared<ReedSolomon>(header.parity);
+    std::shared_ptr<EccReader> ecc = std::make_shared<EccReader>(*code,
+        stream_read, header.size(), header.length);
+    return [code, ecc](size_t offset, uint8_t* data, size_t size) {
+        ecc->read(offset, data, size);
+    };
+}
+
+/*
+The stages that undo the transforms header records, with the key
+derived into key. Decryption undoes the last transform, so it goes
+first. Throws std::runtime_error if a secret is needed and missing.
+*/
+static std::vector<BlockStage> undo_stages(const PayloadHeader& header,
+    const PayloadOptions& options, uint8_t key[KEY_SIZE]) {
+    std::vector<BlockStage> stages;
+    if (header.flags & PAYLOAD_ENCRYPTED) {
+        if (options.secret.empty()) {
+            throw std::runtime_error(
+                "Message is encrypted, a passphrase or key file is needed!\n");
+        }
+        if (header.length == 0) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        derive_key(header, options.secret, key);
+        stages.push_back([&header, key](Block& block) {
+            decrypt_block(header, key, block);
+        });
+    }
+    if (header.flags & PAYLOAD_COMPRESSED) {
+        stages.push_back(decompress_block);
+    }
+    return stages;
+}
+
+// Throws unless options say whether header should be a shard.
+static void check_shard(const PayloadHeader& header,
+    const PayloadOptions& options) {
+    if ((header.flags & PAYLOAD_SHARD) && options.shard.count == 0) {
+        throw std::runtime_error(
+            "Image holds one shard of a message, decode it with --shard!\n");
+    }
+    if (!(header.flags & PAYLOAD_SHARD) && options.shard.count > 0) {
+        throw std::runtime_error("Image doesn't hold a shard!\n");
+    }
+}
+
+std::string read_payload(const PayloadHeader& header,
+    const PayloadOptions& options, const StreamReader& stream_read) {
+    check_shard(header, options);
+    const StreamReader read = payload_reader(header, stream_read);
+    std::string message;
+    if (!(header.flags & PAYLOAD_FRAMED)) {
+        message.resize(header.length);
+        uint8_t* text = reinterpret_cast<uint8_t*>(&message[0]);
+        read(header.size(), text, message.size());
+        check_payload(header, crc32c(0, text, message.size()));
+        return message;
+    }
+    uint8_t key[KEY_SIZE];
+    const std::vector<BlockStage> stages = undo_stages(header, options, key);
+    const size_t end = header.size() + header.length;
+    size_t offset = header.size();
+    size_t index = 0;
+    uint32_t crc = 0;
+    // Blocks are read in order, so the source keeps the checksum.
+    BlockSource source = [&](Block& block) {
+        if (offset == end) {
+            check_payload(header, crc);
+            return false;
+        }
+        uint8_t frame[4];
+        if (end - offset < sizeof(frame)) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        read(offset, frame, sizeof(frame));
+        offset += sizeof(frame);
+        const size_t size = get_be32(frame) & 0xFFFFFF;
+        if (end - offset < size) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        block.index = index++;
+        block.flags = frame[0];
+        block.data.resize(size);
+        read(offset, block.data.data(), size);
+        offset += size;
+        crc = crc32c(crc32c(crc, frame, sizeof(frame)), block.data.data(),
+            size);
+        block.last = offset == end;
+        return true;
+    };
+    BlockSink sink = [&message](Block& block) {
+        message.append(block.data.begin(), block.data.end());
+    };
+    run_pipeline(source, stages, sink, header.length > BLOCK_SIZE);
+    return message;
+}
+
+PayloadReader::PayloadReader(const PayloadHeader& payload_header,
+    const PayloadOptions& options, const StreamReader& read)
+    : header(payload_header), read_stream(payload_reader(header, read)) {
+    check_shard(header, options);
+    if (header.flags & PAYLOAD_FRAMED) {
+        stages = undo_stages(header, options, key);
+        frames.push_back(header.size());
+    }
+}
+
+/*
+Blocks hold BLOCK_SIZE bytes of the message each, but the last, so
+the range starts in block offset / BLOCK_SIZE. Blocks before it are
+stepped over by their frames, reading nothing else of them, and the
+blocks after it aren't read at all. The last block is always opened,
+since only its size says where the message ends.
+*/
+std::string PayloadReader::read(size_t offset, size_t length) {
+    std::string message;
+    if (!(header.flags & PAYLOAD_FRAMED)) {
+        if (offset > header.length || length > header.length - offset) {
+            throw std::runtime_error("Range is outside the message!\n");
+        }
+        message.resize(length);
+        read_stream(header.size() + offset,
+            reinterpret_cast<uint8_t*>(&message[0]), length);
+        return message;
+    }
+    const size_t end = header.size() + header.length;
+    // Start from the last frame already found, if the range is past it.
+    size_t index = std::min(offset / BLOCK_SIZE, frames.size() - 1);
+    if (frames[index] == end && index > 0) {
+        --index;
+    }
+    for (;; ++index) {
+        size_t position = frames[index];
+        uint8_t frame[4];
+        if (end - position < sizeof(frame)) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        read_stream(position, frame, sizeof(frame));
+        position += sizeof(frame);
+        const size_t size = get_be32(frame) & 0xFFFFFF;
+        if (end - position < size) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        position += size;
+        if (frames.size() == index + 1) {
+            frames.push_back(position);
+        }
+        const size_t first = index * BLOCK_SIZE;
+        const bool last = position == end;
+        if (first + BLOCK_SIZE <= offset && !last) {
+            continue;
+        }
+        Block block;
+        block.index = index;
+        block.flags = frame[0];
+        block.last = last;
+        block.data.resize(size);
+        read_stream(position - size, block.data.data(), size);
+        for (const BlockStage& stage : stages) {
+            stage(block);
+        }
+        if (!last && block.data.size() != BLOCK_SIZE) {
+            throw std::runtime_error("Message is damaged!\n");
+        }
+        // The block holds message bytes [first, block_end).
+        const size_t block_end = first + block.data.size();
+        const size_t start = std::max(offset, first);
+        const size_t stop = std::min(offset + length, block_end);
+        if (start < stop) {
+            message.append(block.data.begin() + (start - first),
+                block.data.begin() + (stop - first));
+        }
+        if (offset + length <= block_end) {
+            return message;
+        }
+        if (last) {
+            throw std::runtime_error("Range is outside the message!\n");
+        }
+    }
+}
@@ -0,0 +1,253 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+payload.h
+
+The versioned header EasyLSB writes in front of the message, and
+the optional transforms it records.
+
+Images encoded by earlier versions start with a bare 16 bit length.
+Images encoded now start with this header instead, big endian:
+    "EL"                2 byte magic
+    version             1 byte, currently 2
+    flags               1 byte, PAYLOAD_* below
+    length              4 bytes, bytes of payload after the header
+    checksum            4 bytes, CRC-32C (crc32c.h) of the payload,
+                        continued over the rest of the header
+and, if the payload is error corrected,
+    parity              1 byte, parity bytes per Reed-Solomon codeword
+and, if the payload is encrypted,
+    salt                16 bytes, for deriving the key
+    nonce               8 bytes, first part of every block's nonce
+and, if the payload is a shard (shard.h), which no other flag goes with,
+    index               2 bytes, of the shard within its set
+    count               2 bytes, shards in the set
+    set                 4 bytes, random, the same for the whole set
+followed by the payload. With no flags set, that is the message as
+it is. Otherwise the message was cut into BLOCK_SIZE blocks and run
+through the pipeline (pipeline.h), and the payload is those blocks
+one after the other, each one:
+    flags               1 byte, BLOCK_* below
+    size                3 bytes, bytes of data that follow
+    data
+The data of a compressed block is the block's original size (4 bytes,
+big endian) followed by the block compressed with lz.h.
+
+Encrypted blocks are sealed one at a time with ChaCha20-Poly1305
+(crypto.h), after being compressed, and followed by their 16 byte
+tag. The key is PBKDF2-HMAC-SHA-256 of the passphrase or key file and
+the salt; a block's nonce is the header's nonce followed by the
+block's index (4 bytes, big endian), and its flags are authenticated
+along with it. The last block is flagged as such, so blocks can't be
+reordered, dropped or cut off the end without decoding failing.
+
+An error corrected payload is embedded in Reed-Solomon groups
+(reed_solomon.h) rather than as it is; length and checksum are still
+those of the payload before coding, so they check the corrected
+payload. The header itself is not coded: damage to it is caught by
+the checksum, but not repaired.
+
+Since the header holds the length of everything after it, it is
+embedded last, once the last block is in. Version 1 headers, which
+are the same without the checksum, still decode.
+
+The checksum lets decoding reject a damaged payload, and rules out
+any image that merely happens to start with the magic bytes, without
+decompressing or decrypting anything first. The header itself is
+checked before any of the payload is read: a version of 0 or flags
+this version doesn't know mean it isn't a header at all.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef PAYLOAD_H_
+#define PAYLOAD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+#include "pipeline.h"
+
+// Set if any of the payload's blocks is stored compressed.
+const uint8_t PAYLOAD_COMPRESSED = 1;
+// Set if the payload's blocks are encrypted.
+const uint8_t PAYLOAD_ENCRYPTED = 2;
+// Set if the payload is embedded with Reed-Solomon error correction.
+const uint8_t PAYLOAD_ECC = 4;
+// Set if the message is an archive of several files (archive.h).
+const uint8_t PAYLOAD_ARCHIVE = 8;
+// Set if the payload is one shard of a stream split over images.
+const uint8_t PAYLOAD_SHARD = 16;
+// Set if a block actually got smaller, and is stored compressed.
+const uint8_t BLOCK_COMPRESSED = 1;
+// Set on the last block of an encrypted payload.
+const uint8_t BLOCK_FINAL = 2;
+// Bytes of message per block.
+const size_t BLOCK_SIZE = 64 * 1024;
+
+// Which piece of a stream split over several images a shard is.
+struct ShardInfo {
+    uint16_t index = 0;
+    // 0 if the payload isn't a shard at all.
+    uint16_t count = 0;
+    uint32_t set = 0;
+};
+
+// Transforms applied to the message before it is embedded.
+struct PayloadOptions {
+    // Compress the message, unless that doesn't make it any smaller.
+    bool compress = false;
+    /*
+    Passphrase, or contents of a key file, to encrypt the message
+    with or decrypt it with. Empty for no encryption.
+    */
+    std::string secret;
+    /*
+    Parity bytes per 255 byte Reed-Solomon codeword, up to 128; up to
+    half as many damaged bytes per codeword can be corrected. 0 for
+    no error correction.
+    */
+    size_t parity = 0;
+    /*
+    Spread the stream over the image in an order keyed by secret
+    (see channel_order.h) instead of filling it from the top. Has to
+    be given again to decode.
+    */
+    bool scatter = false;
+    // Encoding only: the message is an archive built by build_archive().
+    bool archive = false;
+    /*
+    Encoding: if count isn't 0, the message is this shard of a stream
+    and is embedded as it is, whatever the options above say.
+    Decoding: if count isn't 0, shards are expected; otherwise an image
+    holding a shard is rejected, since it's only part of a message.
+    */
+    ShardInfo shard;
+    /*
+    Decoding only: also accept images from versions before the header,
+    which start with a bare length. Without it, an image that doesn't
+    start with the magic bytes is rejected as holding no message.
+    */
+    bool legacy = false;
+};
+
+struct PayloadHeader {
+    // Bytes of magic at the start of every header.
+    static constexpr size_t MAGIC_SIZE = 2;
+    /*
+    Size of the header without, and with, every optional field that
+    can go together.
+    */
+    static constexpr size_t SIZE = 12;
+    static constexpr size_t MAX_SIZE = 37;
+    // Size of a version 1 header, which has no checksum.
+    static constexpr size_t V1_SIZE = 8;
+    static constexpr size_t SALT_SIZE = 16;
+    static constexpr size_t NONCE_PREFIX_SIZE = 8;
+    static constexpr size_t SHARD_SIZE = 8;
+    static constexpr uint8_t VERSION = 2;
+    uint8_t version = VERSION;
+    uint8_t flags = 0;
+    uint32_t length = 0;
+    uint32_t checksum = 0;
+    uint8_t parity = 0;
+    uint8_t salt[SALT_SIZE] = {0};
+    uint8_t nonce[NONCE_PREFIX_SIZE] = {0};
+    ShardInfo shard;
+
+    // Bytes the header takes up, given its version and flags.
+    size_t size() const;
+    // Bytes of the whole stream, the header and the embedded payload.
+    size_t stream_size() const;
+    /*
+    What checksum should be, given the CRC-32C of the payload.
+    Always matches for version 1 headers.
+    */
+    uint32_t expected_checksum(uint32_t payload_crc) const;
+    // Writes the header as embedded, size() bytes, to data.
+    void serialize(uint8_t* data) const;
+    /*
+    Reads a header from the first size bytes of a stream. Returns false
+    if there is no header there, as in images from earlier versions or
+    images without a message. Throws std::runtime_error for a header
+    from a newer version.
+    */
+    static bool parse(const uint8_t* data, size_t size,
+        PayloadHeader* header);
+    /*
+    True if the first size bytes of a stream, at least MAGIC_SIZE,
+    start with the magic bytes, so there may be a header there.
+    */
+    static bool has_magic(const uint8_t* data, size_t size);
+};
+
+// Writes size bytes of data at byte offset of the embedded stream.
+using StreamWriter =
+    std::function<void(size_t offset, const uint8_t* data, size_t size)>;
+// Reads size bytes at byte offset of the embedded stream into data.
+using StreamReader =
+    std::function<void(size_t offset, uint8_t* data, size_t size)>;
+
+/*
+Builds the payload from message, writing each piece as soon as it's
+ready and the header last. Returns the size of the whole stream.
+Throws std::runtime_error if options.parity is out of range.
+*/
+size_t write_payload(const std::string& message,
+    const PayloadOptions& options, const StreamWriter& write);
+
+// The header followed by the payload built from message, in memory.
+std::vector<uint8_t> build_payload(const std::string& message,
+    const PayloadOptions& options);
+
+/*
+The message back from the payload following header, read a block
+at a time, corrected and decrypted with options.secret as the header
+says. Throws std::runtime_error if the payload is damaged beyond
+repair, fails its checksum or the secret is wrong.
+*/
+std::string read_payload(const PayloadHeader& header,
+    const PayloadOptions& options, const StreamReader& read);
+
+/*
+Reads bytes of the message by where they are in it, straight from
+the payload following header, so a slice of a large message doesn't
+need the rest of it. Only the blocks, or Reed-Solomon groups, holding
+a slice are read, corrected and decrypted, and where blocks start is
+remembered for the next slice. Encrypted blocks are still
+authenticated, but the checksum covers the whole payload, so it
+isn't checked.
+*/
+class PayloadReader {
+ private:
+    PayloadHeader header;
+    // Reads the stream, corrected if it was coded.
+    StreamReader read_stream;
+    std::vector<BlockStage> stages;
+    uint8_t key[KEY_SIZE];
+    // Stream offsets of the frames of the blocks found so far.
+    std::vector<size_t> frames;
+
+ public:
+    /*
+    Derives the key, if the payload is encrypted, once for all the
+    reads. read has to outlive the reader. Throws std::runtime_error
+    if the payload is encrypted and options.secret is empty.
+    */
+    PayloadReader(const PayloadHeader& header, const PayloadOptions& options,
+        const StreamReader& read);
+    PayloadReader(const PayloadReader&) = delete;
+    PayloadReader& operator=(const PayloadReader&) = delete;
+    /*
+    Bytes [offset, offset + length) of the message. Throws
+    std::runtime_error if they go past the end of the message, or
+    for the same reasons as read_payload().
+    */
+    std::string read(size_t offset, size_t length);
+};
+
+#endif  // PAYLOAD_H_
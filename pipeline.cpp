@@ -0,0 +1,94 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+pipeline.cpp
+
+Block pipeline over threads and bounded queues. See pipeline.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "pipeline.h"
+
+#include <exception>
+#include <memory>
+#include <thread>
+
+void run_pipeline(const BlockSource& source,
+    const std::vector<BlockStage>& stages, const BlockSink& sink,
+    bool threaded, size_t depth) {
+    if (!threaded) {
+        Block block;
+        while (source(block)) {
+            for (const BlockStage& stage : stages) {
+                stage(block);
+            }
+            sink(block);
+        }
+        return;
+    }
+    // queues[i] feeds stage i, and the last one feeds the sink.
+    std::vector<std::unique_ptr<BoundedQueue<Block>>> queues;
+    for (size_t i = 0; i <= stages.size(); ++i) {
+        queues.push_back(std::make_unique<BoundedQueue<Block>>(depth));
+    }
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    // Records the first error and stops every thread.
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = e;
+            }
+        }
+        for (auto& queue : queues) {
+            queue->abort();
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.emplace_back([&] {
+        try {
+            Block block;
+            while (source(block)) {
+                if (!queues[0]->push(std::move(block))) {
+                    return;
+                }
+                block = Block();
+            }
+            queues[0]->close();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+    for (size_t i = 0; i < stages.size(); ++i) {
+        threads.emplace_back([&, i] {
+            try {
+                Block block;
+                while (queues[i]->pop(block)) {
+                    stages[i](block);
+                    if (!queues[i + 1]->push(std::move(block))) {
+                        return;
+                    }
+                }
+                queues[i + 1]->close();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+    try {
+        Block block;
+        while (queues.back()->pop(block)) {
+            sink(block);
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,139 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+pipeline.h
+
+Runs payload blocks through a chain of transforms (compression, and
+whatever else the header records) with every stage working at once.
+
+The message is cut into fixed size blocks. The source hands them out
+one at a time, each stage transforms a block and passes it on, and
+the sink embeds it into the image (or, decoding, appends it to the
+message) as soon as it comes out of the last stage. Stages run on
+their own threads connected by short queues, so at any time only a
+few blocks are in flight instead of a whole copy of the payload per
+transform.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// A block of payload on its way through the pipeline.
+struct Block {
+    // Position of the block within the payload, counting from 0.
+    size_t index = 0;
+    // BLOCK_* flags from payload.h, saying how data was transformed.
+    uint8_t flags = 0;
+    // True for the last block of the payload.
+    bool last = false;
+    std::vector<uint8_t> data;
+};
+
+// Fills in the next block and returns true, or returns false at the end.
+using BlockSource = std::function<bool(Block& block)>;
+// Transforms a block in place.
+using BlockStage = std::function<void(Block& block)>;
+// Takes a block that went through every stage.
+using BlockSink = std::function<void(Block& block)>;
+
+/*
+A first in, first out queue holding at most capacity items, for
+handing work from one thread to the next. push() waits while the
+queue is full and pop() while it is empty.
+*/
+template <class T>
+class BoundedQueue {
+ private:
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+    bool aborted;
+
+ public:
+    explicit BoundedQueue(size_t max_items)
+        : capacity(max_items), closed(false), aborted(false) {}
+    // Returns false, dropping item, if the queue was aborted.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] {
+            return aborted || items.size() < capacity;
+        });
+        if (aborted) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+    /*
+    Returns false once the queue is closed and empty, or as soon as
+    it is aborted.
+    */
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] {
+            return aborted || closed || !items.empty();
+        });
+        if (aborted || items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    // pop() without waiting: returns false if the queue is empty.
+    bool try_pop(T& item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (aborted || items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    // No more items will be pushed.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+    // Wakes every waiting thread and makes push() and pop() fail.
+    void abort() {
+        std::lock_guard<std::mutex> lock(mutex);
+        aborted = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+/*
+Pulls blocks from source until it returns false, passes each one
+through stages in order and hands them to sink in the same order.
+
+With threaded set, the source and every stage get a thread of their
+own, each connected to the next by a queue of at most depth blocks;
+sink runs on the calling thread. Otherwise everything runs on the
+calling thread one block at a time, which is quicker for a message
+that is a single block anyway. An exception thrown by any of them
+stops the pipeline and is rethrown here.
+*/
+void run_pipeline(const BlockSource& source,
+    const std::vector<BlockStage>& stages, const BlockSink& sink,
+    bool threaded, size_t depth = 4);
+
+#endif  // PIPELINE_H_
@@ -0,0 +1,395 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+png.cpp
+
+Streaming PNG reader and writer. See png.h for what is supported.
+Chunk layout, filters and the zlib stream follow the PNG
+specification (ISO/IEC 15948).
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifdef EASYLSB_HAVE_ZLIB
+
+#include "png.h"
+
+#include <zlib.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+// Every PNG file starts with these 8 bytes.
+static const char PNG_SIGNATURE[8] = {'\x89', 'P', 'N', 'G',
+    '\r', '\n', '\x1a', '\n'};
+// IDAT chunks are written (and read) this many bytes at a time.
+static const size_t IDAT_BYTES = 1 << 16;
+
+static uint32_t load_be32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+static uint32_t chunk_crc(uint32_t crc, const void* data, size_t size) {
+    // crc32() with a null buffer means "give me the initial value".
+    if (size == 0) {
+        return crc;
+    }
+    return static_cast<uint32_t>(crc32(crc,
+        static_cast<const Bytef*>(data), static_cast<uInt>(size)));
+}
+
+// The Paeth predictor: whichever of a, b, c is closest to a + b - c.
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+/*
+What filter type predicts for byte i of row, given the previous row.
+Both rows start with their filter byte, so the samples are at 1..n
+and the byte one pixel to the left of i is i - offset.
+*/
+static uint8_t predict(uint8_t type, const uint8_t* row,
+    const uint8_t* prior, size_t i, size_t offset) {
+    const uint8_t a = i > offset ? row[i - offset] : 0;
+    const uint8_t b = prior[i];
+    const uint8_t c = i > offset ? prior[i - offset] : 0;
+    switch (type) {
+    case 0:
+        return 0;
+    case 1:
+        return a;
+    case 2:
+        return b;
+    case 3:
+        return static_cast<uint8_t>((a + b) / 2);
+    case 4:
+        return paeth(a, b, c);
+    }
+    throw std::runtime_error("PNG image data is corrupt!\n");
+}
+
+void InflateDeleter::operator()(z_stream_s* strm) const {
+    inflateEnd(strm);
+    delete strm;
+}
+
+void DeflateDeleter::operator()(z_stream_s* strm) const {
+    deflateEnd(strm);
+    delete strm;
+}
+
+/*
+Reads every chunk up to the first IDAT into head, checking CRCs and
+picking up the image size and format from IHDR on the way, then
+leaves the file positioned at the start of the image data.
+*/
+PngReader::PngReader(const char* filename)
+    : in(filename, std::ios::binary), width(0), height(0), bit_depth(0),
+    colors(0), idat_left(0), idat_crc(0), in_buffer(IDAT_BYTES),
+    rows_read(0) {
+    if (!in) {
+        throw std::runtime_error("Cannot open input image!\n");
+    }
+    char signature[8];
+    in.read(signature, 8);
+    if (!in || std::memcmp(signature, PNG_SIGNATURE, 8) != 0) {
+        throw std::runtime_error("Unsupported image format!\n");
+    }
+    head.assign(signature, 8);
+    for (;;) {
+        char type[4];
+        const uint32_t length = next_chunk(type);
+        if (std::memcmp(type, "IDAT", 4) == 0) {
+            idat_left = length;
+            idat_crc = chunk_crc(crc32(0, Z_NULL, 0), type, 4);
+            break;
+        } else if (std::memcmp(type, "IEND", 4) == 0) {
+            throw std::runtime_error("PNG image data is truncated!\n");
+        }
+        std::vector<uint8_t> data(length + 4);
+        in.read(reinterpret_cast<char*>(data.data()), data.size());
+        if (!in || chunk_crc(chunk_crc(crc32(0, Z_NULL, 0), type, 4),
+            data.data(), length) != load_be32(&data[length])) {
+            throw std::runtime_error("PNG image data is corrupt!\n");
+        }
+        if (std::memcmp(type, "IHDR", 4) == 0 && length == 13) {
+            width = load_be32(&data[0]);
+            height = load_be32(&data[4]);
+            bit_depth = data[8];
+            // Color type 0 is grayscale, 2 is truecolor.
+            colors = data[9] == 2 ? 3 : data[9] == 0 ? 1 : 0;
+            // Compression, filter method and no interlacing.
+            if (data[10] != 0 || data[11] != 0 || data[12] != 0) {
+                colors = 0;
+            }
+        }
+        uint8_t size_and_type[8];
+        store_be32(size_and_type, length);
+        std::memcpy(size_and_type + 4, type, 4);
+        head.append(reinterpret_cast<char*>(size_and_type), 8);
+        head.append(reinterpret_cast<char*>(data.data()), data.size());
+    }
+    if (width == 0 || height == 0 || colors == 0 ||
+        (bit_depth != 8 && bit_depth != 16)) {
+        throw std::runtime_error("Unsupported PNG image!\n");
+    }
+    strm.reset(new z_stream_s());
+    if (inflateInit(strm.get()) != Z_OK) {
+        throw std::runtime_error("Cannot initialize zlib!\n");
+    }
+    prior.assign(row_bytes() + 1, 0);
+    current.resize(row_bytes() + 1);
+}
+
+uint32_t PngReader::next_chunk(char type[4]) {
+    uint8_t length[4];
+    in.read(reinterpret_cast<char*>(length), 4);
+    in.read(type, 4);
+    if (!in) {
+        throw std::runtime_error("PNG image data is truncated!\n");
+    }
+    const uint32_t size = load_be32(length);
+    // Chunk lengths are limited to 2^31 - 1 by the specification.
+    if (size > 0x7FFFFFFF) {
+        throw std::runtime_error("PNG image data is corrupt!\n");
+    }
+    return size;
+}
+
+/*
+Hands zlib the next piece of image data, moving on to the next
+IDAT chunk (and checking the CRC of the finished one) as needed.
+*/
+void PngReader::fill_input() {
+    while (idat_left == 0) {
+        uint8_t crc[4];
+        in.read(reinterpret_cast<char*>(crc), 4);
+        if (!in || load_be32(crc) != idat_crc) {
+            throw std::runtime_error("PNG image data is corrupt!\n");
+        }
+        char type[4];
+        idat_left = next_chunk(type);
+        if (std::memcmp(type, "IDAT", 4) != 0) {
+            throw std::runtime_error("PNG image data is truncated!\n");
+        }
+        idat_crc = chunk_crc(crc32(0, Z_NULL, 0), type, 4);
+    }
+    const size_t size = idat_left < in_buffer.size() ?
+        idat_left : in_buffer.size();
+    in.read(reinterpret_cast<char*>(in_buffer.data()), size);
+    if (!in) {
+        throw std::runtime_error("PNG image data is truncated!\n");
+    }
+    idat_crc = chunk_crc(idat_crc, in_buffer.data(), size);
+    idat_left -= static_cast<uint32_t>(size);
+    strm->next_in = in_buffer.data();
+    strm->avail_in = static_cast<uInt>(size);
+}
+
+const std::string& PngReader::header() const {
+    return head;
+}
+
+uint8_t PngReader::filter_type(size_t row) const {
+    return filters[row];
+}
+
+size_t PngReader::filter_offset() const {
+    return colors * bytes_per_sample();
+}
+
+/*
+Skips whatever is left of the image data (zlib's checksum and any
+padding), then collects the chunks that follow it.
+*/
+std::string PngReader::trailer() {
+    std::string chunks;
+    in.ignore(idat_left);
+    idat_left = 0;
+    in.ignore(4);
+    for (;;) {
+        char type[4];
+        const uint32_t length = next_chunk(type);
+        if (std::memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        std::string data(length + 4, '\0');
+        in.read(&data[0], data.size());
+        if (!in) {
+            throw std::runtime_error("PNG image data is truncated!\n");
+        }
+        if (std::memcmp(type, "IDAT", 4) == 0) {
+            continue;
+        }
+        uint8_t size_and_type[8];
+        store_be32(size_and_type, length);
+        std::memcpy(size_and_type + 4, type, 4);
+        chunks.append(reinterpret_cast<char*>(size_and_type), 8);
+        chunks += data;
+    }
+    return chunks;
+}
+
+size_t PngReader::rows() const {
+    return height;
+}
+
+size_t PngReader::row_channels() const {
+    return width * colors;
+}
+
+size_t PngReader::bytes_per_sample() const {
+    return bit_depth / 8;
+}
+
+size_t PngReader::channel_bits() const {
+    return bit_depth;
+}
+
+/*
+Inflates one filtered row (filter byte plus samples) at a time
+and undoes the filter against the previous row.
+*/
+size_t PngReader::read_rows(uint8_t* buffer, size_t count) {
+    if (count > height - rows_read) {
+        count = height - rows_read;
+    }
+    const size_t size = row_bytes() + 1;
+    for (size_t row = 0; row < count; ++row) {
+        strm->next_out = current.data();
+        strm->avail_out = static_cast<uInt>(size);
+        while (strm->avail_out > 0) {
+            if (strm->avail_in == 0) {
+                fill_input();
+            }
+            const int ret = inflate(strm.get(), Z_NO_FLUSH);
+            if (ret == Z_STREAM_END && strm->avail_out > 0) {
+                throw std::runtime_error("PNG image data is truncated!\n");
+            } else if (ret != Z_OK && ret != Z_STREAM_END) {
+                throw std::runtime_error("PNG image data is corrupt!\n");
+            }
+        }
+        const uint8_t type = current[0];
+        for (size_t i = 1; i < size; ++i) {
+            current[i] = static_cast<uint8_t>(current[i] +
+                predict(type, current.data(), prior.data(), i,
+                filter_offset()));
+        }
+        filters.push_back(type);
+        std::memcpy(buffer + row * row_bytes(), current.data() + 1,
+            row_bytes());
+        prior.swap(current);
+    }
+    rows_read += count;
+    return count;
+}
+
+std::unique_ptr<RowWriter> PngReader::create_writer(const char* filename,
+    const OutputOptions& options) {
+    return std::make_unique<PngWriter>(filename, *this, options);
+}
+
+PngWriter::PngWriter(const char* filename, PngReader& source,
+    const OutputOptions& options)
+    : out(filename, options), reader(source),
+    out_buffer(IDAT_BYTES), pending(0), prior(source.row_bytes() + 1, 0),
+    current(source.row_bytes() + 1), filtered(source.row_bytes() + 1),
+    rows_written(0) {
+    if (options.compression_level < -1 || options.compression_level > 9) {
+        throw std::runtime_error("Compression level must be 0 to 9!\n");
+    }
+    out.write(reader.header().data(), reader.header().size());
+    strm.reset(new z_stream_s());
+    if (deflateInit(strm.get(), options.compression_level) != Z_OK) {
+        throw std::runtime_error("Cannot initialize zlib!\n");
+    }
+}
+
+/*
+Each row is filtered with the same filter type the source image
+used for it. The encoder that made the source already picked those
+to suit the image, and flipping a few low bits hardly changes which
+filter compresses best.
+*/
+void PngWriter::write_rows(const uint8_t* buffer, size_t count) {
+    const size_t size = current.size();
+    const size_t offset = reader.filter_offset();
+    for (size_t row = 0; row < count; ++row) {
+        const uint8_t type = reader.filter_type(rows_written);
+        std::memcpy(current.data() + 1, buffer + row * (size - 1), size - 1);
+        filtered[0] = type;
+        for (size_t i = 1; i < size; ++i) {
+            filtered[i] = static_cast<uint8_t>(current[i] -
+                predict(type, current.data(), prior.data(), i, offset));
+        }
+        strm->next_in = filtered.data();
+        strm->avail_in = static_cast<uInt>(size);
+        deflate_out(Z_NO_FLUSH);
+        prior.swap(current);
+        ++rows_written;
+    }
+}
+
+/*
+Deflates whatever zlib has been given, sending out_buffer out as an
+IDAT chunk whenever it fills up, and at the very end.
+*/
+void PngWriter::deflate_out(int flush) {
+    int ret;
+    do {
+        strm->next_out = out_buffer.data() + pending;
+        strm->avail_out = static_cast<uInt>(out_buffer.size() - pending);
+        ret = deflate(strm.get(), flush);
+        if (ret == Z_STREAM_ERROR) {
+            throw std::runtime_error("Cannot compress PNG image data!\n");
+        }
+        pending = out_buffer.size() - strm->avail_out;
+        if (pending == out_buffer.size() ||
+            (flush == Z_FINISH && pending > 0)) {
+            write_chunk("IDAT", out_buffer.data(), pending);
+            pending = 0;
+        }
+    } while (strm->avail_out == 0 ||
+        (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+void PngWriter::write_chunk(const char type[4], const uint8_t* data,
+    size_t size) {
+    uint8_t length[4];
+    store_be32(length, static_cast<uint32_t>(size));
+    uint8_t crc[4];
+    store_be32(crc, chunk_crc(chunk_crc(crc32(0, Z_NULL, 0), type, 4),
+        data, size));
+    // One system call for the whole chunk.
+    const iovec pieces[4] = {{length, 4},
+        {const_cast<char*>(type), 4},
+        {const_cast<uint8_t*>(data), size},
+        {crc, 4}};
+    out.write(pieces, 4);
+}
+
+// Ends the image data, copies the source's trailing chunks, and IEND.
+void PngWriter::close() {
+    deflate_out(Z_FINISH);
+    const std::string trailer = reader.trailer();
+    out.write(trailer.data(), trailer.size());
+    write_chunk("IEND", nullptr, 0);
+    out.close();
+}
+
+#endif  // EASYLSB_HAVE_ZLIB
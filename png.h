@@ -0,0 +1,121 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+png.h
+
+Streaming reader and writer for lossless PNG carriers, using zlib.
+
+Rows are inflated and unfiltered one at a time, embedded into,
+then refiltered and deflated straight into the output, so memory use
+stays at a couple of rows plus zlib's window regardless of the image
+size. Unfiltered PNG scanlines are top-down with RGB (or gray)
+samples and 16 bit samples most significant byte first, so they map
+onto EasyLSB's traversal order exactly like bitmap rows do.
+
+Supported: non-interlaced grayscale (color type 0) and truecolor
+(color type 2) images with 8 or 16 bit samples. Every chunk other
+than the image data is copied to the output unchanged.
+
+PNG support needs zlib; build without EASYLSB_HAVE_ZLIB and PNG
+images are rejected with an exception instead.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef PNG_H_
+#define PNG_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "row_stream.h"
+
+// zlib's stream state, kept out of this header.
+struct z_stream_s;
+struct InflateDeleter {
+    void operator()(z_stream_s* strm) const;
+};
+struct DeflateDeleter {
+    void operator()(z_stream_s* strm) const;
+};
+
+class PngReader : public RowReader {
+ private:
+    std::ifstream in;
+    size_t width;
+    size_t height;
+    size_t bit_depth;
+    // 1 for grayscale, 3 for truecolor.
+    size_t colors;
+    // Signature and every chunk before the first IDAT, verbatim.
+    std::string head;
+    // Bytes left in the IDAT chunk being inflated.
+    uint32_t idat_left;
+    // Running CRC of that chunk, checked once it's used up.
+    uint32_t idat_crc;
+    std::unique_ptr<z_stream_s, InflateDeleter> strm;
+    std::vector<uint8_t> in_buffer;
+    // Previous and current unfiltered row, filter byte included.
+    std::vector<uint8_t> prior;
+    std::vector<uint8_t> current;
+    size_t rows_read;
+    // Filter type of every row read so far, reused by the writer.
+    std::vector<uint8_t> filters;
+
+    // Reads the next chunk's length and type, and checks the type.
+    uint32_t next_chunk(char type[4]);
+    // Refills in_buffer from the IDAT chunks.
+    void fill_input();
+
+ public:
+    explicit PngReader(const char* filename);
+    const std::string& header() const;
+    // Filter type the source image used for row.
+    uint8_t filter_type(size_t row) const;
+    // Bytes per complete pixel, what filters use as their offset.
+    size_t filter_offset() const;
+    /*
+    Chunks after the image data, verbatim, up to but not including
+    IEND. Only valid once every row has been read.
+    */
+    std::string trailer();
+    size_t rows() const override;
+    size_t row_channels() const override;
+    size_t bytes_per_sample() const override;
+    size_t channel_bits() const override;
+    size_t read_rows(uint8_t* buffer, size_t count) override;
+    std::unique_ptr<RowWriter> create_writer(const char* filename,
+        const OutputOptions& options) override;
+};
+
+class PngWriter : public RowWriter {
+ private:
+    OutputFile out;
+    PngReader& reader;
+    std::unique_ptr<z_stream_s, DeflateDeleter> strm;
+    // Compressed data waiting to go out as an IDAT chunk.
+    std::vector<uint8_t> out_buffer;
+    // Bytes of out_buffer filled so far.
+    size_t pending;
+    // Previous and current row, filter byte included, and the filtered row.
+    std::vector<uint8_t> prior;
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> filtered;
+    size_t rows_written;
+
+    // Runs deflate over whatever is queued up with the given flush mode.
+    void deflate_out(int flush);
+    void write_chunk(const char type[4], const uint8_t* data, size_t size);
+
+ public:
+    // Creates filename and writes the chunks before the image data.
+    PngWriter(const char* filename, PngReader& source,
+        const OutputOptions& options);
+    void write_rows(const uint8_t* buffer, size_t count) override;
+    void close() override;
+};
+
+#endif  // PNG_H_
@@ -0,0 +1,407 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+reed_solomon.cpp
+
+Reed-Solomon coding with vectorized row kernels. See reed_solomon.h.
+
+The field is GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1, with 2 as its
+generator alpha. The generator polynomial of the code has the roots
+alpha^0 through alpha^(parity - 1), and the first byte of a codeword
+is its highest degree coefficient.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "reed_solomon.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+static const unsigned FIELD_POLYNOMIAL = 0x11D;
+// Bytes per multiplication table: 16 low nibble and 16 high nibble products.
+static const size_t TABLE_SIZE = 32;
+static const size_t ROW = ReedSolomon::INTERLEAVE;
+
+// Antilog table, doubled so products of logs need no modulo, and log table.
+struct GfTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GfTables() {
+        unsigned x = 1;
+        for (unsigned i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= FIELD_POLYNOMIAL;
+            }
+        }
+        for (unsigned i = 255; i < 512; ++i) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+    }
+};
+
+static const GfTables& gf() {
+    static const GfTables tables;
+    return tables;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf().exp[gf().log[a] + gf().log[b]];
+}
+
+static uint8_t gf_div(uint8_t a, uint8_t b) {
+    if (a == 0) {
+        return 0;
+    }
+    return gf().exp[gf().log[a] + 255 - gf().log[b]];
+}
+
+// alpha^power, for any power from -255 up.
+static uint8_t gf_pow_alpha(int power) {
+    return gf().exp[(power % 255 + 255) % 255];
+}
+
+// Appends the nibble tables for multiplying by constant to tables.
+static void add_table(uint8_t constant, std::vector<uint8_t>& tables) {
+    for (unsigned x = 0; x < 16; ++x) {
+        tables.push_back(gf_mul(constant, static_cast<uint8_t>(x)));
+    }
+    for (unsigned x = 0; x < 16; ++x) {
+        tables.push_back(gf_mul(constant, static_cast<uint8_t>(x << 4)));
+    }
+}
+
+/*
+Row kernels. encode_rows() runs count data rows through the parity
+rows in reg, the remainder of dividing by the generator, one shift
+register per column. syndrome_rows() evaluates count rows at every
+root by Horner's rule, accumulating in syndromes.
+*/
+using EncodeRows = void (*)(const uint8_t* generator, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* reg);
+using SyndromeRows = void (*)(const uint8_t* roots, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* syndromes);
+
+static inline uint8_t mul_table(const uint8_t* table, uint8_t x) {
+    return table[x & 0x0F] ^ table[16 + (x >> 4)];
+}
+
+static void encode_rows_scalar(const uint8_t* generator, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* reg) {
+    uint8_t feedback[ROW];
+    for (size_t j = 0; j < count; ++j) {
+        for (size_t b = 0; b < ROW; ++b) {
+            feedback[b] = rows[j * ROW + b] ^ reg[b];
+        }
+        for (size_t i = 0; i < parity; ++i) {
+            const uint8_t* table = generator + i * TABLE_SIZE;
+            uint8_t* r = reg + i * ROW;
+            for (size_t b = 0; b < ROW; ++b) {
+                const uint8_t next = i + 1 < parity ? r[ROW + b] : 0;
+                r[b] = next ^ mul_table(table, feedback[b]);
+            }
+        }
+    }
+}
+
+static void syndrome_rows_scalar(const uint8_t* roots, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* syndromes) {
+    for (size_t j = 0; j < count; ++j) {
+        for (size_t i = 0; i < parity; ++i) {
+            const uint8_t* table = roots + i * TABLE_SIZE;
+            uint8_t* s = syndromes + i * ROW;
+            for (size_t b = 0; b < ROW; ++b) {
+                s[b] = mul_table(table, s[b]) ^ rows[j * ROW + b];
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// Products of 16 bytes with a constant, by its two nibble tables.
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i mul_ssse3(const uint8_t* table, __m128i x) {
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i low = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(table)),
+        _mm_and_si128(x, mask));
+    const __m128i high = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16)),
+        _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+    return _mm_xor_si128(low, high);
+}
+
+__attribute__((target("ssse3")))
+static void encode_rows_ssse3(const uint8_t* generator, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* reg) {
+    for (size_t j = 0; j < count; ++j) {
+        for (size_t half = 0; half < ROW; half += 16) {
+            const __m128i feedback = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                    rows + j * ROW + half)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                    reg + half)));
+            for (size_t i = 0; i < parity; ++i) {
+                uint8_t* r = reg + i * ROW + half;
+                const __m128i next = i + 1 < parity ?
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                        r + ROW)) : _mm_setzero_si128();
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(r),
+                    _mm_xor_si128(next,
+                        mul_ssse3(generator + i * TABLE_SIZE, feedback)));
+            }
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void syndrome_rows_ssse3(const uint8_t* roots, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* syndromes) {
+    for (size_t j = 0; j < count; ++j) {
+        for (size_t half = 0; half < ROW; half += 16) {
+            const __m128i row = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(rows + j * ROW + half));
+            for (size_t i = 0; i < parity; ++i) {
+                __m128i* s =
+                    reinterpret_cast<__m128i*>(syndromes + i * ROW + half);
+                _mm_storeu_si128(s, _mm_xor_si128(row,
+                    mul_ssse3(roots + i * TABLE_SIZE, _mm_loadu_si128(s))));
+            }
+        }
+    }
+}
+
+// The same, for a whole 32 byte row at once.
+__attribute__((target("avx2"), always_inline))
+static inline __m256i mul_avx2(const uint8_t* table, __m256i x) {
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(table))),
+        _mm256_and_si256(x, mask));
+    const __m256i high = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16))),
+        _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+    return _mm256_xor_si256(low, high);
+}
+
+__attribute__((target("avx2")))
+static void encode_rows_avx2(const uint8_t* generator, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* reg) {
+    for (size_t j = 0; j < count; ++j) {
+        const __m256i feedback = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                rows + j * ROW)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(reg)));
+        for (size_t i = 0; i < parity; ++i) {
+            uint8_t* r = reg + i * ROW;
+            const __m256i next = i + 1 < parity ?
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                    r + ROW)) : _mm256_setzero_si256();
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(r),
+                _mm256_xor_si256(next,
+                    mul_avx2(generator + i * TABLE_SIZE, feedback)));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void syndrome_rows_avx2(const uint8_t* roots, size_t parity,
+    const uint8_t* rows, size_t count, uint8_t* syndromes) {
+    for (size_t j = 0; j < count; ++j) {
+        const __m256i row = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(rows + j * ROW));
+        for (size_t i = 0; i < parity; ++i) {
+            __m256i* s = reinterpret_cast<__m256i*>(syndromes + i * ROW);
+            _mm256_storeu_si256(s, _mm256_xor_si256(row,
+                mul_avx2(roots + i * TABLE_SIZE, _mm256_loadu_si256(s))));
+        }
+    }
+}
+#endif
+
+struct RowKernels {
+    EncodeRows encode;
+    SyndromeRows syndromes;
+};
+
+static RowKernels pick_row_kernels() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {encode_rows_avx2, syndrome_rows_avx2};
+    } else if (__builtin_cpu_supports("ssse3")) {
+        return {encode_rows_ssse3, syndrome_rows_ssse3};
+    }
+#endif
+    return {encode_rows_scalar, syndrome_rows_scalar};
+}
+
+static const RowKernels row_kernels = pick_row_kernels();
+
+ReedSolomon::ReedSolomon(size_t parity_bytes) : parity(parity_bytes) {
+    if (parity < 1 || parity > MAX_PARITY) {
+        throw std::runtime_error(
+            "Error correction must be 1 to 128 parity bytes!\n");
+    }
+    // g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(parity - 1)).
+    std::vector<uint8_t> g(parity + 1, 0);
+    g[0] = 1;
+    for (size_t i = 0; i < parity; ++i) {
+        const uint8_t root = gf_pow_alpha(static_cast<int>(i));
+        for (size_t k = i + 1; k > 0; --k) {
+            g[k] = g[k - 1] ^ gf_mul(g[k], root);
+        }
+        g[0] = gf_mul(g[0], root);
+        add_table(root, roots);
+    }
+    // g[k] is the coefficient of x^k; the shift register wants them
+    // from x^(parity - 1) down, the leading 1 left out.
+    for (size_t i = 0; i < parity; ++i) {
+        add_table(g[parity - 1 - i], generator);
+    }
+}
+
+size_t ReedSolomon::group_data() const {
+    return (CODEWORD_SIZE - parity) * INTERLEAVE;
+}
+
+size_t ReedSolomon::encoded_size(size_t size) const {
+    const size_t groups = size / group_data();
+    const size_t rest = size % group_data();
+    size_t encoded = groups * CODEWORD_SIZE * INTERLEAVE;
+    if (rest > 0) {
+        encoded += ((rest + ROW - 1) / ROW + parity) * ROW;
+    }
+    return encoded;
+}
+
+void ReedSolomon::encode(const uint8_t* data, size_t size,
+    uint8_t* out) const {
+    const size_t rows = (size + ROW - 1) / ROW;
+    std::memcpy(out, data, size);
+    // Zero the padding of the last data row and the parity rows.
+    std::fill(out + size, out + (rows + parity) * ROW, 0);
+    row_kernels.encode(generator.data(), parity, out, rows,
+        out + rows * ROW);
+}
+
+size_t ReedSolomon::decode(uint8_t* group, size_t size) const {
+    const size_t rows = (size + ROW - 1) / ROW + parity;
+    uint8_t syndromes[MAX_PARITY * ROW] = {0};
+    row_kernels.syndromes(roots.data(), parity, group, rows, syndromes);
+    size_t corrected = 0;
+    for (size_t column = 0; column < ROW; ++column) {
+        for (size_t i = 0; i < parity; ++i) {
+            if (syndromes[i * ROW + column] != 0) {
+                corrected += correct(group, rows, column, syndromes);
+                break;
+            }
+        }
+    }
+    return corrected;
+}
+
+/*
+Berlekamp-Massey finds the error locator, a Chien search its roots
+(the error positions), and Forney's formula the error values.
+*/
+size_t ReedSolomon::correct(uint8_t* group, size_t rows, size_t column,
+    const uint8_t* syndromes) const {
+    const std::runtime_error too_many(
+        "Message has too many errors to correct!\n");
+    uint8_t s[MAX_PARITY];
+    for (size_t i = 0; i < parity; ++i) {
+        s[i] = syndromes[i * ROW + column];
+    }
+    // Error locator lambda, and the copy of it from the last length change.
+    uint8_t lambda[MAX_PARITY + 1] = {1};
+    uint8_t previous[MAX_PARITY + 1] = {1};
+    size_t errors = 0;
+    size_t shift = 1;
+    uint8_t previous_discrepancy = 1;
+    for (size_t n = 0; n < parity; ++n) {
+        uint8_t discrepancy = s[n];
+        for (size_t i = 1; i <= errors; ++i) {
+            discrepancy ^= gf_mul(lambda[i], s[n - i]);
+        }
+        if (discrepancy == 0) {
+            ++shift;
+            continue;
+        }
+        const uint8_t scale = gf_div(discrepancy, previous_discrepancy);
+        uint8_t saved[MAX_PARITY + 1];
+        std::copy(lambda, lambda + parity + 1, saved);
+        for (size_t i = 0; i + shift <= parity; ++i) {
+            lambda[i + shift] ^= gf_mul(scale, previous[i]);
+        }
+        if (2 * errors <= n) {
+            errors = n + 1 - errors;
+            std::copy(saved, saved + parity + 1, previous);
+            previous_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            ++shift;
+        }
+    }
+    if (2 * errors > parity) {
+        throw too_many;
+    }
+    // Error evaluator omega = s * lambda mod x^parity.
+    uint8_t omega[MAX_PARITY];
+    for (size_t k = 0; k < parity; ++k) {
+        omega[k] = 0;
+        for (size_t i = 0; i <= std::min(k, errors); ++i) {
+            omega[k] ^= gf_mul(lambda[i], s[k - i]);
+        }
+    }
+    size_t found = 0;
+    for (size_t j = 0; j < rows; ++j) {
+        // Byte j is the coefficient of x^(rows - 1 - j).
+        const int power = static_cast<int>(rows - 1 - j);
+        const uint8_t x_inverse = gf_pow_alpha(-power);
+        uint8_t value = 0;
+        uint8_t derivative = 0;
+        uint8_t x_power = 1;
+        for (size_t i = 0; i <= errors; ++i) {
+            const uint8_t term = gf_mul(lambda[i], x_power);
+            value ^= term;
+            if (i & 1) {
+                // Odd terms of lambda, over x, make up its derivative.
+                derivative ^= gf_mul(lambda[i], gf_div(x_power, x_inverse));
+            }
+            x_power = gf_mul(x_power, x_inverse);
+        }
+        if (value != 0) {
+            continue;
+        }
+        uint8_t numerator = 0;
+        x_power = 1;
+        for (size_t k = 0; k < parity; ++k) {
+            numerator ^= gf_mul(omega[k], x_power);
+            x_power = gf_mul(x_power, x_inverse);
+        }
+        if (derivative == 0) {
+            throw too_many;
+        }
+        group[j * ROW + column] ^= gf_mul(gf_pow_alpha(power),
+            gf_div(numerator, derivative));
+        ++found;
+    }
+    if (found != errors) {
+        throw too_many;
+    }
+    return found;
+}
@@ -0,0 +1,81 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+reed_solomon.h
+
+Reed-Solomon error correction over GF(2^8), so a message survives
+a few pixels of its carrier being touched.
+
+Data is coded in groups of INTERLEAVE codewords of up to 255 bytes
+each, parity of them parity bytes, which can correct up to parity / 2
+damaged bytes per codeword. A group is laid out as rows of INTERLEAVE
+bytes, one byte from each codeword: the data rows first, so the data
+is simply the first bytes of the group, then the parity rows. A run
+of damaged bytes in the image is therefore spread over all of the
+group's codewords instead of landing in one of them. The last group
+of a message is shortened to as many data rows as it needs.
+
+Since a row holds one byte of every codeword, encoding and checking
+work on whole rows at once. Multiplying a row by a constant is two
+16 entry table lookups per byte, one per nibble, which SSSE3 and AVX2
+do for 16 or 32 bytes at a time with a byte shuffle; other processors
+use the same tables a byte at a time. Only codewords that actually
+have errors go on to the (scalar, log table based) correction.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef REED_SOLOMON_H_
+#define REED_SOLOMON_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ReedSolomon {
+ private:
+    size_t parity;
+    /*
+    Products of every nibble with each generator coefficient, highest
+    degree first, then with each root of the generator: 32 bytes per
+    constant, the 16 low nibble products then the 16 high nibble ones.
+    */
+    std::vector<uint8_t> generator;
+    std::vector<uint8_t> roots;
+
+    /*
+    Corrects codeword column of a group with rows rows, given its
+    syndromes. Returns how many bytes were corrected, or throws
+    std::runtime_error if there are too many errors.
+    */
+    size_t correct(uint8_t* group, size_t rows, size_t column,
+        const uint8_t* syndromes) const;
+
+ public:
+    // Bytes in a whole codeword, data and parity.
+    static const size_t CODEWORD_SIZE = 255;
+    // Codewords coded side by side in a group.
+    static const size_t INTERLEAVE = 32;
+    // Most parity bytes per codeword.
+    static const size_t MAX_PARITY = 128;
+
+    // Throws std::runtime_error unless 1 <= parity_bytes <= MAX_PARITY.
+    explicit ReedSolomon(size_t parity_bytes);
+    // Data bytes a whole group holds.
+    size_t group_data() const;
+    // Bytes the groups coding size bytes of data take up.
+    size_t encoded_size(size_t size) const;
+    /*
+    Codes size bytes of data, at most group_data(), into one group of
+    encoded_size(size) bytes at out.
+    */
+    void encode(const uint8_t* data, size_t size, uint8_t* out) const;
+    /*
+    Checks and corrects, in place, one group coding size bytes of data,
+    which are then its first size bytes. Returns how many bytes were
+    corrected; throws std::runtime_error if there were too many errors.
+    */
+    size_t decode(uint8_t* group, size_t size) const;
+};
+
+#endif  // REED_SOLOMON_H_
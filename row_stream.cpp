@@ -0,0 +1,88 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+row_stream.cpp
+
+Picks the streamed format for an input image. See row_stream.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "row_stream.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "netpbm.h"
+#include "png.h"
+
+/*
+"P5" and "P6" are binary Netpbm images, and PNG images
+start with "\x89PNG". Anything else isn't streamed.
+*/
+std::unique_ptr<RowReader> RowReader::open(const char* filename) {
+    std::ifstream probe(filename, std::ios::binary);
+    char magic[4] = {0, 0, 0, 0};
+    probe.read(magic, 4);
+    probe.close();
+    if (magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6')) {
+        return std::make_unique<NetpbmReader>(filename);
+    } else if (std::memcmp(magic, "\x89PNG", 4) == 0) {
+#ifdef EASYLSB_HAVE_ZLIB
+        return std::make_unique<PngReader>(filename);
+#else
+        throw std::runtime_error("PNG support requires zlib!\n");
+#endif
+    }
+    return nullptr;
+}
+
+size_t RowReader::skip_rows(size_t count) {
+    const size_t batch = std::max<size_t>(1, (1 << 16) / row_bytes());
+    std::vector<uint8_t> scratch(std::min(count, batch) * row_bytes());
+    size_t skipped = 0;
+    while (skipped < count) {
+        const size_t n = read_rows(scratch.data(),
+            std::min(count - skipped, batch));
+        if (n == 0) {
+            break;
+        }
+        skipped += n;
+    }
+    return skipped;
+}
+
+RowCursor::RowCursor(const char* filename, size_t chunk_bytes)
+    : filename(filename), source(RowReader::open(filename)),
+    rows_per_chunk(std::max<size_t>(1, chunk_bytes / source->row_bytes())),
+    chunk(rows_per_chunk * source->row_bytes()), chunk_first(0),
+    chunk_rows(0) {}
+
+RowReader& RowCursor::reader() {
+    return *source;
+}
+
+/*
+A chunk is read starting at the row asked for, so reading rows in
+order reads each one once, and a row far ahead costs a skip. The
+readers throw if the image is cut short, so a row past the end of
+the image is the only way to come up empty.
+*/
+const uint8_t* RowCursor::row(size_t row) {
+    if (row < chunk_first) {
+        source = RowReader::open(filename);
+        chunk_first = 0;
+        chunk_rows = 0;
+    }
+    if (row >= chunk_first + chunk_rows) {
+        source->skip_rows(row - (chunk_first + chunk_rows));
+        chunk_first = row;
+        chunk_rows = source->read_rows(chunk.data(), rows_per_chunk);
+        if (chunk_rows == 0) {
+            throw std::runtime_error("Row is outside the image!\n");
+        }
+    }
+    return chunk.data() + (row - chunk_first) * source->row_bytes();
+}
@@ -0,0 +1,111 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+row_stream.h
+
+Carriers that are streamed a few rows at a time instead of being
+loaded whole. A RowReader hands out raw sample bytes in EasyLSB's
+traversal order (top-down, samples of a pixel in R, G, B order, 16
+bit samples most significant byte first), the embed kernel in
+lsb_kernel.h runs over them in place, and the RowWriter made by the
+reader writes them back out in the same format.
+
+Netpbm (netpbm.h) and PNG (png.h) images are streamed this way.
+A RowCursor reads rows by number instead, skipping the ones that
+aren't needed, which seeks in a Netpbm image and still has to
+inflate them in a PNG image.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef ROW_STREAM_H_
+#define ROW_STREAM_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "lsb_kernel.h"
+#include "output_file.h"
+
+class RowWriter {
+ public:
+    virtual ~RowWriter() = default;
+    // Appends count rows of raw samples, row_bytes() each.
+    virtual void write_rows(const uint8_t* buffer, size_t count) = 0;
+    // Finishes the file and checks that everything made it to disk.
+    virtual void close() = 0;
+};
+
+class RowReader {
+ public:
+    virtual ~RowReader() = default;
+    virtual size_t rows() const = 0;
+    // Channels (samples) in one row.
+    virtual size_t row_channels() const = 0;
+    // 1, or 2 for 16 bit samples.
+    virtual size_t bytes_per_sample() const = 0;
+    // Usable bit planes per channel.
+    virtual size_t channel_bits() const = 0;
+    /*
+    Reads up to count rows into buffer, which must hold
+    count * row_bytes() bytes. Returns the number of rows read,
+    which is only less than count at the end of the image.
+    */
+    virtual size_t read_rows(uint8_t* buffer, size_t count) = 0;
+    /*
+    Moves past up to count rows without handing them out, and returns
+    how many that was. Reads them into a scratch buffer, unless the
+    format can seek past them.
+    */
+    virtual size_t skip_rows(size_t count);
+    /*
+    Creates filename as an image in the same format, ready to
+    take the rows read from this reader.
+    */
+    virtual std::unique_ptr<RowWriter> create_writer(const char* filename,
+        const OutputOptions& options) = 0;
+
+    size_t num_channels() const {
+        return row_channels() * rows();
+    }
+    size_t row_bytes() const {
+        return row_channels() * bytes_per_sample();
+    }
+    // The kernel's view of a stream_bits long stream in this image.
+    StreamLayout stream_layout(size_t stream_bits) const {
+        return {num_channels(), channel_bits(), bytes_per_sample(),
+            false, false, stream_bits};
+    }
+    /*
+    Opens filename if it is in a streamed format,
+    chosen by its magic bytes. Returns nullptr otherwise.
+    */
+    static std::unique_ptr<RowReader> open(const char* filename);
+};
+
+/*
+Rows of a streamed image by number, for reading parts of it that
+are mostly in order. Rows ahead of the ones at hand are skipped over
+(see RowReader::skip_rows()), and rows behind them are got back by
+opening the image again.
+*/
+class RowCursor {
+ private:
+    const char* filename;
+    std::unique_ptr<RowReader> source;
+    size_t rows_per_chunk;
+    std::vector<uint8_t> chunk;
+    // Rows [chunk_first, chunk_first + chunk_rows) are in chunk.
+    size_t chunk_first;
+    size_t chunk_rows;
+
+ public:
+    // Reads filename, a streamed image, about chunk_bytes at a time.
+    RowCursor(const char* filename, size_t chunk_bytes);
+    RowReader& reader();
+    // Samples of row row, valid until the next call.
+    const uint8_t* row(size_t row);
+};
+
+#endif  // ROW_STREAM_H_
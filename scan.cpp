@@ -0,0 +1,328 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+scan.cpp
+
+Parallel scanning of a directory tree for messages. See scan.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "scan.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "EasyLSB.h"
+#include "carrier.h"
+#include "file_reader.h"
+#include "lsb_kernel.h"
+#include "work_stealing_pool.h"
+
+namespace fs = std::filesystem;
+
+// Bits of the longest header.
+static const size_t HEADER_BITS = PayloadHeader::MAX_SIZE * 8;
+/*
+Channels holding the longest header, rounded up to whole pixels: the
+kernel takes a bitmap's channels a pixel at a time.
+*/
+static const size_t HEADER_CHANNELS = (HEADER_BITS + 2) / 3 * 3;
+/*
+Bytes read at a time: enough for the headers and the first rows of
+any bitmap, or for the header channels of one however wide it is.
+*/
+static const size_t PROBE_BYTES = 4096;
+// Files each probing task reads at once.
+static const size_t PROBE_WINDOW = 64;
+
+// A file that holds a message header, or a header this can't read.
+struct Hit {
+    std::string path;
+    PayloadHeader header;
+    // Empty if the message decoded.
+    std::string error;
+    size_t bytes = 0;
+    std::string output;
+};
+
+// Where to read the header channels of a bitmap from.
+struct HeaderRange {
+    size_t offset;
+    size_t size;
+};
+
+static bool is_bitmap_name(const fs::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+    return extension == ".bmp";
+}
+
+/*
+Adds the bitmaps in dir to files, and walks its subdirectories as
+tasks of their own. Only the type readdir() returns is looked at, so
+walking costs no system call per file; symbolic links aren't followed,
+and directories that can't be read are skipped.
+*/
+static void walk(WorkStealingPool* pool, const fs::path& dir,
+    std::mutex* mutex, std::vector<std::string>* files) {
+    std::vector<fs::path> subdirs;
+    std::vector<std::string> found;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir,
+        fs::directory_options::skip_permission_denied, ec), end;
+        !ec && it != end; it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        if (entry.is_symlink(ec)) {
+            continue;
+        } else if (entry.is_directory(ec)) {
+            subdirs.push_back(entry.path());
+        } else if (is_bitmap_name(entry.path()) &&
+            entry.is_regular_file(ec)) {
+            found.push_back(entry.path().string());
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(*mutex);
+        files->insert(files->end(), found.begin(), found.end());
+    }
+    pool->run(subdirs.size(), [&](size_t i) {
+        walk(pool, subdirs[i], mutex, files);
+    });
+}
+
+/*
+Traversal rows [0, rows) are stored next to each other, at the end of
+the pixel array for a bottom-up bitmap, so the header channels are in
+one range of the file. Unless a row is wider than the header, only the
+part of the first row holding them is needed.
+*/
+static HeaderRange header_range(const RasterLayout& raster, size_t* rows) {
+    const size_t channels = std::min(raster.num_channels(), HEADER_CHANNELS);
+    *rows = (channels + raster.row_channels - 1) / raster.row_channels;
+    if (*rows == 1) {
+        return {raster.row_offset(0), channels * raster.bytes_per_sample};
+    }
+    return {raster.row_offset(raster.bottom_up ? *rows - 1 : 0),
+        *rows * raster.stride};
+}
+
+/*
+Extracts the first bits of the stream from the header channels, the
+range of the file at data, and parses them as a header. A header has
+to fit in the image along with what it says follows it. Throws
+std::runtime_error for a header from a newer version.
+*/
+static bool probe(const RasterLayout& raster, const HeaderRange& range,
+    size_t rows, const uint8_t* data, PayloadHeader* header) {
+    const size_t capacity = raster.num_channels() * raster.channel_bits;
+    StreamLayout layout =
+        raster.stream_layout(std::min(HEADER_BITS, capacity) / 8 * 8);
+    uint8_t prefix[PayloadHeader::MAX_SIZE] = {0};
+    const size_t channels = std::min(raster.num_channels(), HEADER_CHANNELS);
+    for (size_t r = 0; r < rows; ++r) {
+        const size_t first = r * raster.row_channels;
+        extract_samples(data + (raster.row_offset(r) - range.offset), first,
+            std::min(raster.row_channels, channels - first), layout, prefix);
+    }
+    return PayloadHeader::parse(prefix, layout.stream_bits / 8, header) &&
+        header->stream_size() * 8 <= capacity;
+}
+
+/*
+Probes a window of files: every file's start is read at once, which
+holds the bitmap headers and, for a small or top-down bitmap, the
+header channels too; the header channels of the rest are read at
+once after that. A file that isn't a supported bitmap is no hit.
+Each thread keeps one reader, and its ring and buffers, for every
+window it probes.
+*/
+static void probe_window(const std::vector<std::string>& paths,
+    std::mutex* mutex, std::vector<Hit>* hits) {
+    static thread_local FileReader reader(PROBE_WINDOW, PROBE_BYTES);
+    std::vector<Hit> found;
+    auto check = [&](size_t i, const RasterLayout& raster,
+        const HeaderRange& range, size_t rows, const uint8_t* data) {
+        Hit hit;
+        hit.path = paths[i];
+        try {
+            if (!probe(raster, range, rows, data, &hit.header)) {
+                return;
+            }
+        } catch (const std::runtime_error& e) {
+            hit.error = e.what();
+        }
+        found.push_back(hit);
+    };
+    std::vector<std::string> later;
+    std::vector<size_t> offsets;
+    struct Pending {
+        size_t file;
+        RasterLayout raster;
+        HeaderRange range;
+        size_t rows;
+    };
+    std::vector<Pending> pending;
+    reader.read(paths, [&](size_t i, const uint8_t* data, size_t size,
+        int error) {
+        if (error) {
+            return;
+        }
+        RasterLayout raster;
+        try {
+            /*
+            Without the whole file its size isn't known; a truncated
+            bitmap is caught when a hit is decoded.
+            */
+            raster = Carrier::parse_bitmap(data, size, size < PROBE_BYTES ?
+                size : std::numeric_limits<size_t>::max() / 2);
+        } catch (const std::runtime_error&) {
+            return;
+        }
+        size_t rows;
+        const HeaderRange range = header_range(raster, &rows);
+        if (range.offset + range.size <= size) {
+            check(i, raster, range, rows, data + range.offset);
+        } else if (range.size <= PROBE_BYTES) {
+            later.push_back(paths[i]);
+            offsets.push_back(range.offset);
+            pending.push_back({i, raster, range, rows});
+        }
+    });
+    reader.read(later, offsets, [&](size_t i, const uint8_t* data,
+        size_t size, int error) {
+        const Pending& p = pending[i];
+        if (!error && size >= p.range.size) {
+            check(p.file, p.raster, p.range, p.rows, data);
+        }
+    });
+    std::lock_guard<std::mutex> lock(*mutex);
+    hits->insert(hits->end(), found.begin(), found.end());
+}
+
+// Decodes a hit, and writes the message under extract_to if set.
+static void decode_hit(const std::string& root, const std::string& extract_to,
+    const PayloadOptions& options, Hit* hit) {
+    try {
+        EasyLSB unsteg(hit->path.c_str());
+        unsteg.set_payload_options(options);
+        unsteg.decode();
+        hit->bytes = unsteg.message().size();
+        if (extract_to.empty()) {
+            return;
+        }
+        const fs::path output = fs::path(extract_to) /
+            (fs::relative(hit->path, root).string() + ".msg");
+        fs::create_directories(output.parent_path());
+        std::ofstream out(output, std::ios::binary);
+        out.write(unsteg.message().data(),
+            static_cast<std::streamsize>(unsteg.message().size()));
+        if (!out.flush()) {
+            throw std::runtime_error("Cannot write message file!\n");
+        }
+        hit->output = output.string();
+    } catch (const std::exception& e) {
+        hit->error = e.what();
+    }
+}
+
+// s as a JSON string, quotes included.
+static std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (const char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static void write_hit(const Hit& hit, std::ostream& report) {
+    std::string error = hit.error;
+    if (!error.empty() && error.back() == '\n') {
+        error.pop_back();
+    }
+    const uint8_t flags = hit.header.flags;
+    report << "{\"path\": " << json_string(hit.path) <<
+        ", \"version\": " << static_cast<int>(hit.header.version) <<
+        ", \"stream_bytes\": " << hit.header.stream_size() <<
+        ", \"compressed\": " <<
+        ((flags & PAYLOAD_COMPRESSED) ? "true" : "false") <<
+        ", \"encrypted\": " <<
+        ((flags & PAYLOAD_ENCRYPTED) ? "true" : "false") <<
+        ", \"error_correction\": " <<
+        ((flags & PAYLOAD_ECC) ? "true" : "false") <<
+        ", \"archive\": " << ((flags & PAYLOAD_ARCHIVE) ? "true" : "false") <<
+        ", \"shard\": " << ((flags & PAYLOAD_SHARD) ? "true" : "false");
+    if (error.empty()) {
+        report << ", \"message_bytes\": " << hit.bytes;
+        if (!hit.output.empty()) {
+            report << ", \"output\": " << json_string(hit.output);
+        }
+    } else {
+        report << ", \"error\": " << json_string(error);
+    }
+    report << "}\n";
+}
+
+/*
+Walking, probing and decoding run one after the other, each spread
+over the whole pool: the tree is usually walked long before the first
+window could be probed anyway, and hits are few.
+*/
+ScanReport scan(const std::string& root, const std::string& extract_to,
+    const PayloadOptions& options, std::ostream& report, size_t threads) {
+    const auto start = std::chrono::steady_clock::now();
+    std::error_code ec;
+    if (!fs::is_directory(root, ec)) {
+        throw std::runtime_error("Cannot read directory!\n");
+    }
+    WorkStealingPool pool(threads);
+    std::mutex mutex;
+    std::vector<std::string> files;
+    pool.run(1, [&](size_t) { walk(&pool, root, &mutex, &files); });
+    std::vector<Hit> hits;
+    const size_t windows = (files.size() + PROBE_WINDOW - 1) / PROBE_WINDOW;
+    pool.run(windows, [&](size_t w) {
+        const size_t first = w * PROBE_WINDOW;
+        const std::vector<std::string> paths(files.begin() + first,
+            files.begin() + std::min(files.size(), first + PROBE_WINDOW));
+        probe_window(paths, &mutex, &hits);
+    });
+    std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) {
+        return a.path < b.path;
+    });
+    pool.run(hits.size(), [&](size_t i) {
+        if (hits[i].error.empty()) {
+            decode_hit(root, extract_to, options, &hits[i]);
+        }
+    });
+    ScanReport result;
+    result.bitmaps = files.size();
+    result.found = hits.size();
+    for (const Hit& hit : hits) {
+        write_hit(hit, report);
+        if (hit.error.empty()) {
+            ++result.decoded;
+        }
+    }
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+}
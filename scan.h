@@ -0,0 +1,60 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+scan.h
+
+Sweeping a whole archive of images for the messages hidden in them.
+
+The directory tree is walked in parallel on a work stealing pool
+(work_stealing_pool.h), each directory a task that adds its
+subdirectories as tasks of their own, and every file named *.bmp is
+probed. Probing reads only the bitmap's headers and the first few
+hundred channels, where a message's header would be, with two small
+reads at most, and a window of files is probed at once through a
+FileReader (file_reader.h), so with io_uring there are dozens of
+reads in flight per worker. A file whose channels hold a header that
+parses and fits the image is a hit, and only hits are read any
+further: each is decoded in full, which checks its checksum (and
+decrypts it, given the passphrase), and the message can be extracted
+to a file of its own.
+
+Only bitmaps, and messages embedded in the usual order, are found: a
+scattered message could be anywhere in the image, and a message from
+a version before the header has nothing to tell it by.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+#include "payload.h"
+
+struct ScanReport {
+    // Seconds the whole scan took.
+    double seconds = 0;
+    // Files probed, and those that held a message header.
+    size_t bitmaps = 0;
+    size_t found = 0;
+    // Hits that decoded, checksum and all.
+    size_t decoded = 0;
+};
+
+/*
+Scans every bitmap under the directory root, on threads workers (one
+per processor if 0), decoding the messages found with options. Writes
+a JSON object to report for each hit, one to a line, in order of path:
+the image's path, what its header says, and either the message's
+length or the error decoding it failed with. If extract_to isn't
+empty, each message decoded is written under that directory, at the
+image's path relative to root with ".msg" added. Throws
+std::runtime_error if root isn't a directory that can be read.
+*/
+ScanReport scan(const std::string& root, const std::string& extract_to,
+    const PayloadOptions& options, std::ostream& report, size_t threads = 0);
+
+#endif  // SCAN_H_
@@ -0,0 +1,143 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+shard.cpp
+
+Messages split over several images. See shard.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "shard.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include "EasyLSB.h"
+#include "crypto.h"
+#include "thread_pool.h"
+
+static const size_t BITS_PER_BYTE = 8;
+// Shards in a set are counted in 2 bytes of the header.
+static const size_t MAX_SHARDS = 65535;
+
+/*
+Splits total bytes in proportion to room, the bytes of stream each
+image has space for, rounding down and then handing out what is left
+to the images with space to spare.
+*/
+static std::vector<size_t> shard_sizes(size_t total,
+    const std::vector<size_t>& room) {
+    size_t sum = 0;
+    for (size_t r : room) {
+        sum += r;
+    }
+    if (total > sum) {
+        throw std::runtime_error(
+            "Images are not large enough to hold message!\n");
+    }
+    std::vector<size_t> sizes(room.size(), 0);
+    size_t assigned = 0;
+    for (size_t i = 0; i < room.size() && sum > 0; ++i) {
+        sizes[i] = std::min(room[i], static_cast<size_t>(
+            static_cast<double>(total) * room[i] / sum));
+        assigned += sizes[i];
+    }
+    for (size_t i = 0; i < room.size() && assigned < total; ++i) {
+        const size_t extra = std::min(room[i] - sizes[i], total - assigned);
+        sizes[i] += extra;
+        assigned += extra;
+    }
+    return sizes;
+}
+
+/*
+The stream is built whole before it is split, since how large it is
+after compressing and encrypting decides where the cuts go.
+*/
+void encode_shards(const std::string& message,
+    const std::vector<std::pair<const char*, const char*>>& images,
+    const PayloadOptions& options, const OutputOptions& output_options) {
+    if (images.empty() || images.size() > MAX_SHARDS) {
+        throw std::runtime_error("Sharding needs 1 to 65535 images!\n");
+    }
+    const std::vector<uint8_t> stream = build_payload(message, options);
+    PayloadHeader shard_header;
+    shard_header.flags = PAYLOAD_SHARD;
+    ThreadPool pool;
+    std::vector<size_t> room(images.size());
+    pool.run(images.size(), [&](size_t i) {
+        const size_t capacity =
+            EasyLSB(images[i].first).capacity() / BITS_PER_BYTE;
+        room[i] = capacity > shard_header.size() ?
+            capacity - shard_header.size() : 0;
+    });
+    const std::vector<size_t> sizes = shard_sizes(stream.size(), room);
+    std::vector<size_t> offsets(images.size(), 0);
+    for (size_t i = 1; i < images.size(); ++i) {
+        offsets[i] = offsets[i - 1] + sizes[i - 1];
+    }
+    uint8_t set[4];
+    random_bytes(set, sizeof(set));
+    pool.run(images.size(), [&](size_t i) {
+        PayloadOptions shard_options;
+        shard_options.secret = options.secret;
+        shard_options.scatter = options.scatter;
+        shard_options.shard.index = static_cast<uint16_t>(i);
+        shard_options.shard.count = static_cast<uint16_t>(images.size());
+        shard_options.shard.set = static_cast<uint32_t>(set[0]) << 24 |
+            set[1] << 16 | set[2] << 8 | set[3];
+        EasyLSB steg(std::string(stream.begin() + offsets[i],
+            stream.begin() + offsets[i] + sizes[i]), images[i].first,
+            images[i].second);
+        steg.set_output_options(output_options);
+        steg.set_payload_options(shard_options);
+        steg.encode();
+    });
+}
+
+std::string decode_shards(const std::vector<const char*>& images,
+    const PayloadOptions& options) {
+    std::vector<std::string> pieces(images.size());
+    std::vector<ShardInfo> shards(images.size());
+    ThreadPool pool;
+    pool.run(images.size(), [&](size_t i) {
+        PayloadOptions shard_options;
+        shard_options.secret = options.secret;
+        shard_options.scatter = options.scatter;
+        shard_options.shard.count = 1;
+        EasyLSB unsteg(images[i]);
+        unsteg.set_payload_options(shard_options);
+        unsteg.decode();
+        pieces[i] = unsteg.message();
+        shards[i] = unsteg.decoded_header().shard;
+    });
+    // Image holding each shard, by index.
+    std::vector<size_t> order(images.size(), SIZE_MAX);
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (shards[i].count != images.size() ||
+            shards[i].set != shards[0].set ||
+            order[shards[i].index] != SIZE_MAX) {
+            throw std::runtime_error(
+                "Images don't hold one whole set of shards!\n");
+        }
+        order[shards[i].index] = i;
+    }
+    std::vector<uint8_t> stream;
+    for (size_t i : order) {
+        stream.insert(stream.end(), pieces[i].begin(), pieces[i].end());
+    }
+    PayloadHeader header;
+    if (!PayloadHeader::parse(stream.data(), stream.size(), &header) ||
+        header.stream_size() != stream.size()) {
+        throw std::runtime_error("Message is damaged!\n");
+    }
+    PayloadOptions message_options = options;
+    message_options.shard = ShardInfo();
+    return read_payload(header, message_options,
+        [&stream](size_t offset, uint8_t* data, size_t size) {
+        std::copy(stream.begin() + offset, stream.begin() + offset + size,
+            data);
+    });
+}
@@ -0,0 +1,52 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+shard.h
+
+A message too large for one image, split over several.
+
+The message is turned into a stream (header and payload, compressed,
+encrypted and error corrected as asked) as usual, and the stream is
+cut into one shard per image, each in proportion to how much its
+image holds, so every image is changed about as much as the others.
+Each shard is embedded as a message of its own, with a header
+(payload.h) saying which shard of how many it is and which set it
+belongs to, and with its own checksum. The shards are embedded, and
+decoded, in parallel on a thread pool (thread_pool.h), one image per
+task.
+
+Decoding takes the images in any order, puts the shards back in
+order by their index, and decodes the stream they make up like any
+other, so a missing, repeated or foreign shard is reported rather
+than turned into a damaged message.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "output_file.h"
+#include "payload.h"
+
+/*
+Encodes message over images, pairs of input and output file names.
+options.secret also keys the order of a scattered shard. Throws
+std::runtime_error if the images can't hold the message between them.
+*/
+void encode_shards(const std::string& message,
+    const std::vector<std::pair<const char*, const char*>>& images,
+    const PayloadOptions& options, const OutputOptions& output_options);
+
+/*
+The message split over images, given in any order. Throws
+std::runtime_error if they don't hold exactly one whole set of shards.
+*/
+std::string decode_shards(const std::vector<const char*>& images,
+    const PayloadOptions& options);
+
+#endif  // SHARD_H_
@@ -0,0 +1,92 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+thread_pool.cpp
+
+Worker threads running batches of tasks. See thread_pool.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads)
+    : task(nullptr), count(0), next(0), done(0), stopping(false) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+void ThreadPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_ready.wait(lock, [this] {
+            return stopping || (task && next < count);
+        });
+        if (stopping) {
+            return;
+        }
+        const size_t item = next++;
+        const std::function<void(size_t)>& run_item = *task;
+        lock.unlock();
+        std::exception_ptr failure;
+        try {
+            run_item(item);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        lock.lock();
+        if (failure) {
+            if (!error) {
+                error = failure;
+            }
+            // Skip whatever hasn't been started yet.
+            done += count - next;
+            next = count;
+        }
+        if (++done == count) {
+            work_done.notify_all();
+        }
+    }
+}
+
+void ThreadPool::run(size_t items, const std::function<void(size_t)>& job) {
+    if (items == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    task = &job;
+    count = items;
+    next = 0;
+    done = 0;
+    error = nullptr;
+    work_ready.notify_all();
+    work_done.wait(lock, [this] { return done == count; });
+    task = nullptr;
+    if (error) {
+        std::exception_ptr failure = error;
+        error = nullptr;
+        lock.unlock();
+        std::rethrow_exception(failure);
+    }
+}
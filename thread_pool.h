@@ -0,0 +1,62 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+thread_pool.h
+
+A fixed set of worker threads for running many independent jobs,
+such as embedding each shard of a message into its own image.
+
+Unlike the pipeline (pipeline.h), where every stage is a different
+transform running on its own thread, the pool runs the same task over
+a batch of items, as many at a time as there are threads.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+ private:
+    std::mutex mutex;
+    // Signalled when there is a batch to work on, or the pool stops.
+    std::condition_variable work_ready;
+    // Signalled when the last item of a batch is done.
+    std::condition_variable work_done;
+    std::vector<std::thread> workers;
+    // The batch being run, nullptr between batches.
+    const std::function<void(size_t)>* task;
+    size_t count;
+    // Items handed out, and items done, so far.
+    size_t next;
+    size_t done;
+    // The first exception an item threw.
+    std::exception_ptr error;
+    bool stopping;
+
+    void work();
+
+ public:
+    // Starts threads workers, or one per processor if threads is 0.
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    size_t size() const;
+    /*
+    Runs job(0) to job(items - 1) on the workers, and returns once
+    they are all done. Once one of them throws, no more are started,
+    and the exception is rethrown here. One batch runs at a time.
+    */
+    void run(size_t items, const std::function<void(size_t)>& job);
+};
+
+#endif  // THREAD_POOL_H_
@@ -0,0 +1,180 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+work_stealing_pool.cpp
+
+Worker threads stealing tasks from each other. See work_stealing_pool.h.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+// The pool the current thread is a worker of, if any, and which worker.
+static thread_local WorkStealingPool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+    : queued(0), stopping(false) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(&WorkStealingPool::work, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+size_t WorkStealingPool::size() const {
+    return workers.size();
+}
+
+/*
+Tasks are counted in queued only once they are on a queue, and taken
+off the count only once they are off it, so a worker that wakes up to
+find the queues empty after all just goes back to sleep.
+*/
+void WorkStealingPool::work(size_t index) {
+    current_pool = this;
+    current_worker = index;
+    Task task;
+    while (true) {
+        if (take(index, &task)) {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+bool WorkStealingPool::take(size_t self, Task* task) {
+    const size_t count = queues.size();
+    if (self < count) {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            *task = own.tasks.back();
+            own.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+    for (size_t i = 1; i <= count; ++i) {
+        const size_t victim = (self + i) % count;
+        if (victim == self) {
+            continue;
+        }
+        Queue& other = *queues[victim];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.tasks.empty()) {
+            *task = other.tasks.front();
+            other.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+pending is only decremented with the batch's mutex held, so once the
+thread waiting on the batch has seen it reach 0 and taken the mutex,
+nothing touches the batch again, and it can go out of scope.
+*/
+void WorkStealingPool::execute(const Task& task) {
+    Batch& batch = *task.batch;
+    std::exception_ptr failure;
+    if (!batch.failed) {
+        try {
+            (*batch.job)(task.item);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+    }
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    if (failure) {
+        if (!batch.error) {
+            batch.error = failure;
+        }
+        batch.failed = true;
+    }
+    if (--batch.pending == 0) {
+        batch.done.notify_all();
+    }
+}
+
+void WorkStealingPool::signal(size_t count) {
+    {
+        // So a worker can't miss the wake up between checking and waiting.
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+    }
+    if (count == 1) {
+        wake.notify_one();
+    } else {
+        wake.notify_all();
+    }
+}
+
+/*
+From outside the pool, the items are dealt out over every worker's
+queue and the caller sleeps until they are done. From a worker, they
+go on the back of its own queue, to be stolen by idle workers, and it
+keeps taking tasks itself until the batch is done, yielding when there
+is nothing left to take but items still running elsewhere.
+*/
+void WorkStealingPool::run(size_t items,
+    const std::function<void(size_t)>& job) {
+    if (items == 0) {
+        return;
+    }
+    Batch batch;
+    batch.job = &job;
+    batch.pending = items;
+    batch.failed = false;
+    const bool inside = current_pool == this;
+    for (size_t i = 0; i < items; ++i) {
+        Queue& queue =
+            *queues[inside ? current_worker : i % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(Task{&batch, i});
+        ++queued;
+    }
+    signal(items);
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    if (inside) {
+        Task task;
+        while (batch.pending > 0) {
+            lock.unlock();
+            if (take(current_worker, &task)) {
+                execute(task);
+            } else {
+                std::this_thread::yield();
+            }
+            lock.lock();
+        }
+    } else {
+        batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+    }
+    if (batch.error) {
+        std::rethrow_exception(batch.error);
+    }
+}
@@ -0,0 +1,98 @@
+// Copyright 2019 Jason Kim. All rights reserved.
+/*
+work_stealing_pool.h
+
+Worker threads for batches whose tasks differ wildly in size, such as
+a batch mixing thumbnails with scans a thousand times larger.
+
+Each worker has its own deque of tasks. It takes tasks off the back
+of its own deque, and once that is empty, steals them off the front
+of the other workers' deques, so no worker sits idle while another
+still has a backlog. A task can itself run a batch on the pool, such
+as the parts of one large image: those go on the back of its worker's
+deque, where idle workers steal them, and the worker runs the batch's
+tasks (or any others) itself while waiting for it to finish, so a
+nested batch never holds up a thread.
+
+Unlike ThreadPool (thread_pool.h), which hands out one batch's items
+in order, any number of batches can be running at once.
+
+The style conforms to Google's coding style guide for C++,
+and has been checked with cpplint.
+*/
+
+#ifndef WORK_STEALING_POOL_H_
+#define WORK_STEALING_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool {
+ private:
+    // One call to run().
+    struct Batch {
+        const std::function<void(size_t)>* job;
+        // Items not yet done, or skipped.
+        std::atomic<size_t> pending;
+        // Set once an item has thrown, so the rest are skipped.
+        std::atomic<bool> failed;
+        // Guards error, and decrementing pending, for the waiting thread.
+        std::mutex mutex;
+        std::condition_variable done;
+        // The first exception an item threw.
+        std::exception_ptr error;
+    };
+    struct Task {
+        Batch* batch;
+        size_t item;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    // Tasks in all the queues, for idle workers to sleep until there are.
+    std::atomic<size_t> queued;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void work(size_t index);
+    /*
+    Takes a task off the back of worker self's queue, or else steals
+    one off the front of another's. Returns false if all are empty.
+    self is past the last worker for a thread outside the pool.
+    */
+    bool take(size_t self, Task* task);
+    // Runs the task's item, unless its batch has failed.
+    void execute(const Task& task);
+    // Signals the workers that count more tasks were queued.
+    void signal(size_t count);
+
+ public:
+    // Starts threads workers, or one per processor if threads is 0.
+    explicit WorkStealingPool(size_t threads = 0);
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    size_t size() const;
+    /*
+    Runs job(0) to job(items - 1) on the workers, and returns once
+    they are all done. Once one of them throws, no more are started,
+    and the exception is rethrown here. Can be called from any thread,
+    including from a job running on the pool.
+    */
+    void run(size_t items, const std::function<void(size_t)>& job);
+};
+
+#endif  // WORK_STEALING_POOL_H_